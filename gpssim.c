@@ -1,14 +1,41 @@
 #define _CRT_SECURE_NO_DEPRECATE
 
+#ifdef __linux__
+#define _GNU_SOURCE // O_DIRECT and fallocate()
+#endif
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <math.h>
 #include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
 #ifdef _WIN32
 #include "getopt.h"
 #else
 #include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#endif
+#ifdef __linux__
+#define USE_DIRECT_IO
+#include <errno.h>
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#ifdef IORING_FEAT_RW_CUR_POS // Headers of Linux 5.6 or later, with IORING_OP_WRITE
+#define USE_IO_URING
+#endif
+#endif
+#endif
+#endif
+#if !defined(DISABLE_SIMD) && defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define USE_AVX2
+#include <immintrin.h>
+#elif !defined(DISABLE_SIMD) && defined(__aarch64__)
+#define USE_NEON
+#include <arm_neon.h>
 #endif
 #include "gpssim.h"
 
@@ -82,6 +109,9 @@ int cosTable512[] = {
 	 245, 246, 247, 247, 248, 248, 248, 249, 249, 249, 249, 250, 250, 250, 250, 250
 };
 
+// First quarter of sinTable512, of which the rest of both tables are mirrored and negated copies
+unsigned char sinQuarter128[128];
+
 // Receiver antenna attenuation in dB for boresight angle = 0:5:180 [deg]
 double ant_pat_db[37] = {
 	 0.00,  0.00,  0.22,  0.44,  0.67,  1.11,  1.56,  2.00,  2.44,  2.89,  3.56,  4.22,
@@ -92,6 +122,8 @@ double ant_pat_db[37] = {
 
 int allocatedSat[MAX_SAT];
 
+signed char caTable[MAX_SAT][CA_SEQ_LEN]; // C/A codes of all PRNs as +1/-1, shared by the channels
+
 /*! \brief Subtract two vectors of double
  *  \param[out] y Result of subtraction
  *  \param[in] x1 Minuend of subtraction
@@ -170,6 +202,27 @@ void codegen(int *ca, int prn)
 	return;
 }
 
+/*! \brief Generate the C/A codes of all PRNs into caTable
+ *
+ * The table of 32 KB is shared by all channels, so that the codes of the
+ * active channels stay in the cache.
+ */
+void initCodeTable(void)
+{
+	int ca[CA_SEQ_LEN];
+	int sv,i;
+
+	for (sv=0; sv<MAX_SAT; sv++)
+	{
+		codegen(ca, sv+1);
+
+		for (i=0; i<CA_SEQ_LEN; i++)
+			caTable[sv][i] = (signed char)(ca[i]*2-1);
+	}
+
+	return;
+}
+
 /*! \brief Convert a UTC date into a GPS date
  *  \param[in] t input date in UTC form
  *  \param[out] g output date in GPS form
@@ -369,14 +422,86 @@ void neu2azel(double *azel, const double *neu)
 	return;
 }
 
+/*! \brief Compute the receiver position and local frame
+ *  \param[out] rx Receiver frame
+ *  \param[in] xyz Receiver position in ECEF
+ */
+void initRxFrame(rxframe_t *rx, const double *xyz)
+{
+	rx->xyz[0] = xyz[0];
+	rx->xyz[1] = xyz[1];
+	rx->xyz[2] = xyz[2];
+
+	xyz2llh(xyz, rx->llh);
+	ltcmat(rx->llh, rx->tmat);
+
+	return;
+}
+
+/*! \brief Load an ephemeris into a slot of the satellite batch
+ *  \param ss Satellite batch
+ *  \param[in] i Slot index
+ *  \param[in] eph Ephemeris, NULL to clear the slot
+ */
+void setSatEphemeris(satstate_t *ss, int i, const ephem_t *eph)
+{
+	ss->eph[i] = eph;
+	ss->fitted[i] = 0;
+	ss->nofit[i] = 0;
+
+	if (eph==NULL)
+	{
+		ss->prn[i] = 0;
+		return;
+	}
+
+	ss->prn[i] = eph->prn;
+	ss->toe[i] = eph->toe.sec;
+	ss->toc[i] = eph->toc.sec;
+	ss->m0[i] = eph->m0;
+	ss->n0[i] = eph->n;
+	ss->ecc[i] = eph->ecc;
+	ss->sqrta[i] = eph->sqrta;
+	ss->sq1e2[i] = eph->sq1e2;
+	ss->A[i] = eph->A;
+	ss->aop[i] = eph->aop;
+	ss->cus[i] = eph->cus;
+	ss->cuc[i] = eph->cuc;
+	ss->crs[i] = eph->crs;
+	ss->crc[i] = eph->crc;
+	ss->cis[i] = eph->cis;
+	ss->cic[i] = eph->cic;
+	ss->inc0[i] = eph->inc0;
+	ss->idot[i] = eph->idot;
+	ss->omg0[i] = eph->omg0;
+	ss->omgkdot[i] = eph->omgkdot;
+	ss->af0[i] = eph->af0;
+	ss->af1[i] = eph->af1;
+	ss->af2[i] = eph->af2;
+	ss->tgd[i] = eph->tgd;
+
+	ss->saop[i] = sin(eph->aop);
+	ss->caop[i] = cos(eph->aop);
+	ss->omgt[i] = eph->omg0 - OMEGA_EARTH*eph->toe.sec;
+	ss->relk[i] = -4.442807633E-10*eph->ecc*eph->sqrta;
+
+	// Cold start
+	ss->warm[i] = 0;
+
+	return;
+}
+
 /*! \brief Compute Satellite position, velocity and clock at given time
  *  \param[in] eph Ephemeris data of the satellite
  *  \param[in] g GPS time at which position is to be computed
  *  \param[out] pos Computed position (vector)
  *  \param[out] vel Computed velocity (vector)
  *  \param[clk] clk Computed clock
+ *
+ * Reference implementation, see \ref satposBatch for the one used by the
+ * simulation.
  */
-void satpos(ephem_t eph, gpstime_t g, double *pos, double *vel, double *clk)
+void satpos(const ephem_t *eph, gpstime_t g, double *pos, double *vel, double *clk)
 {
 	// Computing Satellite Velocity using the Broadcast Ephemeris
 	// http://www.ngs.noaa.gov/gps-toolbox/bc_velo.htm
@@ -405,14 +530,14 @@ void satpos(ephem_t eph, gpstime_t g, double *pos, double *vel, double *clk)
 
 	double relativistic, OneMinusecosE, tmp;
 
-	tk = g.sec - eph.toe.sec;
+	tk = g.sec - eph->toe.sec;
 
 	if(tk>SECONDS_IN_HALF_WEEK)
 		tk -= SECONDS_IN_WEEK;
 	else if(tk<-SECONDS_IN_HALF_WEEK)
 		tk += SECONDS_IN_WEEK;
 
-	mk = eph.m0 + eph.n*tk;
+	mk = eph->m0 + eph->n*tk;
 	ek = mk;
 	ekold = ek + 1.0;
   
@@ -420,42 +545,42 @@ void satpos(ephem_t eph, gpstime_t g, double *pos, double *vel, double *clk)
 	while(fabs(ek-ekold)>1.0E-14)
 	{
 		ekold = ek;
-		OneMinusecosE = 1.0-eph.ecc*cos(ekold);
-		ek = ek + (mk-ekold+eph.ecc*sin(ekold))/OneMinusecosE;
+		OneMinusecosE = 1.0-eph->ecc*cos(ekold);
+		ek = ek + (mk-ekold+eph->ecc*sin(ekold))/OneMinusecosE;
 	}
 
 	sek = sin(ek);
 	cek = cos(ek);
 
-	ekdot = eph.n/OneMinusecosE;
+	ekdot = eph->n/OneMinusecosE;
 
-	relativistic = -4.442807633E-10*eph.ecc*eph.sqrta*sek;
+	relativistic = -4.442807633E-10*eph->ecc*eph->sqrta*sek;
 
-	pk = atan2(eph.sq1e2*sek,cek-eph.ecc) + eph.aop;
-	pkdot = eph.sq1e2*ekdot/OneMinusecosE;
+	pk = atan2(eph->sq1e2*sek,cek-eph->ecc) + eph->aop;
+	pkdot = eph->sq1e2*ekdot/OneMinusecosE;
 
 	s2pk = sin(2.0*pk);
 	c2pk = cos(2.0*pk);
 
-	uk = pk + eph.cus*s2pk + eph.cuc*c2pk;
+	uk = pk + eph->cus*s2pk + eph->cuc*c2pk;
 	suk = sin(uk);
 	cuk = cos(uk);
-	ukdot = pkdot*(1.0 + 2.0*(eph.cus*c2pk - eph.cuc*s2pk));
+	ukdot = pkdot*(1.0 + 2.0*(eph->cus*c2pk - eph->cuc*s2pk));
 
-	rk = eph.A*OneMinusecosE + eph.crc*c2pk + eph.crs*s2pk;
-	rkdot = eph.A*eph.ecc*sek*ekdot + 2.0*pkdot*(eph.crs*c2pk - eph.crc*s2pk);
+	rk = eph->A*OneMinusecosE + eph->crc*c2pk + eph->crs*s2pk;
+	rkdot = eph->A*eph->ecc*sek*ekdot + 2.0*pkdot*(eph->crs*c2pk - eph->crc*s2pk);
 
-	ik = eph.inc0 + eph.idot*tk + eph.cic*c2pk + eph.cis*s2pk;
+	ik = eph->inc0 + eph->idot*tk + eph->cic*c2pk + eph->cis*s2pk;
 	sik = sin(ik);
 	cik = cos(ik);
-	ikdot = eph.idot + 2.0*pkdot*(eph.cis*c2pk - eph.cic*s2pk);
+	ikdot = eph->idot + 2.0*pkdot*(eph->cis*c2pk - eph->cic*s2pk);
 
 	xpk = rk*cuk;
 	ypk = rk*suk;
 	xpkdot = rkdot*cuk - ypk*ukdot;
 	ypkdot = rkdot*suk + xpk*ukdot;
 
-	ok = eph.omg0 + tk*eph.omgkdot - OMEGA_EARTH*eph.toe.sec;
+	ok = eph->omg0 + tk*eph->omgkdot - OMEGA_EARTH*eph->toe.sec;
 	sok = sin(ok);
 	cok = cos(ok);
 
@@ -465,20 +590,436 @@ void satpos(ephem_t eph, gpstime_t g, double *pos, double *vel, double *clk)
 
 	tmp = ypkdot*cik - ypk*sik*ikdot;
 
-	vel[0] = -eph.omgkdot*pos[1] + xpkdot*cok - tmp*sok;
-	vel[1] = eph.omgkdot*pos[0] + xpkdot*sok + tmp*cok;
+	vel[0] = -eph->omgkdot*pos[1] + xpkdot*cok - tmp*sok;
+	vel[1] = eph->omgkdot*pos[0] + xpkdot*sok + tmp*cok;
 	vel[2] = ypk*cik*ikdot + ypkdot*sik;
 
 	// Satellite clock correction
-	tk = g.sec - eph.toc.sec;
+	tk = g.sec - eph->toc.sec;
 
 	if(tk>SECONDS_IN_HALF_WEEK)
 		tk -= SECONDS_IN_WEEK;
 	else if(tk<-SECONDS_IN_HALF_WEEK)
 		tk += SECONDS_IN_WEEK;
 
-	clk[0] = eph.af0 + tk*(eph.af1 + tk*eph.af2) + relativistic - eph.tgd;  
-	clk[1] = eph.af1 + 2.0*tk*eph.af2; 
+	clk[0] = eph->af0 + tk*(eph->af1 + tk*eph->af2) + relativistic - eph->tgd;  
+	clk[1] = eph->af1 + 2.0*tk*eph->af2; 
+
+	return;
+}
+
+/*! \brief Fit the orbit and clock of a slot with Chebyshev series
+ *  \param ss Satellite batch
+ *  \param[in] i Slot index
+ *  \param[in] g GPS time at the start of the window
+ *  \param[in] tk Time of \a g from TOE
+ *  \returns Maximum difference to \ref satpos at the check points in meters
+ *
+ * The series are fitted at the Chebyshev nodes of [tk, tk+window]. The
+ * position and clock are checked at the extrema of the next Chebyshev
+ * polynomial, both ends included, which lie between the nodes where the
+ * error of the fit peaks.
+ */
+double fitOrbit(satstate_t *ss, int i, gpstime_t g, double tk, double window)
+{
+	double f[8][ORBIT_CHEB_NODES];
+	double x,t,sum,err,maxerr;
+	double pos[3],vel[3],clk[2];
+	double b0,b1,b2;
+	gpstime_t gt;
+	int j,k,m;
+
+	gt.week = g.week;
+
+	ss->wt0[i] = tk;
+	ss->wt1[i] = tk + window;
+
+	// Samples at the nodes
+	for (k=0; k<ORBIT_CHEB_NODES; k++)
+	{
+		x = cos(PI*(k+0.5)/ORBIT_CHEB_NODES);
+		t = 0.5*window*(x+1.0);
+
+		gt.sec = g.sec + t; // Not rounded to 1 ms as by incGpsTime()
+		satpos(ss->eph[i], gt, pos, vel, clk);
+
+		f[0][k] = pos[0];
+		f[1][k] = pos[1];
+		f[2][k] = pos[2];
+		f[3][k] = vel[0];
+		f[4][k] = vel[1];
+		f[5][k] = vel[2];
+		f[6][k] = clk[0]*SPEED_OF_LIGHT;
+		f[7][k] = clk[1]*SPEED_OF_LIGHT;
+	}
+
+	// Coefficients, the constant term is halved
+	for (m=0; m<8; m++)
+	{
+		for (j=0; j<ORBIT_CHEB_NODES; j++)
+		{
+			sum = 0.0;
+			for (k=0; k<ORBIT_CHEB_NODES; k++)
+				sum += f[m][k]*cos(PI*j*(k+0.5)/ORBIT_CHEB_NODES);
+
+			ss->cheb[m][j][i] = 2.0*sum/ORBIT_CHEB_NODES;
+		}
+
+		ss->cheb[m][0][i] *= 0.5;
+	}
+
+	// Check the position and clock
+	maxerr = 0.0;
+	for (k=0; k<=ORBIT_CHEB_NODES; k++)
+	{
+		x = cos(PI*k/ORBIT_CHEB_NODES);
+		t = 0.5*window*(x+1.0);
+
+		gt.sec = g.sec + t;
+		satpos(ss->eph[i], gt, pos, vel, clk);
+
+		err = 0.0;
+		for (m=0; m<7; m+=(m==2)?4:1) // pos[0..2] and clk[0]
+		{
+			b1 = 0.0;
+			b2 = 0.0;
+			for (j=ORBIT_CHEB_NODES-1; j>=1; j--)
+			{
+				b0 = 2.0*x*b1 - b2 + ss->cheb[m][j][i];
+				b2 = b1;
+				b1 = b0;
+			}
+			b0 = x*b1 - b2 + ss->cheb[m][0][i];
+
+			if (m<3)
+				err += (b0-pos[m])*(b0-pos[m]);
+			else if (fabs(b0-clk[0]*SPEED_OF_LIGHT)>maxerr)
+				maxerr = fabs(b0-clk[0]*SPEED_OF_LIGHT);
+		}
+		err = sqrt(err);
+
+		if (err>maxerr)
+			maxerr = err;
+	}
+
+	ss->fitted[i] = 1;
+
+	return(maxerr);
+}
+
+/*! \brief Interpolate the satellite states of a batch at given time
+ *  \param ss Satellite batch, the states of all slots are updated
+ *  \param[in] g GPS time at which the states are to be computed
+ *
+ * A slot is refitted when \a g leaves its window or the ephemeris changes.
+ * The window is halved until the fit meets ORBIT_INTERP_TOL. If no window
+ * down to 1 s does, the slot is evaluated with \ref satpos until its
+ * ephemeris changes.
+ */
+void satposInterp(satstate_t *ss, gpstime_t g)
+{
+	double tk[MAX_SAT],x[MAX_SAT];
+	double b0[MAX_SAT],b1[MAX_SAT],b2[MAX_SAT];
+	double pos[3],vel[3],clk[2];
+	double window;
+	int i,j,m,n;
+
+	n = ss->n;
+
+	for (i=0; i<n; i++)
+	{
+		tk[i] = g.sec - ss->toe[i];
+
+		if(tk[i]>SECONDS_IN_HALF_WEEK)
+			tk[i] -= SECONDS_IN_WEEK;
+		else if(tk[i]<-SECONDS_IN_HALF_WEEK)
+			tk[i] += SECONDS_IN_WEEK;
+
+		if (ss->prn[i]==0 || ss->nofit[i])
+		{
+			x[i] = 0.0;
+			continue;
+		}
+
+		if (!ss->fitted[i] || tk[i]<ss->wt0[i] || tk[i]>ss->wt1[i])
+		{
+			window = ss->window;
+			while (fitOrbit(ss, i, g, tk[i], window)>ORBIT_INTERP_TOL)
+			{
+				if (window<=1.0)
+				{
+					ss->nofit[i] = TRUE;
+					break;
+				}
+				window *= 0.5;
+			}
+
+			if (ss->nofit[i])
+			{
+				x[i] = 0.0;
+				continue;
+			}
+		}
+
+		x[i] = (2.0*tk[i] - ss->wt0[i] - ss->wt1[i])/(ss->wt1[i] - ss->wt0[i]);
+	}
+
+	// Clenshaw recurrence
+	for (m=0; m<8; m++)
+	{
+		for (i=0; i<n; i++)
+		{
+			b1[i] = 0.0;
+			b2[i] = 0.0;
+		}
+
+		for (j=ORBIT_CHEB_NODES-1; j>=1; j--)
+		{
+			for (i=0; i<n; i++)
+			{
+				b0[i] = 2.0*x[i]*b1[i] - b2[i] + ss->cheb[m][j][i];
+				b2[i] = b1[i];
+				b1[i] = b0[i];
+			}
+		}
+
+		for (i=0; i<n; i++)
+			b0[i] = x[i]*b1[i] - b2[i] + ss->cheb[m][0][i];
+
+		if (m<3)
+		{
+			for (i=0; i<n; i++)
+				ss->pos[m][i] = b0[i];
+		}
+		else if (m<6)
+		{
+			for (i=0; i<n; i++)
+				ss->vel[m-3][i] = b0[i];
+		}
+		else
+		{
+			for (i=0; i<n; i++)
+				ss->clk[m-6][i] = b0[i]/SPEED_OF_LIGHT;
+		}
+	}
+
+	// Slots without a fit
+	for (i=0; i<n; i++)
+	{
+		if (ss->prn[i]==0 || !ss->nofit[i])
+			continue;
+
+		satpos(ss->eph[i], g, pos, vel, clk);
+
+		for (m=0; m<3; m++)
+		{
+			ss->pos[m][i] = pos[m];
+			ss->vel[m][i] = vel[m];
+		}
+		ss->clk[0][i] = clk[0];
+		ss->clk[1][i] = clk[1];
+	}
+
+	return;
+}
+
+/*! \brief Evaluate the satellite states of a batch with the reference \ref satpos
+ *  \param ss Satellite batch, the states of all slots in use are updated
+ *  \param[in] g GPS time at which the states are to be computed
+ */
+void satposExact(satstate_t *ss, gpstime_t g)
+{
+	double pos[3],vel[3],clk[2];
+	int i;
+
+	for (i=0; i<ss->n; i++)
+	{
+		if (ss->prn[i]==0)
+			continue;
+
+		satpos(ss->eph[i], g, pos, vel, clk);
+
+		ss->pos[0][i] = pos[0];
+		ss->pos[1][i] = pos[1];
+		ss->pos[2][i] = pos[2];
+		ss->vel[0][i] = vel[0];
+		ss->vel[1][i] = vel[1];
+		ss->vel[2][i] = vel[2];
+		ss->clk[0][i] = clk[0];
+		ss->clk[1][i] = clk[1];
+	}
+
+	return;
+}
+
+/*! \brief Compute Satellite positions, velocities and clocks of a batch at given time
+ *  \param ss Satellite batch, the states of all slots are updated
+ *  \param[in] g GPS time at which the states are to be computed
+ *
+ * Same model as \ref satpos, which is kept as the reference, evaluated in
+ * stages over all slots. The arithmetic stages are left to the auto-vectorizer.
+ *
+ * - Kepler's equation is solved by Newton's method, starting from the previous
+ *   eccentric anomaly advanced by dE/dM. Epochs 0.1 s apart converge in a
+ *   single iteration.
+ * - The true anomaly, the argument of latitude and its double angle are
+ *   rotated with sin/cos pairs instead of atan2() and six more calls. The
+ *   small harmonic correction of the argument of latitude uses a series.
+ * - The sin/cos of the inclination and the node are computed next to each
+ *   other, which gcc turns into sincos() calls.
+ *
+ * The result agrees with \ref satpos to well below 1 mm, but not bit for bit,
+ * which changes a few output samples. Define EXACT_SATPOS to evaluate every
+ * slot with \ref satpos instead.
+ */
+void satposBatch(satstate_t *ss, gpstime_t g)
+{
+	double tk[MAX_SAT];
+	double mk[MAX_SAT];
+	double sek[MAX_SAT],cek[MAX_SAT];
+	double OneMinusecosE[MAX_SAT];
+	double s2pk[MAX_SAT],c2pk[MAX_SAT];
+	double suk[MAX_SAT],cuk[MAX_SAT];
+	double rk[MAX_SAT],ik[MAX_SAT],ok[MAX_SAT];
+	double sik[MAX_SAT],cik[MAX_SAT];
+	double sok[MAX_SAT],cok[MAX_SAT];
+	double ek,dek,sek0;
+	double svk,cvk,spk,cpk,du,sdu,cdu;
+	double ekdot,pkdot,ukdot,rkdot,ikdot;
+	double xpk,ypk,xpkdot,ypkdot;
+	double tmp,tc;
+	int i,n,iter;
+
+	if (ss->window>0.0)
+	{
+		satposInterp(ss, g);
+		return;
+	}
+
+#ifdef EXACT_SATPOS
+	satposExact(ss, g);
+	return;
+#endif
+
+	n = ss->n;
+
+	// Mean anomaly
+	for (i=0; i<n; i++)
+	{
+		tk[i] = g.sec - ss->toe[i];
+
+		if(tk[i]>SECONDS_IN_HALF_WEEK)
+			tk[i] -= SECONDS_IN_WEEK;
+		else if(tk[i]<-SECONDS_IN_HALF_WEEK)
+			tk[i] += SECONDS_IN_WEEK;
+
+		mk[i] = ss->m0[i] + ss->n0[i]*tk[i];
+	}
+
+	// Eccentric anomaly
+	for (i=0; i<n; i++)
+	{
+		if (ss->warm[i])
+			ek = ss->ek[i] + (mk[i]-ss->mk[i])*ss->dedm[i];
+		else
+			ek = mk[i];
+
+		for (iter=0; iter<KEPLER_MAX_ITER; iter++)
+		{
+			sek[i] = sin(ek);
+			cek[i] = cos(ek);
+
+			dek = (mk[i]-ek+ss->ecc[i]*sek[i])/(1.0-ss->ecc[i]*cek[i]);
+			ek += dek;
+
+			if (fabs(dek)<KEPLER_TOL)
+			{
+				// Carry sin and cos over the last step
+				sek0 = sek[i];
+				sek[i] += dek*cek[i];
+				cek[i] -= dek*sek0;
+				break;
+			}
+		}
+
+		OneMinusecosE[i] = 1.0-ss->ecc[i]*cek[i];
+
+		ss->ek[i] = ek;
+		ss->mk[i] = mk[i];
+		ss->dedm[i] = 1.0/OneMinusecosE[i];
+		ss->warm[i] = 1;
+	}
+
+	// Argument of latitude, radius, inclination and longitude of the node
+	for (i=0; i<n; i++)
+	{
+		// True anomaly
+		svk = ss->sq1e2[i]*sek[i]/OneMinusecosE[i];
+		cvk = (cek[i]-ss->ecc[i])/OneMinusecosE[i];
+
+		// Argument of latitude
+		spk = svk*ss->caop[i] + cvk*ss->saop[i];
+		cpk = cvk*ss->caop[i] - svk*ss->saop[i];
+
+		s2pk[i] = 2.0*spk*cpk;
+		c2pk[i] = cpk*cpk - spk*spk;
+
+		// Corrected argument of latitude, the correction is below 1e-4 rad
+		du = ss->cus[i]*s2pk[i] + ss->cuc[i]*c2pk[i];
+		sdu = du*(1.0 - du*du/6.0);
+		cdu = 1.0 - 0.5*du*du;
+
+		suk[i] = spk*cdu + cpk*sdu;
+		cuk[i] = cpk*cdu - spk*sdu;
+
+		rk[i] = ss->A[i]*OneMinusecosE[i] + ss->crc[i]*c2pk[i] + ss->crs[i]*s2pk[i];
+		ik[i] = ss->inc0[i] + ss->idot[i]*tk[i] + ss->cic[i]*c2pk[i] + ss->cis[i]*s2pk[i];
+		ok[i] = ss->omgt[i] + tk[i]*ss->omgkdot[i];
+	}
+
+	for (i=0; i<n; i++)
+	{
+		sik[i] = sin(ik[i]);
+		cik[i] = cos(ik[i]);
+		sok[i] = sin(ok[i]);
+		cok[i] = cos(ok[i]);
+	}
+
+	// Position, velocity and clock
+	for (i=0; i<n; i++)
+	{
+		ekdot = ss->n0[i]/OneMinusecosE[i];
+		pkdot = ss->sq1e2[i]*ekdot/OneMinusecosE[i];
+		ukdot = pkdot*(1.0 + 2.0*(ss->cus[i]*c2pk[i] - ss->cuc[i]*s2pk[i]));
+		rkdot = ss->A[i]*ss->ecc[i]*sek[i]*ekdot + 2.0*pkdot*(ss->crs[i]*c2pk[i] - ss->crc[i]*s2pk[i]);
+		ikdot = ss->idot[i] + 2.0*pkdot*(ss->cis[i]*c2pk[i] - ss->cic[i]*s2pk[i]);
+
+		xpk = rk[i]*cuk[i];
+		ypk = rk[i]*suk[i];
+		xpkdot = rkdot*cuk[i] - ypk*ukdot;
+		ypkdot = rkdot*suk[i] + xpk*ukdot;
+
+		ss->pos[0][i] = xpk*cok[i] - ypk*cik[i]*sok[i];
+		ss->pos[1][i] = xpk*sok[i] + ypk*cik[i]*cok[i];
+		ss->pos[2][i] = ypk*sik[i];
+
+		tmp = ypkdot*cik[i] - ypk*sik[i]*ikdot;
+
+		ss->vel[0][i] = -ss->omgkdot[i]*ss->pos[1][i] + xpkdot*cok[i] - tmp*sok[i];
+		ss->vel[1][i] = ss->omgkdot[i]*ss->pos[0][i] + xpkdot*sok[i] + tmp*cok[i];
+		ss->vel[2][i] = ypk*cik[i]*ikdot + ypkdot*sik[i];
+
+		// Satellite clock correction
+		tc = g.sec - ss->toc[i];
+
+		if(tc>SECONDS_IN_HALF_WEEK)
+			tc -= SECONDS_IN_WEEK;
+		else if(tc<-SECONDS_IN_HALF_WEEK)
+			tc += SECONDS_IN_WEEK;
+
+		ss->clk[0][i] = ss->af0[i] + tc*(ss->af1[i] + tc*ss->af2[i]) + ss->relk[i]*sek[i] - ss->tgd[i];
+		ss->clk[1][i] = ss->af1[i] + 2.0*tc*ss->af2[i];
+	}
 
 	return;
 }
@@ -811,14 +1352,16 @@ gpstime_t incGpsTime(gpstime_t g0, double dt)
 }
 
 /*! \brief Read Ephemeris data from the RINEX Navigation file */
-/*  \param[out] eph Array of Output SV ephemeris data
+/*  \param[out] list Allocated array of the ephemeris records in the file
+ *  \param[out] ionoutc Iono/UTC parameters in the header
  *  \param[in] fname File name of the RINEX file
- *  \returns Number of sets of ephemerides in the file
+ *  \returns Number of ephemeris records in the file, -1 on error
  */
-int readRinexNavAll(ephem_t eph[][MAX_SAT], ionoutc_t *ionoutc, const char *fname)
+int readRinexNavAll(ephem_t **list, ionoutc_t *ionoutc, const char *fname)
 {
 	FILE *fp;
-	int ieph;
+	int neph,size;
+	ephem_t *eph,*tmplist;
 	
 	int sv;
 	char str[MAX_CHAR];
@@ -826,18 +1369,15 @@ int readRinexNavAll(ephem_t eph[][MAX_SAT], ionoutc_t *ionoutc, const char *fnam
 
 	datetime_t t;
 	gpstime_t g;
-	gpstime_t g0;
-	double dt;
 
 	int flags = 0x0;
 
 	if (NULL==(fp=fopen(fname, "rt")))
 		return(-1);
 
-	// Clear valid flag
-	for (ieph=0; ieph<EPHEM_ARRAY_SIZE; ieph++)
-		for (sv=0; sv<MAX_SAT; sv++)
-			eph[ieph][sv].vflg = 0;
+	neph = 0;
+	size = 0;
+	*list = NULL;
 
 	// Read header lines
 	while (1)
@@ -933,14 +1473,22 @@ int readRinexNavAll(ephem_t eph[][MAX_SAT], ionoutc_t *ionoutc, const char *fnam
 		ionoutc->vflg = TRUE;
 
 	// Read ephemeris blocks
-	g0.week = -1;
-	ieph = 0;
-
 	while (1)
 	{
 		if (NULL==fgets(str, MAX_CHAR, fp))
 			break;
 
+		if (neph==size)
+		{
+			size = (size==0)?256:2*size;
+			if (NULL==(tmplist=realloc(*list, size*sizeof(ephem_t))))
+				break;
+			*list = tmplist;
+		}
+
+		eph = &(*list)[neph];
+		memset(eph, 0, sizeof(ephem_t));
+
 		// PRN
 		strncpy(tmp, str, 2);
 		tmp[2] = 0;
@@ -972,42 +1520,27 @@ int readRinexNavAll(ephem_t eph[][MAX_SAT], ionoutc_t *ionoutc, const char *fnam
 		t.sec = atof(tmp);
 
 		date2gps(&t, &g);
-		
-		if (g0.week==-1)
-			g0 = g;
-
-		// Check current time of clock
-		dt = subGpsTime(g, g0);
-		
-		if (dt>SECONDS_IN_HOUR)
-		{
-			g0 = g;
-			ieph++; // a new set of ephemerides
-
-			if (ieph>=EPHEM_ARRAY_SIZE)
-				break;
-		}
 
 		// Date and time
-		eph[ieph][sv].t = t;
+		eph->t = t;
 
 		// SV CLK
-		eph[ieph][sv].toc = g;
+		eph->toc = g;
 
 		strncpy(tmp, str+22, 19);
 		tmp[19] = 0;
 		replaceExpDesignator(tmp, 19); // tmp[15]='E';
-		eph[ieph][sv].af0 = atof(tmp);
+		eph->af0 = atof(tmp);
 
 		strncpy(tmp, str+41, 19);
 		tmp[19] = 0;
 		replaceExpDesignator(tmp, 19);
-		eph[ieph][sv].af1 = atof(tmp);
+		eph->af1 = atof(tmp);
 
 		strncpy(tmp, str+60, 19);
 		tmp[19] = 0;
 		replaceExpDesignator(tmp, 19);
-		eph[ieph][sv].af2 = atof(tmp);
+		eph->af2 = atof(tmp);
 
 		// BROADCAST ORBIT - 1
 		if (NULL==fgets(str, MAX_CHAR, fp))
@@ -1016,22 +1549,22 @@ int readRinexNavAll(ephem_t eph[][MAX_SAT], ionoutc_t *ionoutc, const char *fnam
 		strncpy(tmp, str+3, 19);
 		tmp[19] = 0;
 		replaceExpDesignator(tmp, 19);
-		eph[ieph][sv].iode = (int)atof(tmp);
+		eph->iode = (int)atof(tmp);
 
 		strncpy(tmp, str+22, 19);
 		tmp[19] = 0;
 		replaceExpDesignator(tmp, 19);
-		eph[ieph][sv].crs = atof(tmp);
+		eph->crs = atof(tmp);
 
 		strncpy(tmp, str+41, 19);
 		tmp[19] = 0;
 		replaceExpDesignator(tmp, 19);
-		eph[ieph][sv].deltan = atof(tmp);
+		eph->deltan = atof(tmp);
 
 		strncpy(tmp, str+60, 19);
 		tmp[19] = 0;
 		replaceExpDesignator(tmp, 19);
-		eph[ieph][sv].m0 = atof(tmp);
+		eph->m0 = atof(tmp);
 
 		// BROADCAST ORBIT - 2
 		if (NULL==fgets(str, MAX_CHAR, fp))
@@ -1040,22 +1573,22 @@ int readRinexNavAll(ephem_t eph[][MAX_SAT], ionoutc_t *ionoutc, const char *fnam
 		strncpy(tmp, str+3, 19);
 		tmp[19] = 0;
 		replaceExpDesignator(tmp, 19);
-		eph[ieph][sv].cuc = atof(tmp);
+		eph->cuc = atof(tmp);
 
 		strncpy(tmp, str+22, 19);
 		tmp[19] = 0;
 		replaceExpDesignator(tmp, 19);
-		eph[ieph][sv].ecc = atof(tmp);
+		eph->ecc = atof(tmp);
 
 		strncpy(tmp, str+41, 19);
 		tmp[19] = 0;
 		replaceExpDesignator(tmp, 19);
-		eph[ieph][sv].cus = atof(tmp);
+		eph->cus = atof(tmp);
 
 		strncpy(tmp, str+60, 19);
 		tmp[19] = 0;
 		replaceExpDesignator(tmp, 19);
-		eph[ieph][sv].sqrta = atof(tmp);
+		eph->sqrta = atof(tmp);
 
 		// BROADCAST ORBIT - 3
 		if (NULL==fgets(str, MAX_CHAR, fp))
@@ -1064,22 +1597,22 @@ int readRinexNavAll(ephem_t eph[][MAX_SAT], ionoutc_t *ionoutc, const char *fnam
 		strncpy(tmp, str+3, 19);
 		tmp[19] = 0;
 		replaceExpDesignator(tmp, 19);
-		eph[ieph][sv].toe.sec = atof(tmp);
+		eph->toe.sec = atof(tmp);
 
 		strncpy(tmp, str+22, 19);
 		tmp[19] = 0;
 		replaceExpDesignator(tmp, 19);
-		eph[ieph][sv].cic = atof(tmp);
+		eph->cic = atof(tmp);
 
 		strncpy(tmp, str+41, 19);
 		tmp[19] = 0;
 		replaceExpDesignator(tmp, 19);
-		eph[ieph][sv].omg0 = atof(tmp);
+		eph->omg0 = atof(tmp);
 
 		strncpy(tmp, str+60, 19);
 		tmp[19] = 0;
 		replaceExpDesignator(tmp, 19);
-		eph[ieph][sv].cis = atof(tmp);
+		eph->cis = atof(tmp);
 
 		// BROADCAST ORBIT - 4
 		if (NULL==fgets(str, MAX_CHAR, fp))
@@ -1088,22 +1621,22 @@ int readRinexNavAll(ephem_t eph[][MAX_SAT], ionoutc_t *ionoutc, const char *fnam
 		strncpy(tmp, str+3, 19);
 		tmp[19] = 0;
 		replaceExpDesignator(tmp, 19);
-		eph[ieph][sv].inc0 = atof(tmp);
+		eph->inc0 = atof(tmp);
 
 		strncpy(tmp, str+22, 19);
 		tmp[19] = 0;
 		replaceExpDesignator(tmp, 19);
-		eph[ieph][sv].crc = atof(tmp);
+		eph->crc = atof(tmp);
 		
 		strncpy(tmp, str+41, 19);
 		tmp[19] = 0;
 		replaceExpDesignator(tmp, 19);
-		eph[ieph][sv].aop = atof(tmp);
+		eph->aop = atof(tmp);
 
 		strncpy(tmp, str+60, 19);
 		tmp[19] = 0;
 		replaceExpDesignator(tmp, 19);
-		eph[ieph][sv].omgdot = atof(tmp);
+		eph->omgdot = atof(tmp);
 
 		// BROADCAST ORBIT - 5
 		if (NULL==fgets(str, MAX_CHAR, fp))
@@ -1112,17 +1645,17 @@ int readRinexNavAll(ephem_t eph[][MAX_SAT], ionoutc_t *ionoutc, const char *fnam
 		strncpy(tmp, str+3, 19);
 		tmp[19] = 0;
 		replaceExpDesignator(tmp, 19);
-		eph[ieph][sv].idot = atof(tmp);
+		eph->idot = atof(tmp);
 
 		strncpy(tmp, str+22, 19);
 		tmp[19] = 0;
 		replaceExpDesignator(tmp, 19);
-		eph[ieph][sv].codeL2 = (int)atof(tmp);
+		eph->codeL2 = (int)atof(tmp);
 
 		strncpy(tmp, str+41, 19);
 		tmp[19] = 0;
 		replaceExpDesignator(tmp, 19);
-		eph[ieph][sv].toe.week = (int)atof(tmp);
+		eph->toe.week = (int)atof(tmp);
 
 		// BROADCAST ORBIT - 6
 		if (NULL==fgets(str, MAX_CHAR, fp))
@@ -1131,87 +1664,456 @@ int readRinexNavAll(ephem_t eph[][MAX_SAT], ionoutc_t *ionoutc, const char *fnam
 		strncpy(tmp, str+22, 19);
 		tmp[19] = 0;
 		replaceExpDesignator(tmp, 19);
-		eph[ieph][sv].svhlth = (int)atof(tmp);
-		if ((eph[ieph][sv].svhlth>0) && (eph[ieph][sv].svhlth<32))
-			eph[ieph][sv].svhlth += 32; // Set MSB to 1
+		eph->svhlth = (int)atof(tmp);
+		if ((eph->svhlth>0) && (eph->svhlth<32))
+			eph->svhlth += 32; // Set MSB to 1
 
 		strncpy(tmp, str+41, 19);
 		tmp[19] = 0;
 		replaceExpDesignator(tmp, 19);
-		eph[ieph][sv].tgd = atof(tmp);
+		eph->tgd = atof(tmp);
 
 		strncpy(tmp, str+60, 19);
 		tmp[19] = 0;
 		replaceExpDesignator(tmp, 19);
-		eph[ieph][sv].iodc = (int)atof(tmp);
+		eph->iodc = (int)atof(tmp);
 
 		// BROADCAST ORBIT - 7
 		if (NULL==fgets(str, MAX_CHAR, fp))
 			break;
 
+		if (sv<0 || sv>=MAX_SAT)
+			continue; // Not a GPS satellite
+
 		// Set valid flag
-		eph[ieph][sv].vflg = 1;
+		eph->vflg = 1;
+		eph->prn = sv+1;
 
 		// Update the working variables
-		eph[ieph][sv].A = eph[ieph][sv].sqrta * eph[ieph][sv].sqrta;
-		eph[ieph][sv].n = sqrt(GM_EARTH/(eph[ieph][sv].A*eph[ieph][sv].A*eph[ieph][sv].A)) + eph[ieph][sv].deltan;
-		eph[ieph][sv].sq1e2 = sqrt(1.0 - eph[ieph][sv].ecc*eph[ieph][sv].ecc);
-		eph[ieph][sv].omgkdot = eph[ieph][sv].omgdot - OMEGA_EARTH;
+		eph->A = eph->sqrta * eph->sqrta;
+		eph->n = sqrt(GM_EARTH/(eph->A*eph->A*eph->A)) + eph->deltan;
+		eph->sq1e2 = sqrt(1.0 - eph->ecc*eph->ecc);
+		eph->omgkdot = eph->omgdot - OMEGA_EARTH;
+
+		neph++;
 	}
 
 	fclose(fp);
-	
-	if (g0.week>=0)
-		ieph += 1; // Number of sets of ephemerides
 
-	return(ieph);
+	return(neph);
 }
 
-double ionosphericDelay(const ionoutc_t *ionoutc, gpstime_t g, double *llh, double *azel)
+/*! \brief Compute the key of the RINEX file the ephemeris cache is valid for
+ *  \param[in] fname File name of the RINEX file
+ *  \param[out] key Cache header with the source fields set
+ *  \returns 0 on success, -1 on error
+ */
+int getEphemCacheKey(const char *fname, ephcache_t *key)
 {
-	double iono_delay = 0.0;
-	double E,phi_u,lam_u,F;
+	FILE *fp;
+	struct stat st;
+	unsigned char buf[65536];
+	unsigned long long h;
+	size_t i,n;
 
-	if (ionoutc->enable==FALSE)
-		return (0.0); // No ionospheric delay
+	memset(key, 0, sizeof(ephcache_t));
 
-	E = azel[1]/PI;
-	phi_u = llh[0]/PI;
-	lam_u = llh[1]/PI;
+	if (stat(fname, &st)!=0)
+		return(-1);
 
-	// Obliquity factor
-	F = 1.0 + 16.0*pow((0.53 - E),3.0);
+	if (NULL==(fp=fopen(fname, "rb")))
+		return(-1);
 
-	if (ionoutc->vflg==FALSE)
-		iono_delay = F*5.0e-9*SPEED_OF_LIGHT;
-	else
+	// 64-bit FNV-1a
+	h = 0xcbf29ce484222325ULL;
+
+	while ((n=fread(buf, 1, sizeof(buf), fp))>0)
 	{
-		double t,psi,phi_i,lam_i,phi_m,phi_m2,phi_m3;
-		double AMP,PER,X,X2,X4;
+		for (i=0; i<n; i++)
+		{
+			h ^= buf[i];
+			h *= 0x100000001b3ULL;
+		}
+	}
 
-		// Earth's central angle between the user position and the earth projection of
-		// ionospheric intersection point (semi-circles)
-		psi = 0.0137/(E + 0.11) - 0.022;
-		
-		// Geodetic latitude of the earth projection of the ionospheric intersection point
-		// (semi-circles)
-		phi_i = phi_u + psi*cos(azel[0]);
-		if(phi_i>0.416)
-			phi_i = 0.416;
-		else if(phi_i<-0.416)
-			phi_i = -0.416;
+	fclose(fp);
 
-		// Geodetic longitude of the earth projection of the ionospheric intersection point
-		// (semi-circles)
-		lam_i = lam_u + psi*sin(azel[0])/cos(phi_i*PI);
+	strcpy(key->magic, "GPSEPHC");
+	key->version = EPHEM_CACHE_VERSION;
+	key->eph_size = (int)sizeof(ephem_t);
+	key->iono_size = (int)sizeof(ionoutc_t);
+	key->nsat = MAX_SAT;
+	key->src_size = (long long)st.st_size;
+	key->src_mtime = (long long)st.st_mtime;
+	key->src_hash = h;
 
-		// Geomagnetic latitude of the earth projection of the ionospheric intersection
-		// point (mean ionospheric height assumed 350 km) (semi-circles)
-		phi_m = phi_i + 0.064*cos((lam_i - 1.617)*PI);
-		phi_m2 = phi_m*phi_m;
-		phi_m3 = phi_m2*phi_m;
+	return(0);
+}
 
-		AMP = ionoutc->alpha0 + ionoutc->alpha1*phi_m
+/*! \brief Load the ephemerides from the binary cache
+ *  \param[out] list Allocated array of the ephemeris records
+ *  \param[out] ionoutc Iono/UTC parameters
+ *  \param[in] cachefile File name of the cache
+ *  \param[in] key Key of the RINEX file from getEphemCacheKey()
+ *  \returns Number of ephemeris records, -1 if the cache is missing or stale
+ */
+int readEphemCache(ephem_t **list, ionoutc_t *ionoutc, const char *cachefile, const ephcache_t *key)
+{
+	FILE *fp;
+	ephcache_t hdr;
+	int neph;
+
+	*list = NULL;
+
+	if (NULL==(fp=fopen(cachefile, "rb")))
+		return(-1);
+
+	if (fread(&hdr, sizeof(ephcache_t), 1, fp)!=1)
+	{
+		fclose(fp);
+		return(-1);
+	}
+
+	// Everything but the number of records is part of the key
+	neph = hdr.neph;
+	hdr.neph = key->neph;
+
+	if (neph<0 || memcmp(&hdr, key, sizeof(ephcache_t))!=0)
+	{
+		fclose(fp);
+		return(-1);
+	}
+
+	// Read the payload straight into place
+	if (neph>0 && NULL==(*list=malloc(neph*sizeof(ephem_t))))
+	{
+		fclose(fp);
+		return(-1);
+	}
+
+	if (fread(ionoutc, sizeof(ionoutc_t), 1, fp)!=1 || (neph>0 && fread(*list, sizeof(ephem_t), neph, fp)!=(size_t)neph))
+	{
+		fclose(fp);
+		free(*list);
+		*list = NULL;
+		return(-1);
+	}
+
+	fclose(fp);
+
+	return(neph);
+}
+
+/*! \brief Save the ephemerides to the binary cache
+ *  \param[in] list Array of the ephemeris records
+ *  \param[in] neph Number of ephemeris records
+ *  \param[in] ionoutc Iono/UTC parameters
+ *  \param[in] cachefile File name of the cache
+ *  \param[in] key Key of the RINEX file from getEphemCacheKey()
+ *  \returns 0 on success, -1 on error
+ *
+ * The cache is written to a temporary file and renamed into place, so that
+ * concurrent runs never see a partial cache.
+ */
+int writeEphemCache(const ephem_t *list, int neph, const ionoutc_t *ionoutc, const char *cachefile, const ephcache_t *key)
+{
+	FILE *fp;
+	ephcache_t hdr;
+	char tmpfile[2*MAX_CHAR];
+	int len;
+	int ok;
+
+#ifdef _WIN32
+	len = snprintf(tmpfile, sizeof(tmpfile), "%s.tmp", cachefile);
+#else
+	len = snprintf(tmpfile, sizeof(tmpfile), "%s.%d", cachefile, (int)getpid());
+#endif
+
+	if (len<0 || len>=(int)sizeof(tmpfile))
+		return(-1); // Path too long
+
+	if (NULL==(fp=fopen(tmpfile, "wb")))
+		return(-1);
+
+	hdr = *key;
+	hdr.neph = neph;
+
+	ok = fwrite(&hdr, sizeof(ephcache_t), 1, fp)==1 &&
+		fwrite(ionoutc, sizeof(ionoutc_t), 1, fp)==1 &&
+		(neph==0 || fwrite(list, sizeof(ephem_t), neph, fp)==(size_t)neph);
+
+	if (fclose(fp)!=0)
+		ok = FALSE;
+
+#ifdef _WIN32
+	if (ok)
+		remove(cachefile); // rename() does not replace an existing file
+#endif
+	if (!ok || rename(tmpfile, cachefile)!=0)
+	{
+		remove(tmpfile);
+		return(-1);
+	}
+
+	return(0);
+}
+
+/*! \brief Insert an ephemeris into the store
+ *  \param store Ephemeris store
+ *  \param[in] eph Ephemeris, replaces a stored one of the same PRN and TOE
+ *  \returns 0 on success, -1 on error
+ */
+int addEphemeris(ephstore_t *store, const ephem_t *eph)
+{
+	int sv = eph->prn-1;
+	int lo,hi,mid;
+	double dt;
+	ephem_t *tmp;
+
+	// First entry with a TOE not before the new one
+	lo = 0;
+	hi = store->neph[sv];
+	while (lo<hi)
+	{
+		mid = (lo+hi)/2;
+		if (subGpsTime(store->eph[sv][mid].toe, eph->toe)<0.0)
+			lo = mid+1;
+		else
+			hi = mid;
+	}
+
+	if (lo<store->neph[sv])
+	{
+		dt = subGpsTime(store->eph[sv][lo].toe, eph->toe);
+		if (dt==0.0)
+		{
+			store->eph[sv][lo] = *eph; // The later record wins
+			return(0);
+		}
+	}
+
+	if (store->neph[sv]==store->size[sv])
+	{
+		store->size[sv] = (store->size[sv]==0)?16:2*store->size[sv];
+		if (NULL==(tmp=realloc(store->eph[sv], store->size[sv]*sizeof(ephem_t))))
+			return(-1);
+		store->eph[sv] = tmp;
+	}
+
+	memmove(&store->eph[sv][lo+1], &store->eph[sv][lo], (store->neph[sv]-lo)*sizeof(ephem_t));
+	store->eph[sv][lo] = *eph;
+	store->neph[sv]++;
+
+	if (store->tlast.week<0 || subGpsTime(eph->toe, store->tlast)>0.0)
+		store->tlast = eph->toe;
+
+	return(0);
+}
+
+/*! \brief Read the next RINEX file into the ephemeris store
+ *  \param store Ephemeris store
+ *  \param[out] ionoutc Iono/UTC parameters, taken from the first file
+ *  \returns Number of ephemeris records read, -1 on error
+ */
+int loadNextEphemFile(ephstore_t *store, ionoutc_t *ionoutc)
+{
+	const char *fname;
+	const char *base;
+	char cachefile[2*MAX_CHAR];
+	ephcache_t key;
+	ephem_t *list;
+	ionoutc_t iono;
+	int neph,i,len;
+	int usecache = (store->cachedir!=NULL);
+	int cached = FALSE;
+
+	if (store->ifile>=store->nfile)
+		return(0);
+
+	fname = store->files[store->ifile++];
+
+	if (usecache)
+	{
+		base = strrchr(fname, '/');
+#ifdef _WIN32
+		if (strrchr(fname, '\\')>base)
+			base = strrchr(fname, '\\');
+#endif
+		base = (base==NULL)?fname:base+1;
+		len = snprintf(cachefile, sizeof(cachefile), "%s/%s.cache", store->cachedir, base);
+
+		if (len<0 || len>=(int)sizeof(cachefile))
+		{
+			fprintf(stderr, "WARNING: Ephemeris cache path too long. Not using the cache for %s.\n", fname);
+			usecache = FALSE;
+		}
+	}
+
+	if (usecache)
+	{
+		if (getEphemCacheKey(fname, &key)==-1)
+			return(-1);
+
+		if ((neph=readEphemCache(&list, &iono, cachefile, &key))>=0)
+		{
+			cached = TRUE;
+			if (store->verb==TRUE)
+				fprintf(stderr, "Ephemeris loaded from cache %s.\n", cachefile);
+		}
+	}
+
+	if (cached==FALSE)
+	{
+		if ((neph=readRinexNavAll(&list, &iono, fname))==-1)
+			return(-1);
+
+		if (usecache)
+		{
+			if (writeEphemCache(list, neph, &iono, cachefile, &key)==-1)
+				fprintf(stderr, "WARNING: Failed to write ephemeris cache %s.\n", cachefile);
+			else if (store->verb==TRUE)
+				fprintf(stderr, "Ephemeris cache %s updated.\n", cachefile);
+		}
+	}
+
+	// Iono/UTC parameters of the first file
+	if (store->ifile==1)
+	{
+		iono.enable = ionoutc->enable;
+		*ionoutc = iono;
+	}
+
+	for (i=0; i<neph; i++)
+	{
+		if (store->dsec!=0.0)
+		{
+			list[i].toc = incGpsTime(list[i].toc, store->dsec);
+			gps2date(&list[i].toc, &list[i].t);
+			list[i].toe = incGpsTime(list[i].toe, store->dsec);
+		}
+
+		if (addEphemeris(store, &list[i])==-1)
+		{
+			free(list);
+			return(-1);
+		}
+	}
+
+	free(list);
+
+	return(neph);
+}
+
+/*! \brief Read the RINEX files needed up to the given time
+ *  \param store Ephemeris store
+ *  \param[out] ionoutc Iono/UTC parameters
+ *  \param[in] g Scenario time
+ *  \returns 0 on success, -1 on error
+ */
+int loadEphemerides(ephstore_t *store, ionoutc_t *ionoutc, gpstime_t g)
+{
+	while (store->ifile<store->nfile &&
+		(store->tlast.week<0 || subGpsTime(store->tlast, g)<EPHEM_LOOKAHEAD))
+	{
+		if (loadNextEphemFile(store, ionoutc)==-1)
+		{
+			fprintf(stderr, "ERROR: Failed to read ephemeris file %s.\n", store->files[store->ifile-1]);
+			return(-1);
+		}
+	}
+
+	return(0);
+}
+
+/*! \brief Find the ephemeris of a satellite to be broadcast at a given time
+ *  \param[in] store Ephemeris store
+ *  \param[in] sv Satellite index (PRN-1)
+ *  \param[in] g GPS time
+ *  \returns The latest ephemeris with a TOE less than one hour ahead of \a g,
+ *   NULL if there is none or it is older than EPHEM_MAX_AGE
+ */
+const ephem_t *findEphemeris(const ephstore_t *store, int sv, gpstime_t g)
+{
+	int lo,hi,mid;
+
+	// Number of entries with a TOE less than one hour ahead
+	lo = 0;
+	hi = store->neph[sv];
+	while (lo<hi)
+	{
+		mid = (lo+hi)/2;
+		if (subGpsTime(store->eph[sv][mid].toe, g)<SECONDS_IN_HOUR)
+			lo = mid+1;
+		else
+			hi = mid;
+	}
+
+	if (lo==0 || subGpsTime(g, store->eph[sv][lo-1].toe)>EPHEM_MAX_AGE)
+		return(NULL);
+
+	return(&store->eph[sv][lo-1]);
+}
+
+void freeEphemStore(ephstore_t *store)
+{
+	int sv;
+
+	for (sv=0; sv<MAX_SAT; sv++)
+	{
+		free(store->eph[sv]);
+		store->eph[sv] = NULL;
+		store->neph[sv] = 0;
+		store->size[sv] = 0;
+	}
+
+	return;
+}
+
+double ionosphericDelay(const ionoutc_t *ionoutc, gpstime_t g, double *llh, double *azel)
+{
+	double iono_delay = 0.0;
+	double E,phi_u,lam_u,F;
+
+	if (ionoutc->enable==FALSE)
+		return (0.0); // No ionospheric delay
+
+	E = azel[1]/PI;
+	phi_u = llh[0]/PI;
+	lam_u = llh[1]/PI;
+
+	// Obliquity factor
+	F = 1.0 + 16.0*pow((0.53 - E),3.0);
+
+	if (ionoutc->vflg==FALSE)
+		iono_delay = F*5.0e-9*SPEED_OF_LIGHT;
+	else
+	{
+		double t,psi,phi_i,lam_i,phi_m,phi_m2,phi_m3;
+		double AMP,PER,X,X2,X4;
+
+		// Earth's central angle between the user position and the earth projection of
+		// ionospheric intersection point (semi-circles)
+		psi = 0.0137/(E + 0.11) - 0.022;
+		
+		// Geodetic latitude of the earth projection of the ionospheric intersection point
+		// (semi-circles)
+		phi_i = phi_u + psi*cos(azel[0]);
+		if(phi_i>0.416)
+			phi_i = 0.416;
+		else if(phi_i<-0.416)
+			phi_i = -0.416;
+
+		// Geodetic longitude of the earth projection of the ionospheric intersection point
+		// (semi-circles)
+		lam_i = lam_u + psi*sin(azel[0])/cos(phi_i*PI);
+
+		// Geomagnetic latitude of the earth projection of the ionospheric intersection
+		// point (mean ionospheric height assumed 350 km) (semi-circles)
+		phi_m = phi_i + 0.064*cos((lam_i - 1.617)*PI);
+		phi_m2 = phi_m*phi_m;
+		phi_m3 = phi_m2*phi_m;
+
+		AMP = ionoutc->alpha0 + ionoutc->alpha1*phi_m
 			+ ionoutc->alpha2*phi_m2 + ionoutc->alpha3*phi_m3;
 		if (AMP<0.0)
 			AMP = 0.0;
@@ -1244,77 +2146,123 @@ double ionosphericDelay(const ionoutc_t *ionoutc, gpstime_t g, double *llh, doub
 	return (iono_delay);
 }
 
-/*! \brief Compute range between a satellite and the receiver
- *  \param[out] rho The computed range
- *  \param[in] eph Ephemeris data of the satellite
+/*! \brief Compute ranges between a batch of satellites and the receiver
+ *  \param[out] rho The computed ranges, indexed by slot
+ *  \param[in] ss Satellite batch with the states at \a g from \ref satposBatch
+ *  \param[in] ionoutc Iono/UTC parameters
  *  \param[in] g GPS time at time of receiving the signal
- *  \param[in] xyz position of the receiver
+ *  \param[in] rx Receiver frame
  */
-void computeRange(range_t *rho, ephem_t eph, ionoutc_t *ionoutc, gpstime_t g, double xyz[])
+void computeRanges(range_t *rho, const satstate_t *ss, const ionoutc_t *ionoutc, gpstime_t g, const rxframe_t *rx)
 {
-	double pos[3],vel[3],clk[2];
-	double los[3];
+	double los[3][MAX_SAT];
+	double neu[3][MAX_SAT];
+	double d[MAX_SAT],rate[MAX_SAT];
+	double lx,ly,lz;
+	double px,py,pz;
 	double tau;
-	double range,rate;
 	double xrot,yrot;
+	double nv[3],llh[3];
+	int i;
 
-	double llh[3],neu[3];
-	double tmat[3][3];
-	
-	// SV position at time of the pseudorange observation.
-	satpos(eph, g, pos, vel, clk);
+	for (i=0; i<ss->n; i++)
+	{
+		// Receiver to satellite vector and light-time.
+		lx = ss->pos[0][i] - rx->xyz[0];
+		ly = ss->pos[1][i] - rx->xyz[1];
+		lz = ss->pos[2][i] - rx->xyz[2];
+		tau = sqrt(lx*lx+ly*ly+lz*lz)/SPEED_OF_LIGHT;
+
+		// Extrapolate the satellite position backwards to the transmission time.
+		px = ss->pos[0][i] - ss->vel[0][i]*tau;
+		py = ss->pos[1][i] - ss->vel[1][i]*tau;
+		pz = ss->pos[2][i] - ss->vel[2][i]*tau;
+
+		// Earth rotation correction. The change in velocity can be neglected.
+		xrot = px + py*OMEGA_EARTH*tau;
+		yrot = py - px*OMEGA_EARTH*tau;
+
+		// New observer to satellite vector and satellite range.
+		los[0][i] = xrot - rx->xyz[0];
+		los[1][i] = yrot - rx->xyz[1];
+		los[2][i] = pz - rx->xyz[2];
+		d[i] = sqrt(los[0][i]*los[0][i]+los[1][i]*los[1][i]+los[2][i]*los[2][i]);
+
+		// Relative velocity of SV and receiver.
+		rate[i] = (ss->vel[0][i]*los[0][i]+ss->vel[1][i]*los[1][i]+ss->vel[2][i]*los[2][i])/d[i];
+
+		// Line of sight in the local frame.
+		neu[0][i] = rx->tmat[0][0]*los[0][i] + rx->tmat[0][1]*los[1][i] + rx->tmat[0][2]*los[2][i];
+		neu[1][i] = rx->tmat[1][0]*los[0][i] + rx->tmat[1][1]*los[1][i] + rx->tmat[1][2]*los[2][i];
+		neu[2][i] = rx->tmat[2][0]*los[0][i] + rx->tmat[2][1]*los[1][i] + rx->tmat[2][2]*los[2][i];
+	}
+
+	llh[0] = rx->llh[0];
+	llh[1] = rx->llh[1];
+	llh[2] = rx->llh[2];
 
-	// Receiver to satellite vector and light-time.
-	subVect(los, pos, xyz);
-	tau = normVect(los)/SPEED_OF_LIGHT;
+	for (i=0; i<ss->n; i++)
+	{
+		if (ss->prn[i]==0)
+			continue;
 
-	// Extrapolate the satellite position backwards to the transmission time.
-	pos[0] -= vel[0]*tau;
-	pos[1] -= vel[1]*tau;
-	pos[2] -= vel[2]*tau;
+		rho[i].d = d[i];
 
-	// Earth rotation correction. The change in velocity can be neglected.
-	xrot = pos[0] + pos[1]*OMEGA_EARTH*tau;
-	yrot = pos[1] - pos[0]*OMEGA_EARTH*tau;
-	pos[0] = xrot;
-	pos[1] = yrot;
+		// Pseudorange.
+		rho[i].range = d[i] - SPEED_OF_LIGHT*ss->clk[0][i];
 
-	// New observer to satellite vector and satellite range.
-	subVect(los, pos, xyz);
-	range = normVect(los);
-	rho->d = range;
+		// Pseudorange rate.
+		rho[i].rate = rate[i]; // - SPEED_OF_LIGHT*clk[1];
 
-	// Pseudorange.
-	rho->range = range - SPEED_OF_LIGHT*clk[0];
+		// Time of application.
+		rho[i].g = g;
 
-	// Relative velocity of SV and receiver.
-	rate = dotProd(vel, los)/range;
+		// Azimuth and elevation angles.
+		nv[0] = neu[0][i];
+		nv[1] = neu[1][i];
+		nv[2] = neu[2][i];
+		neu2azel(rho[i].azel, nv);
 
-	// Pseudorange rate.
-	rho->rate = rate; // - SPEED_OF_LIGHT*clk[1];
+		// Add ionospheric delay
+		rho[i].iono_delay = ionosphericDelay(ionoutc, g, llh, rho[i].azel);
+		rho[i].range += rho[i].iono_delay;
+	}
+
+	return;
+}
 
-	// Time of application.
-	rho->g = g;
+/*! \brief Compute range between a satellite and the receiver
+ *  \param[out] rho The computed range
+ *  \param[in] eph Ephemeris data of the satellite
+ *  \param[in] ionoutc Iono/UTC parameters
+ *  \param[in] g GPS time at time of receiving the signal
+ *  \param[in] xyz position of the receiver
+ */
+void computeRange(range_t *rho, const ephem_t *eph, const ionoutc_t *ionoutc, gpstime_t g, const double *xyz)
+{
+	satstate_t ss;
+	rxframe_t rx;
 
-	// Azimuth and elevation angles.
-	xyz2llh(xyz, llh);
-	ltcmat(llh, tmat);
-	ecef2neu(los, tmat, neu);
-	neu2azel(rho->azel, neu);
+	ss.n = 1;
+	ss.window = 0.0;
+	setSatEphemeris(&ss, 0, eph);
+	satposBatch(&ss, g);
 
-	// Add ionospheric delay
-	rho->iono_delay = ionosphericDelay(ionoutc, g, llh, rho->azel);
-	rho->range += rho->iono_delay;
+	initRxFrame(&rx, xyz);
+	computeRanges(rho, &ss, ionoutc, g, &rx);
 
 	return;
 }
 
 /*! \brief Compute the code phase for a given channel (satellite)
  *  \param chan Channel on which we operate (is updated)
+ *  \param nco NCO state, the code phase, data bit counters and phase steps of channel \a i are updated
+ *  \param[in] i Channel index
  *  \param[in] rho1 Current range, after \a dt has expired
  *  \param[in dt delta-t (time difference) in seconds
+ *  \param[in] delt Sampling interval in seconds
  */
-void computeCodePhase(channel_t *chan, range_t rho1, double dt)
+void computeCodePhase(channel_t *chan, ncostate_t *nco, int i, range_t rho1, double dt, double delt)
 {
 	double ms;
 	int ims;
@@ -1327,22 +2275,38 @@ void computeCodePhase(channel_t *chan, range_t rho1, double dt)
 	chan->f_carr = -rhorate/LAMBDA_L1;
 	chan->f_code = CODE_FREQ + chan->f_carr*CARR_TO_CODE;
 
+#ifdef FLOAT_CARR_PHASE
+	nco->carr_phasestep[i] = chan->f_carr * delt;
+#else
+	nco->carr_phasestep[i] = (int)round(512.0 * 65536.0 * chan->f_carr * delt);
+#endif
+
 	// Initial code phase and data bit counters.
 	ms = ((subGpsTime(chan->rho0.g,chan->g0)+6.0) - chan->rho0.range/SPEED_OF_LIGHT)*1000.0;
 
 	ims = (int)ms;
-	chan->code_phase = (ms-(double)ims)*CA_SEQ_LEN; // in chip
+#ifdef FLOAT_CODE_PHASE
+	nco->code_phase[i] = (ms-(double)ims)*CA_SEQ_LEN; // in chip
+	nco->code_phasestep[i] = chan->f_code * delt;
+#else
+	nco->code_phase[i] = (unsigned long long)((ms-(double)ims)*CA_SEQ_LEN*CODE_PHASE_ONE_CHIP);
+	nco->code_phasestep[i] = (unsigned long long)round(chan->f_code*delt*CODE_PHASE_ONE_CHIP);
+#endif
 
-	chan->iword = ims/600; // 1 word = 30 bits = 600 ms
-	ims -= chan->iword*600;
+	nco->iword[i] = ims/600; // 1 word = 30 bits = 600 ms
+	ims -= nco->iword[i]*600;
 			
-	chan->ibit = ims/20; // 1 bit = 20 code = 20 ms
-	ims -= chan->ibit*20;
+	nco->ibit[i] = ims/20; // 1 bit = 20 code = 20 ms
+	ims -= nco->ibit[i]*20;
 
-	chan->icode = ims; // 1 code = 1 ms
+	nco->icode[i] = ims; // 1 code = 1 ms
 
-	chan->codeCA = chan->ca[(int)chan->code_phase]*2-1;
-	chan->dataBit = (int)((chan->dwrd[chan->iword]>>(29-chan->ibit)) & 0x1UL)*2-1;
+#ifdef FLOAT_CODE_PHASE
+	nco->codeCA[i] = nco->ca[i][(int)nco->code_phase[i]];
+#else
+	nco->codeCA[i] = nco->ca[i][(int)(nco->code_phase[i]>>32)];
+#endif
+	nco->dataBit[i] = (int)((chan->dwrd[nco->iword[i]]>>(29-nco->ibit[i])) & 0x1UL)*2-1;
 
 	// Save current pseudorange
 	chan->rho0 = rho1;
@@ -1350,161 +2314,565 @@ void computeCodePhase(channel_t *chan, range_t rho1, double dt)
 	return;
 }
 
-/*! \brief Read the list of user motions from the input file
- *  \param[out] xyz Output array of ECEF vectors for user motion
- *  \param[[in] filename File name of the text input file
- *  \returns Number of user data motion records read, -1 on error
+/*! \brief Open a user motion file for streaming
+ *  \param[out] um User motion reader
+ *  \param[in] filename File name of the text input file
+ *  \param[in] format UM_ECEF, UM_LLH or UM_NMEA_GGA
+ *  \returns 0 on success, -1 on error
+ *
+ * Regular files are memory-mapped. Other files, such as pipes, are read
+ * line by line.
  */
-int readUserMotion(double xyz[USER_MOTION_SIZE][3], const char *filename)
+int openUserMotion(usermotion_t *um, const char *filename, int format)
 {
-	FILE *fp;
-	int numd;
-	char str[MAX_CHAR];
-	double t,x,y,z;
+	memset(um, 0, sizeof(usermotion_t));
 
-	if (NULL==(fp=fopen(filename,"rt")))
-		return(-1);
+	um->name = filename;
+	um->format = format;
 
-	for (numd=0; numd<USER_MOTION_SIZE; numd++)
+#if !defined(_WIN32) && !defined(MOTION_STDIO)
 	{
-		if (fgets(str, MAX_CHAR, fp)==NULL)
-			break;
+		int fd;
+		struct stat st;
+		void *map;
 
-		if (EOF==sscanf(str, "%lf,%lf,%lf,%lf", &t, &x, &y, &z)) // Read CSV line
-			break;
+		if ((fd=open(filename, O_RDONLY))==-1)
+			return(-1);
+
+		if (fstat(fd, &st)==0 && S_ISREG(st.st_mode) && st.st_size>0)
+		{
+			map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+			if (map!=MAP_FAILED)
+			{
+				madvise(map, (size_t)st.st_size, MADV_SEQUENTIAL);
+				um->map = (const char *)map;
+				um->size = (size_t)st.st_size;
+				close(fd);
+
+				return(0);
+			}
+		}
 
-		xyz[numd][0] = x;
-		xyz[numd][1] = y;
-		xyz[numd][2] = z;
+		close(fd);
 	}
+#endif
 
-	fclose(fp);
+	if (NULL==(um->fp=fopen(filename,"rt")))
+		return(-1);
 
-	return (numd);
+	return(0);
 }
 
-/*! \brief Read the list of user motions from the input file
- *  \param[out] xyz Output array of LatLonHei coordinates for user motion
- *  \param[[in] filename File name of the text input file with format Lat,Lon,Hei
- *  \returns Number of user data motion records read, -1 on error
- *
- * Added by romalvarezllorens@gmail.com
+void closeUserMotion(usermotion_t *um)
+{
+#if !defined(_WIN32) && !defined(MOTION_STDIO)
+	if (um->map!=NULL)
+		munmap((void *)um->map, um->size);
+#endif
+	um->map = NULL;
+
+	if (um->fp!=NULL)
+		fclose(um->fp);
+	um->fp = NULL;
+
+	return;
+}
+
+/*! \brief Get the next line of the user motion file
+ *  \param um User motion reader
+ *  \param[out] end End of the line, excluding the line feed
+ *  \returns Beginning of the line, NULL at the end of the file
  */
-int readUserMotionLLH(double xyz[USER_MOTION_SIZE][3], const char *filename)
+const char *nextUserMotionLine(usermotion_t *um, const char **end)
 {
-	FILE *fp;
-	int numd;
-	double t,llh[3];
-	char str[MAX_CHAR];
+	const char *line;
+	const char *lf;
 
-	if (NULL==(fp=fopen(filename,"rt")))
-		return(-1);
+	um->lineno++;
 
-	for (numd=0; numd<USER_MOTION_SIZE; numd++)
+	if (um->map!=NULL)
 	{
-		if (fgets(str, MAX_CHAR, fp)==NULL)
-			break;
+		if (um->pos>=um->size)
+			return(NULL);
 
-		if (EOF==sscanf(str, "%lf,%lf,%lf,%lf", &t, &llh[0], &llh[1], &llh[2])) // Read CSV line
-			break;
-		
-		if (llh[0] > 90.0 || llh[0] < -90.0 || llh[1]>180.0 || llh[1] < -180.0)
+		line = um->map+um->pos;
+		lf = (const char *)memchr(line, '\n', um->size-um->pos);
+		*end = (lf!=NULL)?lf:um->map+um->size;
+		um->pos = (size_t)(*end-um->map)+1;
+
+#if !defined(_WIN32) && !defined(MOTION_STDIO)
+		// Release the pages already parsed, so the resident memory stays bounded
+		if (um->pos-um->released>=((size_t)16<<20))
 		{
-			fprintf(stderr, "ERROR: Invalid file format (time[s], latitude[deg], longitude[deg], height [m].\n");
-			numd = 0; // Empty user motion
-			break;
+			size_t pagesize = (size_t)sysconf(_SC_PAGESIZE);
+			size_t upto = (um->pos/pagesize)*pagesize;
+
+			madvise((void *)(um->map+um->released), upto-um->released, MADV_DONTNEED);
+			um->released = upto;
 		}
+#endif
+		return(line);
+	}
 
-		llh[0] /= R2D; // convert to RAD
-		llh[1] /= R2D; // convert to RAD
+	if (fgets(um->line, MAX_CHAR, um->fp)==NULL)
+		return(NULL);
 
-		llh2xyz(llh, xyz[numd]);
+	line = um->line;
+	*end = line+strlen(line);
+	if (*end>line && (*end)[-1]=='\n')
+		(*end)--;
+
+	return(line);
+}
+
+double pow10Table[23] = {
+	1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+	1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+/*! \brief Scan a decimal floating-point number
+ *  \param[in] p Beginning of the text, leading blanks are skipped
+ *  \param[in] end End of the text
+ *  \param[out] x Scanned value
+ *  \returns Pointer past the number, NULL if there is no number
+ *
+ * Numbers with up to 15 significant digits and a small exponent, which is
+ * the case for all motion and NMEA files, are converted exactly with a
+ * single multiplication or division. The result is correctly rounded, the
+ * same as with strtod(), which is used for all other numbers.
+ */
+const char *scanDouble(const char *p, const char *end, double *x)
+{
+	const char *start;
+	unsigned long long m = 0;
+	int ndig = 0; // Significant digits
+	int nd = 0; // All digits
+	int e = 0;
+	int neg = FALSE;
+	int exp10,expneg;
+	char tmp[MAX_CHAR];
+
+	while (p<end && (*p==' ' || *p=='\t'))
+		p++;
+
+	start = p;
+
+	if (p<end && (*p=='-' || *p=='+'))
+	{
+		neg = (*p=='-');
+		p++;
 	}
 
-	fclose(fp);
+	while (p<end && *p>='0' && *p<='9')
+	{
+		if (ndig<19)
+			m = m*10 + (unsigned long long)(*p-'0');
+		else
+			e++;
+		if (m>0)
+			ndig++;
+		nd++;
+		p++;
+	}
+
+	if (p<end && *p=='.')
+	{
+		p++;
+		while (p<end && *p>='0' && *p<='9')
+		{
+			if (ndig<19)
+			{
+				m = m*10 + (unsigned long long)(*p-'0');
+				e--;
+			}
+			if (m>0)
+				ndig++;
+			nd++;
+			p++;
+		}
+	}
+
+	if (nd==0)
+		return(NULL); // No digits
+
+	if (p<end && (*p=='e' || *p=='E'))
+	{
+		const char *q = p+1;
+
+		exp10 = 0;
+		expneg = FALSE;
+		if (q<end && (*q=='-' || *q=='+'))
+		{
+			expneg = (*q=='-');
+			q++;
+		}
+
+		if (q<end && *q>='0' && *q<='9')
+		{
+			while (q<end && *q>='0' && *q<='9')
+			{
+				if (exp10<10000)
+					exp10 = exp10*10 + (*q-'0');
+				q++;
+			}
+			e += expneg?-exp10:exp10;
+			p = q;
+		}
+	}
+
+	if (ndig<=15 && e>=-22 && e<=22)
+	{
+		*x = (e<0)?(double)m/pow10Table[-e]:(double)m*pow10Table[e];
+		if (neg)
+			*x = -*x;
+	}
+	else
+	{
+		if (p-start>=MAX_CHAR)
+			return(NULL);
+		memcpy(tmp, start, (size_t)(p-start));
+		tmp[p-start] = 0;
+		*x = strtod(tmp, NULL);
+	}
 
-	return (numd);
+	return(p);
 }
 
-int readNmeaGGA(double xyz[USER_MOTION_SIZE][3], const char *filename)
+/*! \brief Report a syntax error in the user motion file */
+void userMotionError(const usermotion_t *um, const char *line, const char *p, const char *msg)
+{
+	fprintf(stderr, "ERROR: %s:%d:%d: %s\n", um->name, um->lineno, (int)(p-line)+1, msg);
+
+	return;
+}
+
+/*! \brief Parse the comma-separated numbers of a CSV user motion line
+ *  \returns 1 on success, 0 for an empty line, -1 on a syntax error
+ */
+int parseMotionCsv(const usermotion_t *um, const char *line, const char *end, double *v, int n)
+{
+	const char *p = line;
+	const char *q;
+	int k;
+
+	while (p<end && (*p==' ' || *p=='\t' || *p=='\r'))
+		p++;
+	if (p==end)
+		return(0);
+
+	for (k=0; k<n; k++)
+	{
+		if ((q=scanDouble(p, end, &v[k]))==NULL)
+		{
+			while (p<end && (*p==' ' || *p=='\t'))
+				p++;
+			userMotionError(um, line, p, "Number expected.");
+			return(-1);
+		}
+		p = q;
+
+		while (p<end && (*p==' ' || *p=='\t'))
+			p++;
+
+		if (k<n-1)
+		{
+			if (p==end || *p!=',')
+			{
+				userMotionError(um, line, p, "Comma expected.");
+				return(-1);
+			}
+			p++;
+		}
+	}
+
+	return(1);
+}
+
+/*! \brief Parse an NMEA GGA sentence
+ *  \returns 1 on success, 0 if the line is not a GGA sentence, -1 on a syntax error
+ */
+int parseNmeaGGA(const usermotion_t *um, const char *line, const char *end, double *llh)
+{
+	const char *fld[15];
+	const char *p;
+	double deg,min;
+	int nfld,k;
+
+	if (end-line<6 || strncmp(line+3, "GGA", 3)!=0)
+		return(0);
+
+	// Split the fields
+	fld[0] = line;
+	nfld = 1;
+	for (p=line; p<end && nfld<15; p++)
+	{
+		if (*p==',')
+			fld[nfld++] = p+1;
+	}
+	for (k=nfld; k<15; k++)
+		fld[k] = end+1;
+
+	if (nfld<12)
+	{
+		userMotionError(um, line, end, "Incomplete GGA sentence.");
+		return(-1);
+	}
+
+	// Latitude: ddmm.mmmm
+	if (fld[2]+2>=fld[3] || scanDouble(fld[2], fld[2]+2, &deg)!=fld[2]+2
+		|| scanDouble(fld[2]+2, fld[3]-1, &min)==NULL)
+	{
+		userMotionError(um, line, fld[2], "Invalid latitude.");
+		return(-1);
+	}
+	llh[0] = deg + min/60.0;
+
+	if (fld[3][0]=='S') // North or south
+		llh[0] *= -1.0;
+
+	llh[0] /= R2D; // in radian
+
+	// Longitude: dddmm.mmmm
+	if (fld[4]+3>=fld[5] || scanDouble(fld[4], fld[4]+3, &deg)!=fld[4]+3
+		|| scanDouble(fld[4]+3, fld[5]-1, &min)==NULL)
+	{
+		userMotionError(um, line, fld[4], "Invalid longitude.");
+		return(-1);
+	}
+	llh[1] = deg + min/60.0;
+
+	if (fld[5][0]=='W') // East or west
+		llh[1] *= -1.0;
+
+	llh[1] /= R2D; // in radian
+
+	// Altitude above mean sea level
+	if (scanDouble(fld[9], fld[10]-1, &llh[2])==NULL)
+	{
+		userMotionError(um, line, fld[9], "Invalid altitude.");
+		return(-1);
+	}
+
+	// Geoid height above WGS84 ellipsoid
+	if (scanDouble(fld[11], fld[12]-1, &min)==NULL)
+	{
+		userMotionError(um, line, fld[11], "Invalid geoid height.");
+		return(-1);
+	}
+	llh[2] += min;
+
+	return(1);
+}
+
+#ifdef MOTION_STDIO
+/*! \brief Read the next point with fgets() and sscanf() (reference implementation)
+ *  \returns 1 if a point was read, 0 at the end of the file, -1 on invalid data
+ */
+int readUserMotionPointStdio(usermotion_t *um, double *xyz)
 {
-	FILE *fp;
-	int numd = 0;
 	char str[MAX_CHAR];
 	char *token;
-	double llh[3],pos[3];
+	char *fld[12];
+	double t,llh[3];
 	char tmp[8];
+	int k,n;
 
-	if (NULL==(fp=fopen(filename,"rt")))
-		return(-1);
-
-	while (1)
+	if (um->format==UM_NMEA_GGA)
 	{
-		if (fgets(str, MAX_CHAR, fp)==NULL)
-			break;
+		while (1)
+		{
+			if (fgets(str, MAX_CHAR, um->fp)==NULL)
+				return(0);
 
-		token = strtok(str, ",");
+			token = strtok(str, ",");
 
-		if (strncmp(token+3, "GGA", 3)==0)
+			if (token!=NULL && strlen(token)>=6 && strncmp(token+3, "GGA", 3)==0)
+				break;
+		}
+
+		// Date and time, latitude, N/S, longitude, E/W, GPS fix, number of
+		// satellites, HDOP, altitude above mean sea level, unit and geoid height
+		for (k=1; k<12; k++)
 		{
-			token = strtok(NULL, ","); // Date and time
-			
-			token = strtok(NULL, ","); // Latitude
-			strncpy(tmp, token, 2);
-			tmp[2] = 0;
-			
-			llh[0] = atof(tmp) + atof(token+2)/60.0;
+			if ((fld[k]=strtok(NULL, ","))==NULL)
+			{
+				fprintf(stderr, "ERROR: Incomplete GGA sentence.\n");
+				return(-1);
+			}
+		}
 
-			token = strtok(NULL, ","); // North or south
-			if (token[0]=='S')
-				llh[0] *= -1.0;
+		// Latitude
+		strncpy(tmp, fld[2], 2);
+		tmp[2] = 0;
 
-			llh[0] /= R2D; // in radian
-			
-			token = strtok(NULL, ","); // Longitude
-			strncpy(tmp, token, 3);
-			tmp[3] = 0;
-			
-			llh[1] = atof(tmp) + atof(token+3)/60.0;
+		llh[0] = atof(tmp) + atof(fld[2]+2)/60.0;
 
-			token = strtok(NULL, ","); // East or west
-			if (token[0]=='W')
-				llh[1] *= -1.0;
+		if (fld[3][0]=='S') // North or south
+			llh[0] *= -1.0;
 
-			llh[1] /= R2D; // in radian
+		llh[0] /= R2D; // in radian
 
-			token = strtok(NULL, ","); // GPS fix
-			token = strtok(NULL, ","); // Number of satellites
-			token = strtok(NULL, ","); // HDOP
+		// Longitude
+		strncpy(tmp, fld[4], 3);
+		tmp[3] = 0;
 
-			token = strtok(NULL, ","); // Altitude above meas sea level
-			
-			llh[2] = atof(token);
+		llh[1] = atof(tmp) + atof(fld[4]+3)/60.0;
 
-			token = strtok(NULL, ","); // in meter
+		if (fld[5][0]=='W') // East or west
+			llh[1] *= -1.0;
 
-			token = strtok(NULL, ","); // Geoid height above WGS84 ellipsoid
-			
-			llh[2] += atof(token);
+		llh[1] /= R2D; // in radian
 
-			// Convert geodetic position into ECEF coordinates
-			llh2xyz(llh, pos);
+		llh[2] = atof(fld[9]); // Altitude above meas sea level
+		llh[2] += atof(fld[11]); // Geoid height above WGS84 ellipsoid
 
-			xyz[numd][0] = pos[0];
-			xyz[numd][1] = pos[1];
-			xyz[numd][2] = pos[2];
-			
-			// Update the number of track points
-			numd++;
+		// Convert geodetic position into ECEF coordinates
+		llh2xyz(llh, xyz);
 
-			if (numd>=USER_MOTION_SIZE)
-				break;
+		return(1);
+	}
+
+	if (fgets(str, MAX_CHAR, um->fp)==NULL)
+		return(0);
+
+	if (um->format==UM_LLH)
+	{
+		if (EOF==(n=sscanf(str, "%lf,%lf,%lf,%lf", &t, &llh[0], &llh[1], &llh[2]))) // Read CSV line
+			return(0);
+
+		if (n<4 || llh[0] > 90.0 || llh[0] < -90.0 || llh[1]>180.0 || llh[1] < -180.0)
+		{
+			fprintf(stderr, "ERROR: Invalid file format (time[s], latitude[deg], longitude[deg], height [m].\n");
+			return(-1);
+		}
+
+		llh[0] /= R2D; // convert to RAD
+		llh[1] /= R2D; // convert to RAD
+
+		llh2xyz(llh, xyz);
+	}
+	else // UM_ECEF
+	{
+		if (EOF==(n=sscanf(str, "%lf,%lf,%lf,%lf", &t, &xyz[0], &xyz[1], &xyz[2]))) // Read CSV line
+			return(0);
+
+		if (n<4)
+		{
+			fprintf(stderr, "ERROR: Invalid file format (time[s], x[m], y[m], z[m]).\n");
+			return(-1);
 		}
 	}
 
-	fclose(fp);
+	return(1);
+}
+#endif
+
+/*! \brief Read the next point of the user motion
+ *  \param um User motion reader
+ *  \param[out] xyz ECEF position of the point
+ *  \returns 1 if a point was read, 0 at the end of the file, -1 on invalid data
+ */
+int readUserMotionPoint(usermotion_t *um, double *xyz)
+{
+	const char *line,*end;
+	double v[4],llh[3];
+	int ret;
+
+#ifdef MOTION_STDIO
+	return(readUserMotionPointStdio(um, xyz));
+#endif
+
+	if (um->format==UM_NMEA_GGA)
+	{
+		do
+		{
+			if ((line=nextUserMotionLine(um, &end))==NULL)
+				return(0);
+		} while ((ret=parseNmeaGGA(um, line, end, llh))==0);
+
+		if (ret<0)
+			return(-1);
+
+		// Convert geodetic position into ECEF coordinates
+		llh2xyz(llh, xyz);
+
+		return(1);
+	}
+
+	if ((line=nextUserMotionLine(um, &end))==NULL)
+		return(0);
+
+	if ((ret=parseMotionCsv(um, line, end, v, 4))!=1) // time, x, y, z or time, lat, lon, height
+		return(ret);
+
+	if (um->format==UM_LLH)
+	{
+		// Added by romalvarezllorens@gmail.com
+		if (v[1] > 90.0 || v[1] < -90.0 || v[2]>180.0 || v[2] < -180.0)
+		{
+			fprintf(stderr, "ERROR: %s:%d: Invalid file format (time[s], latitude[deg], longitude[deg], height [m].\n",
+				um->name, um->lineno);
+			return(-1);
+		}
+
+		llh[0] = v[1] / R2D; // convert to RAD
+		llh[1] = v[2] / R2D; // convert to RAD
+		llh[2] = v[3];
 
-	return (numd);
+		llh2xyz(llh, xyz);
+	}
+	else // UM_ECEF
+	{
+		xyz[0] = v[1];
+		xyz[1] = v[2];
+		xyz[2] = v[3];
+	}
+
+	return(1);
+}
+
+/*! \brief Get the user position at a given time, reading the motion file on demand
+ *  \param um User motion reader
+ *  \param[in] tms Time since the start of the user motion in milliseconds
+ *  \param[out] pos ECEF position, linearly interpolated between the 10Hz points
+ *  \returns 1 on success, 0 beyond the end of the user motion, -1 on invalid data
+ *
+ * Only the last two points are kept in memory, so \a tms must not decrease
+ * by more than one point between calls.
+ */
+int getUserMotion(usermotion_t *um, int tms, double *pos)
+{
+	int iumd = tms/100;
+	double a = (double)(tms%100)/100.0;
+	int need = (a==0.0)?iumd:iumd+1;
+	double *x0,*x1;
+	int ret;
+
+	while (um->numd<=need)
+	{
+		if ((ret=readUserMotionPoint(um, um->xyz[um->numd%2]))!=1)
+			return(ret);
+		um->numd++;
+	}
+
+	x0 = um->xyz[iumd%2];
+
+	if (a==0.0)
+	{
+		pos[0] = x0[0];
+		pos[1] = x0[1];
+		pos[2] = x0[2];
+	}
+	else
+	{
+		x1 = um->xyz[(iumd+1)%2];
+
+		pos[0] = x0[0] + a*(x1[0]-x0[0]);
+		pos[1] = x0[1] + a*(x1[1]-x0[1]);
+		pos[2] = x0[2] + a*(x1[2]-x0[2]);
+	}
+
+	return(1);
 }
 
 int generateNavMsg(gpstime_t g, channel_t *chan, int init)
@@ -1589,43 +2957,98 @@ int generateNavMsg(gpstime_t g, channel_t *chan, int init)
 	return(1);
 }
 
-int checkSatVisibility(ephem_t eph, gpstime_t g, double *xyz, double elvMask, double *azel)
+/*! \brief Check the visibility of a batch of satellites
+ *  \param[in] ss Satellite batch with the states from \ref satposBatch
+ *  \param[in] rx Receiver frame
+ *  \param[in] elvMask Elevation mask in degree
+ *  \param[out] azel Azimuth and elevation of each slot
+ *  \param[out] vis 1 if the satellite in the slot is visible, 0 otherwise
+ */
+void checkSatVisibility(const satstate_t *ss, const rxframe_t *rx, double elvMask, double azel[][2], int *vis)
 {
-	double llh[3],neu[3];
-	double pos[3],vel[3],clk[3],los[3];
-	double tmat[3][3];
+	double los[3],neu[3];
+	int i;
+
+	for (i=0; i<ss->n; i++)
+	{
+		los[0] = ss->pos[0][i] - rx->xyz[0];
+		los[1] = ss->pos[1][i] - rx->xyz[1];
+		los[2] = ss->pos[2][i] - rx->xyz[2];
+
+		neu[0] = rx->tmat[0][0]*los[0] + rx->tmat[0][1]*los[1] + rx->tmat[0][2]*los[2];
+		neu[1] = rx->tmat[1][0]*los[0] + rx->tmat[1][1]*los[1] + rx->tmat[1][2]*los[2];
+		neu[2] = rx->tmat[2][0]*los[0] + rx->tmat[2][1]*los[1] + rx->tmat[2][2]*los[2];
+
+		neu2azel(azel[i], neu);
+
+		vis[i] = (azel[i][1]*R2D > elvMask)?1:0;
+	}
+
+	return;
+}
 
-	if (eph.vflg != 1)
-		return (-1); // Invalid
+/*! \brief Load the ephemerides of the allocated channels into the satellite batch
+ *  \param[out] ss Satellite batch, slot i holds channel i
+ *  \param[in] chan Channels
+ */
+void loadChannelEphemerides(satstate_t *ss, const channel_t *chan)
+{
+	int i;
 
-	xyz2llh(xyz,llh);
-	ltcmat(llh, tmat);
+	ss->n = 0;
 
-	satpos(eph, g, pos, vel, clk);
-	subVect(los, pos, xyz);
-	ecef2neu(los, tmat, neu);
-	neu2azel(azel, neu);
+	for (i=0; i<MAX_CHAN; i++)
+	{
+		if (chan[i].prn>0)
+		{
+			setSatEphemeris(ss, i, &chan[i].eph);
+			ss->n = i+1;
+		}
+		else
+			setSatEphemeris(ss, i, NULL);
+	}
 
-	if (azel[1]*R2D > elvMask)
-		return (1); // Visible
-	// else
-	return (0); // Invisible
+	return;
 }
 
-int allocateChannel(channel_t *chan, ephem_t *eph, ionoutc_t ionoutc, gpstime_t grx, double *xyz, double elvMask)
+int allocateChannel(channel_t *chan, ncostate_t *nco, const ephstore_t *store, ionoutc_t ionoutc, gpstime_t grx, double *xyz, double elvMask)
 {
 	int nsat=0;
 	int i,sv;
-	double azel[2];
+	const ephem_t *eph[MAX_SAT];
+	int slot[MAX_SAT];
+	satstate_t ss;
+	rxframe_t rx;
+	double azel[MAX_SAT][2];
+	int vis[MAX_SAT];
 
 	range_t rho;
 	double ref[3]={0.0};
 	double r_ref,r_xyz;
 	double phase_ini;
 
+	// Positions of all satellites with an ephemeris
+	ss.n = 0;
+	ss.window = 0.0;
+	for (sv=0; sv<MAX_SAT; sv++)
+	{
+		eph[sv] = findEphemeris(store, sv, grx);
+		slot[sv] = -1;
+
+		if (eph[sv]!=NULL)
+		{
+			slot[sv] = ss.n++;
+			setSatEphemeris(&ss, slot[sv], eph[sv]);
+		}
+	}
+
+	satposBatch(&ss, grx);
+	initRxFrame(&rx, xyz);
+	checkSatVisibility(&ss, &rx, 0.0, azel, vis);
+
 	for (sv=0; sv<MAX_SAT; sv++)
 	{
-		if(checkSatVisibility(eph[sv], grx, xyz, 0.0, azel)==1)
+		if(slot[sv]>=0 && vis[slot[sv]]==1)
 		{
 			nsat++; // Number of visible satellites
 
@@ -1638,34 +3061,36 @@ int allocateChannel(channel_t *chan, ephem_t *eph, ionoutc_t ionoutc, gpstime_t
 					{
 						// Initialize channel
 						chan[i].prn = sv+1;
-						chan[i].azel[0] = azel[0];
-						chan[i].azel[1] = azel[1];
+						chan[i].azel[0] = azel[slot[sv]][0];
+						chan[i].azel[1] = azel[slot[sv]][1];
+						chan[i].eph = *eph[sv];
 
-						// C/A code generation
-						codegen(chan[i].ca, chan[i].prn);
+						// C/A code and data words
+						nco->ca[i] = caTable[sv];
+						nco->dwrd[i] = chan[i].dwrd;
 
 						// Generate subframe
-						eph2sbf(eph[sv], ionoutc, chan[i].sbf);
+						eph2sbf(chan[i].eph, ionoutc, chan[i].sbf);
 
 						// Generate navigation message
 						generateNavMsg(grx, &chan[i], 1);
 
 						// Initialize pseudorange
-						computeRange(&rho, eph[sv], &ionoutc, grx, xyz);
+						computeRange(&rho, &chan[i].eph, &ionoutc, grx, xyz);
 						chan[i].rho0 = rho;
 
 						// Initialize carrier phase
 						r_xyz = rho.range;
 
-						computeRange(&rho, eph[sv], &ionoutc, grx, ref);
+						computeRange(&rho, &chan[i].eph, &ionoutc, grx, ref);
 						r_ref = rho.range;
 
 						phase_ini = (2.0*r_ref - r_xyz)/LAMBDA_L1;
 #ifdef FLOAT_CARR_PHASE
-						chan[i].carr_phase = phase_ini - floor(phase_ini);
+						nco->carr_phase[i] = phase_ini - floor(phase_ini);
 #else
 						phase_ini -= floor(phase_ini);
-						chan[i].carr_phase = (unsigned int)(512.0 * 65536.0 * phase_ini);
+						nco->carr_phase[i] = (unsigned int)(512.0 * 65536.0 * phase_ini);
 #endif
 						// Done.
 						break;
@@ -1687,14 +3112,1703 @@ int allocateChannel(channel_t *chan, ephem_t *eph, ionoutc_t ionoutc, gpstime_t
 		}
 	}
 
-	return(nsat);
+	return(nsat);
+}
+
+/*! \brief Advance the code and data bit counters by one C/A code period
+ *  \param nco NCO state (is updated)
+ *  \param[in] i Channel index
+ */
+void nextCodePeriod(ncostate_t *nco, int i)
+{
+	nco->icode[i]++;
+
+	if (nco->icode[i]>=20) // 20 C/A codes = 1 navigation data bit
+	{
+		nco->icode[i] = 0;
+		nco->ibit[i]++;
+
+		if (nco->ibit[i]>=30) // 30 navigation data bits = 1 word
+		{
+			nco->ibit[i] = 0;
+			nco->iword[i]++;
+			/*
+			if (nco->iword[i]>=N_DWRD)
+				fprintf(stderr, "\nWARNING: Subframe word buffer overflow.\n");
+			*/
+		}
+
+		// Set new navigation data bit
+		nco->dataBit[i] = (int)((nco->dwrd[i][nco->iword[i]]>>(29-nco->ibit[i])) & 0x1UL)*2-1;
+	}
+
+	return;
+}
+
+#ifndef FLOAT_CODE_PHASE
+/*! \brief Generate the spreading code in runs of samples between chip transitions
+ *  \param nco NCO state, the code and data bit state of channel \a i is updated
+ *  \param[in] i Channel index
+ *  \param[out] code Product of the data bit and C/A code chip (+1/-1) for each sample
+ *  \param[in] nsamp Number of samples
+ *
+ * The code chip and the data bit are constant until the code phase crosses
+ * the next chip boundary, so the counters only need to be updated once per
+ * chip instead of once per sample. The result is identical to stepping the
+ * code phase sample by sample.
+ */
+void generateCodeRuns(ncostate_t *nco, int i, signed char *code, int nsamp)
+{
+	const signed char *ca = nco->ca[i];
+	unsigned long long phase = nco->code_phase[i];
+	unsigned long long step = nco->code_phasestep[i];
+	unsigned long long edge;
+	int codeCA = nco->codeCA[i];
+	int nmax = (int)((((unsigned long long)1<<32)+step-1)/step); // Longest possible run
+	int isamp,k,n;
+	signed char c;
+
+	for (isamp=0; isamp<nsamp; isamp+=n)
+	{
+		// Number of samples until the next chip transition.
+		// Right after a transition, this is either nmax or nmax-1.
+		edge = ((phase>>32)+1)<<32;
+		n = nmax;
+		while (n>1 && phase+(unsigned long long)(n-1)*step>=edge)
+			n--;
+
+		if (n>nsamp-isamp)
+			n = nsamp-isamp;
+
+		c = (signed char)(nco->dataBit[i] * codeCA);
+		for (k=0; k<n; k++)
+			code[isamp+k] = c;
+
+		// Update code phase
+		phase += (unsigned long long)n*step;
+
+		if (phase>=CODE_PHASE_SEQ_LEN)
+		{
+			phase -= CODE_PHASE_SEQ_LEN;
+			nextCodePeriod(nco, i);
+		}
+
+		// Set current code chip
+		codeCA = ca[(int)(phase>>32)];
+	}
+
+	nco->code_phase[i] = phase;
+	nco->codeCA[i] = codeCA;
+
+	return;
+}
+#endif
+
+/*! \brief Generate the spreading code and data bit of each sample of a channel
+ *  \param nco NCO state, the code and data bit state of channel \a i is updated
+ *  \param[in] i Channel index
+ *  \param[out] code Product of the data bit and C/A code chip (+1/-1) for each sample
+ *  \param[in] nsamp Number of samples
+ */
+void generateCodeSequence(ncostate_t *nco, int i, signed char *code, int nsamp)
+{
+	// The code phase and chip are kept in registers. The byte stores to code[]
+	// would otherwise force them to be reloaded every sample, and channels of
+	// other workers share the cache lines of the NCO state.
+	const signed char *ca = nco->ca[i];
+#ifdef FLOAT_CODE_PHASE
+	double phase = nco->code_phase[i];
+	double step = nco->code_phasestep[i];
+#else
+	unsigned long long phase = nco->code_phase[i];
+	unsigned long long step = nco->code_phasestep[i];
+#endif
+	int codeCA = nco->codeCA[i];
+	int isamp;
+
+#ifndef FLOAT_CODE_PHASE
+	if (step*CHIP_RUN_MIN_SAMPLES <= ((unsigned long long)1<<32))
+	{
+		generateCodeRuns(nco, i, code, nsamp);
+		return;
+	}
+#endif
+
+	for (isamp=0; isamp<nsamp; isamp++)
+	{
+		code[isamp] = (signed char)(nco->dataBit[i] * codeCA);
+
+		// Update code phase
+		phase += step;
+
+#ifdef FLOAT_CODE_PHASE
+		if (phase>=CA_SEQ_LEN)
+		{
+			phase -= CA_SEQ_LEN;
+			nextCodePeriod(nco, i);
+		}
+
+		// Set current code chip
+		codeCA = ca[(int)phase];
+#else
+		if (phase>=CODE_PHASE_SEQ_LEN)
+		{
+			phase -= CODE_PHASE_SEQ_LEN;
+			nextCodePeriod(nco, i);
+		}
+
+		// Set current code chip
+		codeCA = ca[(int)(phase>>32)];
+#endif
+	}
+
+	nco->code_phase[i] = phase;
+	nco->codeCA[i] = codeCA;
+
+	return;
+}
+
+/*! \brief Mix the spread code with the carrier and add it to the I/Q accumulator
+ *  \param acc Accumulator of 2*\a nsamp interleaved I/Q integers
+ *  \param[in] code Product of the data bit and C/A code chip for each sample
+ *  \param[in] phase Carrier phase of the first sample
+ *  \param[in] step Carrier phase step per sample
+ *  \param[in] gain Signal gain scaled by 2^7
+ *  \param[in] nsamp Number of samples
+ *
+ * This is the reference implementation of the SIMD kernels below.
+ */
+void mixCarrierScalar(int *acc, const signed char *code, unsigned int phase, unsigned int step, int gain, int nsamp)
+{
+	int isamp;
+	int iTable;
+
+	for (isamp=0; isamp<nsamp; isamp++)
+	{
+		iTable = (phase >> 16) & 0x1ff; // 9-bit index
+
+		acc[isamp*2] += code[isamp] * cosTable512[iTable] * gain;
+		acc[isamp*2+1] += code[isamp] * sinTable512[iTable] * gain;
+
+		phase += step;
+	}
+
+	return;
+}
+
+#ifdef USE_AVX2
+/*! \brief Look up 32 entries of the first quarter of the sine table
+ *  \param[in] tab The 128-entry quarter in eight 16-byte parts, each in both lanes
+ *  \param[in] k Byte indices 0 to 127
+ */
+__attribute__((target("avx2")))
+__m256i lookupSinQuarterAVX2(const __m256i *tab, __m256i k)
+{
+	__m256i r01,r23,r45,r67,m;
+
+	// Look up all eight parts by bits 0 to 3 and select by bits 4 to 6,
+	// which are shifted into the sign bit of each byte for the blends
+	m = _mm256_slli_epi16(k, 3);
+	r01 = _mm256_blendv_epi8(_mm256_shuffle_epi8(tab[0], k), _mm256_shuffle_epi8(tab[1], k), m);
+	r23 = _mm256_blendv_epi8(_mm256_shuffle_epi8(tab[2], k), _mm256_shuffle_epi8(tab[3], k), m);
+	r45 = _mm256_blendv_epi8(_mm256_shuffle_epi8(tab[4], k), _mm256_shuffle_epi8(tab[5], k), m);
+	r67 = _mm256_blendv_epi8(_mm256_shuffle_epi8(tab[6], k), _mm256_shuffle_epi8(tab[7], k), m);
+
+	m = _mm256_slli_epi16(k, 2);
+	r01 = _mm256_blendv_epi8(r01, r23, m);
+	r45 = _mm256_blendv_epi8(r45, r67, m);
+
+	m = _mm256_slli_epi16(k, 1);
+
+	return(_mm256_blendv_epi8(r01, r45, m));
+}
+
+/*! \brief Scale 8 I/Q pairs of 16 bits by the gain and add them to the accumulator
+ *  \param acc Accumulator of the samples in lane 0, followed by those in lane 1
+ *  \param[in] iq Pairs of 2 samples each in lane 0 and lane 1, in the unpack order
+ *  \param[in] g Gain in every word
+ */
+__attribute__((target("avx2")))
+void addCarrierAVX2(int *acc, __m256i iq, __m256i g)
+{
+	__m256i lo,hi,r1,r2;
+
+	// 32-bit products from the low and high halves
+	lo = _mm256_mullo_epi16(iq, g);
+	hi = _mm256_mulhi_epi16(iq, g);
+	r1 = _mm256_unpacklo_epi16(lo, hi); // I0 Q0 I1 Q1 | I4 Q4 I5 Q5
+	r2 = _mm256_unpackhi_epi16(lo, hi); // I2 Q2 I3 Q3 | I6 Q6 I7 Q7
+
+	_mm256_storeu_si256((__m256i *)acc, _mm256_add_epi32(
+		_mm256_loadu_si256((const __m256i *)acc), _mm256_permute2x128_si256(r1, r2, 0x20)));
+	_mm256_storeu_si256((__m256i *)(acc+8), _mm256_add_epi32(
+		_mm256_loadu_si256((const __m256i *)(acc+8)), _mm256_permute2x128_si256(r1, r2, 0x31)));
+
+	return;
+}
+
+/*! \brief AVX2 version of \ref mixCarrierScalar without gathers
+ *
+ * The sine and cosine tables are symmetric copies of their first quarter,
+ * which fits in eight registers of bytes. The table lookups of 32 samples
+ * are done with byte shuffles and blends, and the quadrant gives the sign.
+ * Gathers are slow on AMD processors and on Intel processors with the
+ * Gather Data Sampling mitigation.
+ */
+__attribute__((target("avx2")))
+void mixCarrierAVX2(int *acc, const signed char *code, unsigned int phase, unsigned int step, int gain, int nsamp)
+{
+	__m256i tab[8];
+	__m256i ph[4],ph32,w[2],ks[2],b7[2],b8[2];
+	__m256i k,qs,qc,c16,sinv,cosv;
+	__m256i mask9 = _mm256_set1_epi32(0x1ff);
+	__m256i mask7 = _mm256_set1_epi16(0x7f);
+	__m256i zero = _mm256_setzero_si256();
+	__m256i g;
+	int isamp,j;
+
+	// The products with the gain are formed from 16-bit halves
+	if (gain<-32768 || gain>32767)
+	{
+		mixCarrierScalar(acc, code, phase, step, gain, nsamp);
+		return;
+	}
+
+	g = _mm256_set1_epi16((short)gain);
+
+	for (j=0; j<8; j++)
+		tab[j] = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)(sinQuarter128+16*j)));
+
+	ph[0] = _mm256_add_epi32(_mm256_set1_epi32((int)phase),
+		_mm256_mullo_epi32(_mm256_set1_epi32((int)step), _mm256_setr_epi32(0,1,2,3,4,5,6,7)));
+	for (j=1; j<4; j++)
+		ph[j] = _mm256_add_epi32(ph[j-1], _mm256_set1_epi32((int)(step*8U)));
+	ph32 = _mm256_set1_epi32((int)(step*32U));
+
+	for (isamp=0; isamp+32<=nsamp; isamp+=32)
+	{
+		for (j=0; j<2; j++)
+		{
+			// 9-bit table indices in words, samples 0-3,8-11 | 4-7,12-15 of 16
+			w[j] = _mm256_packus_epi32(
+				_mm256_and_si256(_mm256_srli_epi32(ph[2*j], 16), mask9),
+				_mm256_and_si256(_mm256_srli_epi32(ph[2*j+1], 16), mask9));
+
+			// Quadrant bits as masks. The sine is mirrored in the second and
+			// fourth quadrants and negative in the third and fourth.
+			b7[j] = _mm256_srai_epi16(_mm256_slli_epi16(w[j], 8), 15);
+			b8[j] = _mm256_srai_epi16(_mm256_slli_epi16(w[j], 7), 15);
+			ks[j] = _mm256_xor_si256(_mm256_and_si256(w[j], mask7), _mm256_and_si256(b7[j], mask7));
+		}
+
+		// The cosine is the sine a quadrant ahead: the mirrored index, and
+		// negative if exactly one of the quadrant bits is set
+		k = _mm256_packus_epi16(ks[0], ks[1]);
+		qs = lookupSinQuarterAVX2(tab, k);
+		qc = lookupSinQuarterAVX2(tab, _mm256_xor_si256(k, _mm256_set1_epi8(0x7f)));
+
+		for (j=0; j<2; j++)
+		{
+			c16 = _mm256_permute4x64_epi64(_mm256_cvtepi8_epi16(
+				_mm_loadu_si128((const __m128i *)(code+isamp+16*j))), 0xd8);
+
+			sinv = _mm256_mullo_epi16((j==0)?_mm256_unpacklo_epi8(qs, zero):_mm256_unpackhi_epi8(qs, zero), c16);
+			cosv = _mm256_mullo_epi16((j==0)?_mm256_unpacklo_epi8(qc, zero):_mm256_unpackhi_epi8(qc, zero), c16);
+			sinv = _mm256_sub_epi16(_mm256_xor_si256(sinv, b8[j]), b8[j]);
+			b7[j] = _mm256_xor_si256(b7[j], b8[j]);
+			cosv = _mm256_sub_epi16(_mm256_xor_si256(cosv, b7[j]), b7[j]);
+
+			addCarrierAVX2(acc+(isamp+16*j)*2, _mm256_unpacklo_epi16(cosv, sinv), g);
+			addCarrierAVX2(acc+(isamp+16*j+8)*2, _mm256_unpackhi_epi16(cosv, sinv), g);
+		}
+
+		for (j=0; j<4; j++)
+			ph[j] = _mm256_add_epi32(ph[j], ph32);
+	}
+
+	mixCarrierScalar(acc+isamp*2, code+isamp, phase+(unsigned int)isamp*step, step, gain, nsamp-isamp);
+
+	return;
+}
+#endif
+
+#ifdef USE_NEON
+/*! \brief Look up 16 entries of the first quarter of the sine table
+ *  \param[in] tab The 128-entry quarter in two tables of 64 bytes
+ *  \param[in] k Byte indices 0 to 127
+ */
+uint8x16_t lookupSinQuarterNEON(const uint8x16x4_t *tab, uint8x16_t k)
+{
+	// Indices out of the 64-byte range give 0 or leave the byte unchanged
+	return(vqtbx4q_u8(vqtbl4q_u8(tab[0], k), tab[1], veorq_u8(k, vdupq_n_u8(0x40))));
+}
+
+/*! \brief NEON version of \ref mixCarrierScalar
+ *
+ * The table lookups of 16 samples are done with byte table lookups in the
+ * first quarter of the sine table, like in \ref mixCarrierAVX2. The
+ * carrier times the code fits in 16 bits and is widened by the product
+ * with the gain.
+ */
+void mixCarrierNEON(int *acc, const signed char *code, unsigned int phase, unsigned int step, int gain, int nsamp)
+{
+	static const unsigned int lane[4] = {0,1,2,3};
+	uint8x16x4_t tab[2];
+	uint32x4_t ph[4],ph16;
+	uint16x8_t w,ks[2],b7[2],b8[2];
+	uint8x16_t k,qs,qc;
+	int16x8_t c16,sinv,cosv;
+	int16x4_t g;
+	int32x4x2_t iq;
+	int isamp,j;
+
+	// The products with the gain are formed from 16-bit halves
+	if (gain<-32768 || gain>32767)
+	{
+		mixCarrierScalar(acc, code, phase, step, gain, nsamp);
+		return;
+	}
+
+	g = vdup_n_s16((short)gain);
+
+	for (j=0; j<8; j++)
+		tab[j/4].val[j%4] = vld1q_u8(sinQuarter128+16*j);
+
+	ph[0] = vmlaq_n_u32(vdupq_n_u32(phase), vld1q_u32(lane), step);
+	for (j=1; j<4; j++)
+		ph[j] = vaddq_u32(ph[j-1], vdupq_n_u32(step*4U));
+	ph16 = vdupq_n_u32(step*16U);
+
+	for (isamp=0; isamp+16<=nsamp; isamp+=16)
+	{
+		for (j=0; j<2; j++)
+		{
+			// 9-bit table indices of 8 samples
+			w = vcombine_u16(vshrn_n_u32(ph[2*j], 16), vshrn_n_u32(ph[2*j+1], 16));
+			w = vandq_u16(w, vdupq_n_u16(0x1ff));
+
+			// Quadrant bits as masks. The sine is mirrored in the second and
+			// fourth quadrants and negative in the third and fourth.
+			b7[j] = vtstq_u16(w, vdupq_n_u16(0x80));
+			b8[j] = vtstq_u16(w, vdupq_n_u16(0x100));
+			ks[j] = veorq_u16(vandq_u16(w, vdupq_n_u16(0x7f)), vandq_u16(b7[j], vdupq_n_u16(0x7f)));
+		}
+
+		// The cosine is the sine a quadrant ahead: the mirrored index, and
+		// negative if exactly one of the quadrant bits is set
+		k = vcombine_u8(vmovn_u16(ks[0]), vmovn_u16(ks[1]));
+		qs = lookupSinQuarterNEON(tab, k);
+		qc = lookupSinQuarterNEON(tab, veorq_u8(k, vdupq_n_u8(0x7f)));
+
+		for (j=0; j<2; j++)
+		{
+			c16 = vmovl_s8(vld1_s8(code+isamp+8*j));
+
+			sinv = vmulq_s16(vreinterpretq_s16_u16(vmovl_u8((j==0)?vget_low_u8(qs):vget_high_u8(qs))), c16);
+			cosv = vmulq_s16(vreinterpretq_s16_u16(vmovl_u8((j==0)?vget_low_u8(qc):vget_high_u8(qc))), c16);
+			sinv = vbslq_s16(b8[j], vnegq_s16(sinv), sinv);
+			cosv = vbslq_s16(veorq_u16(b7[j], b8[j]), vnegq_s16(cosv), cosv);
+
+			// De-interleave the accumulator into I and Q
+			iq = vld2q_s32(acc+(isamp+8*j)*2);
+			iq.val[0] = vmlal_s16(iq.val[0], vget_low_s16(cosv), g);
+			iq.val[1] = vmlal_s16(iq.val[1], vget_low_s16(sinv), g);
+			vst2q_s32(acc+(isamp+8*j)*2, iq);
+
+			iq = vld2q_s32(acc+(isamp+8*j+4)*2);
+			iq.val[0] = vmlal_s16(iq.val[0], vget_high_s16(cosv), g);
+			iq.val[1] = vmlal_s16(iq.val[1], vget_high_s16(sinv), g);
+			vst2q_s32(acc+(isamp+8*j+4)*2, iq);
+		}
+
+		for (j=0; j<4; j++)
+			ph[j] = vaddq_u32(ph[j], ph16);
+	}
+
+	mixCarrierScalar(acc+isamp*2, code+isamp, phase+(unsigned int)isamp*step, step, gain, nsamp-isamp);
+
+	return;
+}
+#endif
+
+/*! \brief Quantize 16-bit samples to 8 bits
+ *  \param[out] out 8-bit samples
+ *  \param[in] in 16-bit samples
+ *  \param[in] n Number of samples (I and Q counted separately)
+ *
+ * This is the reference implementation of the SIMD kernels below.
+ */
+void quantizeSC08Scalar(signed char *out, const short *in, int n)
+{
+	int k;
+
+	for (k=0; k<n; k++)
+		out[k] = in[k]>>4; // 12-bit bladeRF -> 8-bit HackRF
+
+	return;
+}
+
+/*! \brief Pack the signs of 16-bit samples into 1-bit samples
+ *  \param[out] out (\a n+7)/8 bytes, the first sample in the MSB
+ *  \param[in] in 16-bit samples
+ *  \param[in] n Number of samples (I and Q counted separately)
+ *
+ * A bit is set for a positive sample. This is the reference implementation
+ * of the SIMD kernels below.
+ */
+void packSC01Scalar(signed char *out, const short *in, int n)
+{
+	int k;
+
+	for (k=0; k<n; k++)
+	{
+		if (k%8==0)
+			out[k/8] = 0x00;
+
+		out[k/8] |= (in[k]>0?0x01:0x00)<<(7-k%8);
+	}
+
+	return;
+}
+
+#ifdef USE_AVX2
+__attribute__((target("sse2")))
+void quantizeSC08SSE2(signed char *out, const short *in, int n)
+{
+	__m128i a,b;
+	__m128i mask = _mm_set1_epi16(0xff);
+	int k;
+
+	for (k=0; k+16<=n; k+=16)
+	{
+		// Keep the low byte like the scalar conversion, without saturation
+		a = _mm_and_si128(_mm_srai_epi16(_mm_loadu_si128((const __m128i *)(in+k)), 4), mask);
+		b = _mm_and_si128(_mm_srai_epi16(_mm_loadu_si128((const __m128i *)(in+k+8)), 4), mask);
+		_mm_storeu_si128((__m128i *)(out+k), _mm_packus_epi16(a, b));
+	}
+
+	quantizeSC08Scalar(out+k, in+k, n-k);
+
+	return;
+}
+
+__attribute__((target("sse2")))
+void packSC01SSE2(signed char *out, const short *in, int n)
+{
+	__m128i a,b;
+	__m128i zero = _mm_setzero_si128();
+	int k,m;
+
+	for (k=0; k+16<=n; k+=16)
+	{
+		// Reverse each group of 8 samples so the first one ends up in the MSB
+		a = _mm_loadu_si128((const __m128i *)(in+k));
+		b = _mm_loadu_si128((const __m128i *)(in+k+8));
+		a = _mm_shufflehi_epi16(_mm_shufflelo_epi16(_mm_shuffle_epi32(a, 0x4e), 0x1b), 0x1b);
+		b = _mm_shufflehi_epi16(_mm_shufflelo_epi16(_mm_shuffle_epi32(b, 0x4e), 0x1b), 0x1b);
+
+		m = _mm_movemask_epi8(_mm_packs_epi16(_mm_cmpgt_epi16(a, zero), _mm_cmpgt_epi16(b, zero)));
+		out[k/8] = (signed char)m;
+		out[k/8+1] = (signed char)(m>>8);
+	}
+
+	packSC01Scalar(out+k/8, in+k, n-k);
+
+	return;
+}
+
+__attribute__((target("avx2")))
+void quantizeSC08AVX2(signed char *out, const short *in, int n)
+{
+	__m256i a,b;
+	__m256i mask = _mm256_set1_epi16(0xff);
+	int k;
+
+	for (k=0; k+32<=n; k+=32)
+	{
+		a = _mm256_and_si256(_mm256_srai_epi16(_mm256_loadu_si256((const __m256i *)(in+k)), 4), mask);
+		b = _mm256_and_si256(_mm256_srai_epi16(_mm256_loadu_si256((const __m256i *)(in+k+16)), 4), mask);
+
+		// The pack works within 128-bit lanes
+		_mm256_storeu_si256((__m256i *)(out+k), _mm256_permute4x64_epi64(_mm256_packus_epi16(a, b), 0xd8));
+	}
+
+	quantizeSC08SSE2(out+k, in+k, n-k);
+
+	return;
+}
+
+__attribute__((target("avx2")))
+void packSC01AVX2(signed char *out, const short *in, int n)
+{
+	__m256i a,b,c;
+	__m256i zero = _mm256_setzero_si256();
+	__m256i rev = _mm256_setr_epi8(7,6,5,4,3,2,1,0, 15,14,13,12,11,10,9,8,
+		7,6,5,4,3,2,1,0, 15,14,13,12,11,10,9,8);
+	unsigned int m;
+	int k;
+
+	for (k=0; k+32<=n; k+=32)
+	{
+		a = _mm256_cmpgt_epi16(_mm256_loadu_si256((const __m256i *)(in+k)), zero);
+		b = _mm256_cmpgt_epi16(_mm256_loadu_si256((const __m256i *)(in+k+16)), zero);
+
+		// Restore the sample order after the in-lane pack, then reverse each
+		// group of 8 samples so the first one ends up in the MSB
+		c = _mm256_permute4x64_epi64(_mm256_packs_epi16(a, b), 0xd8);
+		m = (unsigned int)_mm256_movemask_epi8(_mm256_shuffle_epi8(c, rev));
+
+		out[k/8] = (signed char)m;
+		out[k/8+1] = (signed char)(m>>8);
+		out[k/8+2] = (signed char)(m>>16);
+		out[k/8+3] = (signed char)(m>>24);
+	}
+
+	packSC01SSE2(out+k/8, in+k, n-k);
+
+	return;
+}
+#endif
+
+#ifdef USE_NEON
+void quantizeSC08NEON(signed char *out, const short *in, int n)
+{
+	int k;
+
+	// The narrowing shift keeps the low byte like the scalar conversion
+	for (k=0; k+16<=n; k+=16)
+		vst1q_s8(out+k, vcombine_s8(vshrn_n_s16(vld1q_s16(in+k), 4), vshrn_n_s16(vld1q_s16(in+k+8), 4)));
+
+	quantizeSC08Scalar(out+k, in+k, n-k);
+
+	return;
+}
+
+void packSC01NEON(signed char *out, const short *in, int n)
+{
+	static const unsigned char weight[16] = {128,64,32,16,8,4,2,1, 128,64,32,16,8,4,2,1};
+	uint8x16_t w = vld1q_u8(weight);
+	uint8x16_t pos;
+	int k;
+
+	for (k=0; k+16<=n; k+=16)
+	{
+		pos = vcombine_u8(vmovn_u16(vcgtzq_s16(vld1q_s16(in+k))), vmovn_u16(vcgtzq_s16(vld1q_s16(in+k+8))));
+		pos = vandq_u8(pos, w);
+
+		out[k/8] = (signed char)vaddv_u8(vget_low_u8(pos));
+		out[k/8+1] = (signed char)vaddv_u8(vget_high_u8(pos));
+	}
+
+	packSC01Scalar(out+k/8, in+k, n-k);
+
+	return;
+}
+#endif
+
+// Kernels selected by initSynthKernels()
+void (*mixCarrier)(int *, const signed char *, unsigned int, unsigned int, int, int) = mixCarrierScalar;
+void (*quantizeSC08)(signed char *, const short *, int) = quantizeSC08Scalar;
+void (*packSC01)(signed char *, const short *, int) = packSC01Scalar;
+
+/*! \brief Select the carrier mixing and quantization kernels supported by the CPU
+ *  \returns Name of the selected kernels
+ */
+const char *initSynthKernels(void)
+{
+	int i;
+
+	for (i=0; i<128; i++)
+		sinQuarter128[i] = (unsigned char)sinTable512[i];
+
+	mixCarrier = mixCarrierScalar;
+	quantizeSC08 = quantizeSC08Scalar;
+	packSC01 = packSC01Scalar;
+#if defined(USE_AVX2)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+	{
+		mixCarrier = mixCarrierAVX2;
+		quantizeSC08 = quantizeSC08AVX2;
+		packSC01 = packSC01AVX2;
+		return("AVX2");
+	}
+	if (__builtin_cpu_supports("sse2"))
+	{
+		quantizeSC08 = quantizeSC08SSE2;
+		packSC01 = packSC01SSE2;
+		return("SSE2");
+	}
+#elif defined(USE_NEON)
+	// Always available on AArch64
+	mixCarrier = mixCarrierNEON;
+	quantizeSC08 = quantizeSC08NEON;
+	packSC01 = packSC01NEON;
+	return("NEON");
+#endif
+
+	return("scalar");
+}
+
+/*! \brief Add the baseband samples of a single channel to an I/Q accumulator
+ *  \param nco NCO state, the code, data bit and carrier state of channel \a i is updated
+ *  \param[in] i Channel index
+ *  \param acc Accumulator of 2*\a nsamp interleaved I/Q integers
+ *  \param[in] nsamp Number of samples
+ */
+void generateChannelSamples(ncostate_t *nco, int i, int *acc, int nsamp)
+{
+	signed char code[SYNTH_CHUNK_SIZE];
+	int gain = nco->gain[i];
+	int i0,n;
+#ifdef FLOAT_CARR_PHASE
+	double phase = nco->carr_phase[i];
+	double step = nco->carr_phasestep[i];
+	int isamp;
+	int iTable;
+#endif
+
+	for (i0=0; i0<nsamp; i0+=n)
+	{
+		n = nsamp-i0;
+		if (n>SYNTH_CHUNK_SIZE)
+			n = SYNTH_CHUNK_SIZE;
+
+		generateCodeSequence(nco, i, code, n);
+
+#ifdef FLOAT_CARR_PHASE
+		for (isamp=0; isamp<n; isamp++)
+		{
+			iTable = (int)floor(phase*512.0);
+
+			acc[(i0+isamp)*2] += code[isamp] * cosTable512[iTable] * gain;
+			acc[(i0+isamp)*2+1] += code[isamp] * sinTable512[iTable] * gain;
+
+			// Update carrier phase
+			phase += step;
+
+			if (phase >= 1.0)
+				phase -= 1.0;
+			else if (phase<0.0)
+				phase += 1.0;
+		}
+#else
+		mixCarrier(acc+i0*2, code, nco->carr_phase[i], (unsigned int)nco->carr_phasestep[i], gain, n);
+
+		// Update carrier phase
+		nco->carr_phase[i] += (unsigned int)n * (unsigned int)nco->carr_phasestep[i];
+#endif
+	}
+
+#ifdef FLOAT_CARR_PHASE
+	nco->carr_phase[i] = phase;
+#endif
+
+	return;
+}
+
+/*! \brief Sum up the worker accumulators into 16-bit samples
+ *  \param[in] pool Worker pool
+ *  \param[out] iq_buff Samples
+ *  \param[in] k0 Index of the first sample in the accumulators (I and Q counted separately)
+ *  \param[in] n Number of samples (I and Q counted separately)
+ */
+void reduceAccumulators(const workpool_t *pool, short *iq_buff, int k0, int n)
+{
+	int j,k;
+	int sum;
+
+	for (k=0; k<n; k++)
+	{
+		sum = pool->acc[0][k0+k];
+		for (j=1; j<pool->nthreads; j++)
+			sum += pool->acc[j][k0+k];
+
+		// Scaled by 2^7
+		iq_buff[k] = (short)((sum+64)>>7);
+	}
+
+	return;
+}
+
+/*! \brief Run the current task of the worker pool for one worker
+ *  \param pool Worker pool
+ *  \param[in] id Worker index
+ *
+ * The channels are split among the workers, each of them accumulating into
+ * its own buffer. The buffers are then summed up by sample ranges. Since the
+ * accumulation is done in integers, the result does not depend on the number
+ * of workers. With a fused output format, the sums are quantized in small
+ * chunks without a 16-bit copy of the block.
+ */
+void runWorkerTask(workpool_t *pool, int id)
+{
+	int *acc = pool->acc[id];
+	short iq[2*SYNTH_CHUNK_SIZE];
+	int j,k,n;
+	int n0,n1;
+
+	if (pool->task==POOL_TASK_SYNTH)
+	{
+		memset(acc, 0, 2*pool->nsamp*sizeof(int));
+
+		for (j=id; j<pool->nactive; j+=pool->nthreads)
+		{
+			int i = pool->active[j];
+			generateChannelSamples(pool->nco, i, acc, pool->nsamp);
+		}
+	}
+	else // POOL_TASK_REDUCE
+	{
+		// Ranges of whole bytes for SC01
+		n0 = (int)((long long)2*pool->nsamp*id/pool->nthreads) & ~7;
+		n1 = (int)((long long)2*pool->nsamp*(id+1)/pool->nthreads) & ~7;
+		if (id==pool->nthreads-1)
+			n1 = 2*pool->nsamp;
+
+		if (pool->data_format==SC16)
+		{
+			reduceAccumulators(pool, pool->iq_buff+n0, n0, n1-n0);
+			return;
+		}
+
+		// Convert the samples while they are in the cache
+		for (k=n0; k<n1; k+=n)
+		{
+			n = n1-k;
+			if (n>2*SYNTH_CHUNK_SIZE)
+				n = 2*SYNTH_CHUNK_SIZE;
+
+			reduceAccumulators(pool, iq, k, n);
+
+			if (pool->data_format==SC08)
+				quantizeSC08(pool->iq8_buff+k, iq, n);
+			else
+				packSC01(pool->iq8_buff+k/8, iq, n);
+		}
+	}
+
+	return;
+}
+
+#ifndef _WIN32
+void *workerThread(void *arg)
+{
+	workarg_t *warg = (workarg_t *)arg;
+	workpool_t *pool = warg->pool;
+	unsigned int job = 0;
+
+	while (1)
+	{
+		pthread_mutex_lock(&pool->lock);
+		while (pool->job==job && !pool->quit)
+			pthread_cond_wait(&pool->start, &pool->lock);
+		if (pool->quit)
+		{
+			pthread_mutex_unlock(&pool->lock);
+			break;
+		}
+		job = pool->job;
+		pthread_mutex_unlock(&pool->lock);
+
+		runWorkerTask(pool, warg->id);
+
+		pthread_mutex_lock(&pool->lock);
+		if (--pool->busy==0)
+			pthread_cond_signal(&pool->done);
+		pthread_mutex_unlock(&pool->lock);
+	}
+
+	return(NULL);
+}
+#endif
+
+/*! \brief Start the worker pool
+ *  \param pool Worker pool
+ *  \param[in] nthreads Number of workers including the main thread
+ *  \param[in] nsamp Maximum number of samples per block
+ *  \param[in] data_format Output format the blocks are synthesized into (SC01, SC08 or SC16)
+ *  \returns 0 on success, -1 on error
+ */
+int startWorkerPool(workpool_t *pool, int nthreads, int nsamp, int data_format)
+{
+	int i;
+
+	memset(pool, 0, sizeof(workpool_t));
+
+#ifdef _WIN32
+	if (nthreads>1)
+		fprintf(stderr, "WARNING: Multi-threading is not supported. Using a single thread.\n");
+	nthreads = 1;
+#endif
+	pool->nthreads = nthreads;
+	pool->data_format = data_format;
+
+	for (i=0; i<nthreads; i++)
+	{
+		pool->arg[i].pool = pool;
+		pool->arg[i].id = i;
+
+		pool->acc[i] = (int *)calloc(2*nsamp, sizeof(int));
+		if (pool->acc[i]==NULL)
+			return(-1);
+	}
+
+#ifndef _WIN32
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->start, NULL);
+	pthread_cond_init(&pool->done, NULL);
+
+	for (i=1; i<nthreads; i++)
+	{
+		if (pthread_create(&pool->tid[i], NULL, workerThread, &pool->arg[i])!=0)
+		{
+			pool->nthreads = i; // Keep the workers created so far
+			break;
+		}
+	}
+#endif
+
+	return(0);
+}
+
+/*! \brief Run a task on all workers and wait for its completion */
+void dispatchWorkerTask(workpool_t *pool, int task)
+{
+	pool->task = task;
+
+#ifndef _WIN32
+	if (pool->nthreads>1)
+	{
+		pthread_mutex_lock(&pool->lock);
+		pool->busy = pool->nthreads-1;
+		pool->job++;
+		pthread_cond_broadcast(&pool->start);
+		pthread_mutex_unlock(&pool->lock);
+
+		runWorkerTask(pool, 0);
+
+		pthread_mutex_lock(&pool->lock);
+		while (pool->busy>0)
+			pthread_cond_wait(&pool->done, &pool->lock);
+		pthread_mutex_unlock(&pool->lock);
+
+		return;
+	}
+#endif
+	runWorkerTask(pool, 0);
+
+	return;
+}
+
+/*! \brief Synthesize a block of I/Q samples from all allocated channels
+ *  \param pool Worker pool
+ *  \param[in] chan Array of channels
+ *  \param nco NCO state of the channels (code, data bit and carrier state is updated)
+ *  \param[out] iq_buff Output buffer of 2*\a nsamp interleaved 16-bit I/Q samples
+ *  \param[out] iq8_buff Output buffer used instead of \a iq_buff if the pool synthesizes SC08 or SC01
+ *  \param[in] nsamp Number of samples
+ */
+void synthesizeBlock(workpool_t *pool, const channel_t *chan, ncostate_t *nco, short *iq_buff, signed char *iq8_buff, int nsamp)
+{
+	int i;
+
+	pool->nco = nco;
+	pool->iq_buff = iq_buff;
+	pool->iq8_buff = iq8_buff;
+	pool->nsamp = nsamp;
+
+	pool->nactive = 0;
+	for (i=0; i<MAX_CHAN; i++)
+	{
+		if (chan[i].prn>0)
+			pool->active[pool->nactive++] = i;
+	}
+
+	dispatchWorkerTask(pool, POOL_TASK_SYNTH);
+	dispatchWorkerTask(pool, POOL_TASK_REDUCE);
+
+	return;
+}
+
+/*! \brief Stop the worker threads and free the accumulators */
+void stopWorkerPool(workpool_t *pool)
+{
+	int i;
+
+#ifndef _WIN32
+	if (pool->nthreads>1)
+	{
+		pthread_mutex_lock(&pool->lock);
+		pool->quit = 1;
+		pthread_cond_broadcast(&pool->start);
+		pthread_mutex_unlock(&pool->lock);
+
+		for (i=1; i<pool->nthreads; i++)
+			pthread_join(pool->tid[i], NULL);
+	}
+
+	pthread_mutex_destroy(&pool->lock);
+	pthread_cond_destroy(&pool->start);
+	pthread_cond_destroy(&pool->done);
+#endif
+
+	for (i=0; i<MAX_CHAN; i++)
+		free(pool->acc[i]);
+
+	return;
+}
+
+/*! \brief Size of I/Q samples in the output data format
+ *  \param[in] nsamp Number of samples
+ *  \param[in] data_format Output data format (SC01, SC08 or SC16)
+ *  \returns Number of bytes
+ */
+size_t sampleBytes(int nsamp, int data_format)
+{
+	if (data_format==SC01)
+		return((2*(size_t)nsamp+7)/8);
+	else if (data_format==SC08)
+		return(2*(size_t)nsamp);
+
+	return(4*(size_t)nsamp);
+}
+
+/*! \brief Convert the I/Q samples into the output data format
+ *  \param[in] iq_buff Interleaved 16-bit I/Q samples
+ *  \param iq8_buff Buffer for the 8-bit or 1-bit I/Q samples
+ *  \param[in] nsamp Number of samples
+ *  \param[in] data_format Output data format (SC01, SC08 or SC16)
+ *  \param[out] out Converted samples, \a iq_buff for SC16
+ *  \returns Number of bytes of the converted samples
+ */
+size_t convertIQSamples(const short *iq_buff, signed char *iq8_buff, int nsamp, int data_format, const void **out)
+{
+	if (data_format==SC01)
+	{
+		packSC01(iq8_buff, iq_buff, 2*nsamp);
+
+		*out = iq8_buff;
+		return(sampleBytes(nsamp, data_format));
+	}
+	else if (data_format==SC08)
+	{
+		quantizeSC08(iq8_buff, iq_buff, 2*nsamp);
+
+		*out = iq8_buff;
+		return(sampleBytes(nsamp, data_format));
+	}
+
+	// data_format==SC16
+	*out = iq_buff;
+	return(sampleBytes(nsamp, data_format));
+}
+
+/*! \brief Convert the I/Q samples into the output data format and write them
+ *  \param[in] fp Output file
+ *  \param[in] iq_buff Interleaved 16-bit I/Q samples
+ *  \param iq8_buff Buffer for the 8-bit or 1-bit I/Q samples
+ *  \param[in] nsamp Number of samples
+ *  \param[in] data_format Output data format (SC01, SC08 or SC16)
+ *  \returns Number of bytes written
+ */
+size_t writeIQSamples(FILE *fp, const short *iq_buff, signed char *iq8_buff, int nsamp, int data_format)
+{
+	const void *out;
+	size_t nbyte;
+
+	nbyte = convertIQSamples(iq_buff, iq8_buff, nsamp, data_format, &out);
+
+	return(fwrite(out, 1, nbyte, fp));
+}
+
+#ifdef USE_DIRECT_IO
+#ifdef USE_IO_URING
+/*! \brief Check if an io_uring supports IORING_OP_WRITE
+ *  \param[in] ring io_uring descriptor
+ *
+ * io_uring is available since Linux 5.1, but IORING_OP_WRITE and the probe
+ * of the supported operations only since Linux 5.6. The probe fails on
+ * the kernels in between.
+ */
+int probeDirectWrite(int ring)
+{
+	struct io_uring_probe *probe;
+	int ok;
+
+	probe = (struct io_uring_probe *)calloc(1, sizeof(struct io_uring_probe)+256*sizeof(struct io_uring_probe_op));
+	if (probe==NULL)
+		return(FALSE);
+
+	ok = (syscall(__NR_io_uring_register, ring, IORING_REGISTER_PROBE, probe, 256)==0 &&
+		probe->last_op>=IORING_OP_WRITE && (probe->ops[IORING_OP_WRITE].flags & IO_URING_OP_SUPPORTED));
+
+	free(probe);
+
+	return(ok);
+}
+#endif
+
+/*! \brief Open an output file for direct writes
+ *  \param[out] d Direct output
+ *  \param[in] fname Output file name
+ *  \returns 0 on success, -1 if the file cannot be opened with O_DIRECT,
+ *  in which case nothing is left open or allocated
+ */
+int openDirect(directio_t *d, const char *fname)
+{
+#ifdef USE_IO_URING
+	struct io_uring_params p;
+#endif
+	void *buf;
+	int i;
+
+	memset(d, 0, sizeof(directio_t));
+	d->ring = -1;
+
+	d->fd = open(fname, O_WRONLY|O_CREAT|O_TRUNC|O_DIRECT, 0644);
+	if (d->fd==-1)
+		return(-1);
+
+	for (i=0; i<DIRECT_MAX_INFLIGHT; i++)
+	{
+		if (posix_memalign(&buf, DIRECT_ALIGN, DIRECT_CHUNK_SIZE)!=0)
+		{
+			while (--i>=0)
+				free(d->chunk[i]);
+			close(d->fd);
+			d->fd = -1;
+			return(-1);
+		}
+		d->chunk[i] = (unsigned char *)buf;
+	}
+
+#ifdef USE_IO_URING
+	// Submission and completion rings, mapped as in the io_uring_setup(2) example.
+	// Without io_uring or its write operation, the chunks are written synchronously.
+	memset(&p, 0, sizeof(p));
+	d->ring = (int)syscall(__NR_io_uring_setup, DIRECT_MAX_INFLIGHT, &p);
+	if (d->ring<0)
+	{
+		d->ring = -1;
+		return(0);
+	}
+
+	if (!probeDirectWrite(d->ring))
+	{
+		close(d->ring);
+		d->ring = -1;
+		return(0);
+	}
+
+	d->sq_size = p.sq_off.array + p.sq_entries*sizeof(unsigned);
+	d->cq_size = p.cq_off.cqes + p.cq_entries*sizeof(struct io_uring_cqe);
+	d->sqes_size = p.sq_entries*sizeof(struct io_uring_sqe);
+
+	d->sq_map = mmap(NULL, d->sq_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, d->ring, IORING_OFF_SQ_RING);
+	d->cq_map = mmap(NULL, d->cq_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, d->ring, IORING_OFF_CQ_RING);
+	d->sqes = mmap(NULL, d->sqes_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, d->ring, IORING_OFF_SQES);
+
+	if (d->sq_map==MAP_FAILED || d->cq_map==MAP_FAILED || d->sqes==MAP_FAILED)
+	{
+		if (d->sq_map!=MAP_FAILED)
+			munmap(d->sq_map, d->sq_size);
+		if (d->cq_map!=MAP_FAILED)
+			munmap(d->cq_map, d->cq_size);
+		if (d->sqes!=MAP_FAILED)
+			munmap(d->sqes, d->sqes_size);
+		close(d->ring);
+		d->ring = -1;
+		return(0);
+	}
+
+	d->sq_head = (unsigned *)((char *)d->sq_map + p.sq_off.head);
+	d->sq_tail = (unsigned *)((char *)d->sq_map + p.sq_off.tail);
+	d->sq_mask = (unsigned *)((char *)d->sq_map + p.sq_off.ring_mask);
+	d->sq_array = (unsigned *)((char *)d->sq_map + p.sq_off.array);
+	d->cq_head = (unsigned *)((char *)d->cq_map + p.cq_off.head);
+	d->cq_tail = (unsigned *)((char *)d->cq_map + p.cq_off.tail);
+	d->cq_mask = (unsigned *)((char *)d->cq_map + p.cq_off.ring_mask);
+	d->cqes = (char *)d->cq_map + p.cq_off.cqes;
+#endif
+
+	return(0);
+}
+
+/*! \brief Wait for the completion of the writes in flight
+ *  \param d Direct output
+ *
+ * Returns after at least one write has completed.
+ */
+void reapDirect(directio_t *d)
+{
+#ifdef USE_IO_URING
+	struct io_uring_cqe *cqe;
+	unsigned head;
+	int i;
+
+	if (d->inflight==0)
+		return;
+
+	if (syscall(__NR_io_uring_enter, d->ring, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0)<0 && errno!=EINTR)
+	{
+		// The writes in flight are lost
+		d->error = TRUE;
+		for (i=0; i<DIRECT_MAX_INFLIGHT; i++)
+			d->busy[i] = FALSE;
+		d->inflight = 0;
+		return;
+	}
+
+	head = *d->cq_head;
+	while (head!=__atomic_load_n(d->cq_tail, __ATOMIC_ACQUIRE))
+	{
+		cqe = (struct io_uring_cqe *)d->cqes + (head & *d->cq_mask);
+		i = (int)cqe->user_data;
+
+		if (cqe->res<0 || (size_t)cqe->res!=d->len[i])
+			d->error = TRUE;
+
+		d->busy[i] = FALSE;
+		d->inflight--;
+		head++;
+	}
+	__atomic_store_n(d->cq_head, head, __ATOMIC_RELEASE);
+#endif
+
+	return;
+}
+
+/*! \brief Write the current chunk at the current file offset
+ *  \param d Direct output
+ *  \param[in] len Length of the write, a multiple of DIRECT_ALIGN
+ */
+void submitDirect(directio_t *d, size_t len)
+{
+	int i = d->cur;
+#ifdef USE_IO_URING
+	struct io_uring_sqe *sqe;
+	unsigned tail,idx;
+
+	if (d->ring>=0)
+	{
+		tail = *d->sq_tail;
+		idx = tail & *d->sq_mask;
+
+		sqe = (struct io_uring_sqe *)d->sqes + idx;
+		memset(sqe, 0, sizeof(struct io_uring_sqe));
+		sqe->opcode = IORING_OP_WRITE;
+		sqe->fd = d->fd;
+		sqe->addr = (unsigned long)d->chunk[i];
+		sqe->len = (unsigned)len;
+		sqe->off = (unsigned long long)d->offset;
+		sqe->user_data = (unsigned long long)i;
+
+		d->sq_array[idx] = idx;
+		__atomic_store_n(d->sq_tail, tail+1, __ATOMIC_RELEASE);
+
+		d->len[i] = len;
+		d->busy[i] = TRUE;
+		d->inflight++;
+
+		if (syscall(__NR_io_uring_enter, d->ring, 1, 0, 0, NULL, 0)!=1)
+		{
+			d->error = TRUE;
+			d->busy[i] = FALSE;
+			d->inflight--;
+		}
+
+		d->offset += (long long)len;
+		return;
+	}
+#endif
+
+	if (pwrite(d->fd, d->chunk[i], len, (off_t)d->offset)!=(ssize_t)len)
+		d->error = TRUE;
+
+	d->offset += (long long)len;
+
+	return;
+}
+
+/*! \brief Append data to a direct output file
+ *  \param d Direct output
+ *  \param[in] buf Data
+ *  \param[in] nbyte Number of bytes
+ *  \returns 0 on success, -1 if a write has failed
+ */
+int writeDirect(directio_t *d, const void *buf, size_t nbyte)
+{
+	const unsigned char *p = (const unsigned char *)buf;
+	size_t n;
+
+	while (nbyte>0)
+	{
+		// Wait until the chunk to be filled has been written
+		if (d->fill==0)
+		{
+			while (d->busy[d->cur])
+				reapDirect(d);
+		}
+
+		n = DIRECT_CHUNK_SIZE - d->fill;
+		if (n>nbyte)
+			n = nbyte;
+
+		memcpy(d->chunk[d->cur]+d->fill, p, n);
+		d->fill += n;
+		p += n;
+		nbyte -= n;
+
+		if (d->fill==DIRECT_CHUNK_SIZE)
+		{
+			submitDirect(d, DIRECT_CHUNK_SIZE);
+			d->cur = (d->cur+1)%DIRECT_MAX_INFLIGHT;
+			d->fill = 0;
+		}
+	}
+
+	return(d->error?-1:0);
+}
+
+/*! \brief Write out the last chunk and close a direct output file
+ *  \param d Direct output
+ *  \returns 0 on success, -1 if a write has failed
+ *
+ * The last write is padded to DIRECT_ALIGN and the file is truncated to
+ * the data length afterwards.
+ */
+int closeDirect(directio_t *d)
+{
+	long long size = d->offset + (long long)d->fill;
+	size_t len;
+	int i;
+
+	if (d->fill>0)
+	{
+		len = (d->fill+DIRECT_ALIGN-1) & ~(size_t)(DIRECT_ALIGN-1);
+		memset(d->chunk[d->cur]+d->fill, 0, len-d->fill);
+		submitDirect(d, len);
+	}
+
+	while (d->inflight>0)
+		reapDirect(d);
+
+	if (ftruncate(d->fd, (off_t)size)!=0)
+		d->error = TRUE;
+
+	if (close(d->fd)!=0)
+		d->error = TRUE;
+
+#ifdef USE_IO_URING
+	if (d->ring>=0)
+	{
+		munmap(d->sq_map, d->sq_size);
+		munmap(d->cq_map, d->cq_size);
+		munmap(d->sqes, d->sqes_size);
+		close(d->ring);
+	}
+#endif
+
+	for (i=0; i<DIRECT_MAX_INFLIGHT; i++)
+		free(d->chunk[i]);
+
+	return(d->error?-1:0);
+}
+#endif
+
+/*! \brief Reserve the disk space of the output file without changing its size
+ *  \param[in] fd Output file descriptor
+ *  \param[in] size Expected size of the output in bytes
+ *  \returns 0 on success, -1 on error
+ */
+int preallocateOutput(int fd, long long size)
+{
+#ifdef USE_DIRECT_IO
+	if (size>0 && fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, (off_t)size)==0)
+		return(0);
+#endif
+
+	return(-1);
+}
+
+/*! \brief Release the preallocated disk space past the end of a buffered output file
+ *  \param[in] fp Output file, flushed by this call
+ *  \returns 0 on success, -1 on error
+ *
+ * The space reserved by \ref preallocateOutput stays allocated when the run
+ * ends early. Truncating the file to its own size frees it again.
+ */
+int trimOutput(FILE *fp)
+{
+#ifdef USE_DIRECT_IO
+	if (fflush(fp)!=0 || ftruncate(fileno(fp), ftello(fp))!=0)
+		return(-1);
+#endif
+
+	return(0);
+}
+
+/*! \brief Flag a failed write
+ *  \param w Writer
+ *
+ * The flag is set by the writer thread and polled by the main thread.
+ */
+void setWriterError(iowriter_t *w)
+{
+#ifndef _WIN32
+	__atomic_store_n(&w->error, TRUE, __ATOMIC_RELEASE);
+#else
+	w->error = TRUE; // Written synchronously
+#endif
+
+	return;
+}
+
+/*! \brief Check if a write has failed so far
+ *  \param[in] w Writer
+ */
+int writerFailed(const iowriter_t *w)
+{
+#ifndef _WIN32
+	return(__atomic_load_n(&w->error, __ATOMIC_ACQUIRE));
+#else
+	return(w->error);
+#endif
+}
+
+/*! \brief Convert and write a block of the writer ring
+ *  \param w Writer, the error flag is set if the block is not fully written
+ *  \param[in] blk Block to be written
+ */
+void writeBlock(iowriter_t *w, const iqblock_t *blk)
+{
+	const void *out;
+	size_t nbyte;
+#ifndef _WIN32
+	void *dst;
+
+	if (w->ring!=NULL)
+	{
+		// Convert straight into the ring
+		nbyte = sampleBytes(blk->nsamp, w->data_format);
+
+		if ((dst = reserveShmRing(w->ring, nbyte))==NULL)
+		{
+			setWriterError(w); // The player has exited
+			return;
+		}
+
+		if (w->fused)
+			memcpy(dst, blk->iq8_buff, nbyte);
+		else if (w->data_format==SC08)
+			quantizeSC08((signed char *)dst, blk->iq_buff, 2*blk->nsamp);
+		else if (w->data_format==SC01)
+			packSC01((signed char *)dst, blk->iq_buff, 2*blk->nsamp);
+		else
+			memcpy(dst, blk->iq_buff, nbyte);
+
+		commitShmRing(w->ring, nbyte);
+		return;
+	}
+#endif
+
+	if (w->fused)
+	{
+		out = blk->iq8_buff;
+		nbyte = sampleBytes(blk->nsamp, w->data_format);
+	}
+	else
+		nbyte = convertIQSamples(blk->iq_buff, blk->iq8_buff, blk->nsamp, w->data_format, &out);
+
+#ifdef USE_DIRECT_IO
+	if (w->direct!=NULL)
+	{
+		if (writeDirect(w->direct, out, nbyte)==-1)
+			setWriterError(w);
+		return;
+	}
+#endif
+
+	if (fwrite(out, 1, nbyte, w->fp)!=nbyte)
+		setWriterError(w);
+
+	return;
+}
+
+#ifndef _WIN32
+void *writerThread(void *arg)
+{
+	iowriter_t *w = (iowriter_t *)arg;
+	iqblock_t *blk;
+
+	while (1)
+	{
+		pthread_mutex_lock(&w->lock);
+		while (w->count==0 && !w->quit)
+			pthread_cond_wait(&w->filled, &w->lock);
+		if (w->count==0) // Quit after the queue is drained
+		{
+			pthread_mutex_unlock(&w->lock);
+			break;
+		}
+		blk = &w->block[w->tail];
+		pthread_mutex_unlock(&w->lock);
+
+		writeBlock(w, blk);
+
+		pthread_mutex_lock(&w->lock);
+		w->tail = (w->tail+1)%w->nbuff;
+		w->count--;
+		pthread_cond_signal(&w->freed);
+		pthread_mutex_unlock(&w->lock);
+	}
+
+	return(NULL);
+}
+#endif
+
+/*! \brief Allocate the writer ring and start the writer thread
+ *  \param w Writer
+ *  \param[in] fp Output file
+ *  \param[in] direct Direct output used instead of \a fp, NULL for none
+ *  \param[in] ring Shared memory output used instead of \a fp, NULL for none
+ *  \param[in] data_format Output data format (SC01, SC08 or SC16)
+ *  \param[in] fused The blocks are synthesized directly in the output data format
+ *  \param[in] nbuff Number of blocks in the ring, 1 to write synchronously
+ *  \param[in] nsamp Maximum number of samples per block
+ *  \returns 0 on success, -1 on error
+ */
+int startWriter(iowriter_t *w, FILE *fp, directio_t *direct, void *ring, int data_format, int fused, int nbuff, int nsamp)
+{
+	int i;
+
+	memset(w, 0, sizeof(iowriter_t));
+
+#ifdef _WIN32
+	nbuff = 1;
+#endif
+	w->fp = fp;
+	w->direct = direct;
+#ifndef _WIN32
+	w->ring = (shmring_t *)ring;
+#endif
+	w->data_format = data_format;
+	w->fused = (data_format!=SC16) && fused;
+	w->nbuff = nbuff;
+
+	for (i=0; i<nbuff; i++)
+	{
+		if (!w->fused)
+		{
+			w->block[i].iq_buff = (short *)calloc(2*nsamp, 2);
+			if (w->block[i].iq_buff==NULL)
+				return(-1);
+		}
+
+		if (data_format==SC08)
+			w->block[i].iq8_buff = (signed char *)calloc(2*nsamp, 1);
+		else if (data_format==SC01)
+			w->block[i].iq8_buff = (signed char *)calloc(sampleBytes(nsamp, SC01), 1); // byte = {I0, Q0, I1, Q1, I2, Q2, I3, Q3}
+
+		if (data_format!=SC16 && w->block[i].iq8_buff==NULL)
+			return(-1);
+	}
+
+#ifndef _WIN32
+	if (nbuff>1)
+	{
+		pthread_mutex_init(&w->lock, NULL);
+		pthread_cond_init(&w->filled, NULL);
+		pthread_cond_init(&w->freed, NULL);
+
+		if (pthread_create(&w->tid, NULL, writerThread, w)!=0)
+			w->nbuff = 1; // Write synchronously
+	}
+#endif
+
+	return(0);
+}
+
+/*! \brief Get the next block to be filled, waiting until the writer has freed it
+ *  \param w Writer
+ *  \returns Block to be filled and submitted with \ref submitWriterBlock
+ */
+iqblock_t *nextWriterBlock(iowriter_t *w)
+{
+#ifndef _WIN32
+	struct timespec t0,t1;
+
+	if (w->nbuff>1)
+	{
+		pthread_mutex_lock(&w->lock);
+		if (w->count==w->nbuff)
+		{
+			w->nstall++;
+			clock_gettime(CLOCK_MONOTONIC, &t0);
+
+			while (w->count==w->nbuff)
+				pthread_cond_wait(&w->freed, &w->lock);
+
+			clock_gettime(CLOCK_MONOTONIC, &t1);
+			w->stall += (double)(t1.tv_sec-t0.tv_sec) + (double)(t1.tv_nsec-t0.tv_nsec)*1.0e-9;
+		}
+		pthread_mutex_unlock(&w->lock);
+	}
+#endif
+
+	return(&w->block[w->head]);
+}
+
+/*! \brief Queue the block from \ref nextWriterBlock for writing
+ *  \param w Writer
+ *  \param[in] nsamp Number of samples in the block
+ */
+void submitWriterBlock(iowriter_t *w, int nsamp)
+{
+	iqblock_t *blk = &w->block[w->head];
+
+	blk->nsamp = nsamp;
+	w->nblock++;
+
+#ifndef _WIN32
+	if (w->nbuff>1)
+	{
+		pthread_mutex_lock(&w->lock);
+		w->head = (w->head+1)%w->nbuff;
+		w->count++;
+		w->depth += w->count;
+		if (w->count>w->maxdepth)
+			w->maxdepth = w->count;
+		pthread_cond_signal(&w->filled);
+		pthread_mutex_unlock(&w->lock);
+
+		return;
+	}
+#endif
+	writeBlock(w, blk);
+
+	return;
+}
+
+/*! \brief Write out the queued blocks, stop the writer thread and free the ring
+ *  \param w Writer
+ *  \returns 0 on success, -1 if a write failed
+ */
+int stopWriter(iowriter_t *w)
+{
+	int i;
+
+#ifndef _WIN32
+	if (w->nbuff>1)
+	{
+		pthread_mutex_lock(&w->lock);
+		w->quit = 1;
+		pthread_cond_signal(&w->filled);
+		pthread_mutex_unlock(&w->lock);
+
+		pthread_join(w->tid, NULL);
+
+		pthread_mutex_destroy(&w->lock);
+		pthread_cond_destroy(&w->filled);
+		pthread_cond_destroy(&w->freed);
+	}
+#endif
+
+	for (i=0; i<MAX_WRITER_BUFF; i++)
+	{
+		free(w->block[i].iq_buff);
+		free(w->block[i].iq8_buff);
+	}
+
+	return(w->error?-1:0);
+}
+
+/*! \brief Time of CLOCK_MONOTONIC
+ *  \returns Time in seconds
+ */
+double monotonicTime(void)
+{
+#ifndef _WIN32
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return((double)ts.tv_sec + (double)ts.tv_nsec*1.0e-9);
+#else
+	return((double)clock()/CLOCKS_PER_SEC);
+#endif
+}
+
+/*! \brief Start pacing the output in real time
+ *  \param p Pacer
+ *  \param[in] lookahead Maximum time a block is produced ahead of its playback [sec]
+ *  \param[in] samp_freq Sampling frequency [Hz]
+ *  \param[in] delay Time until the playback of the first sample [sec]
+ */
+void startPacer(pacer_t *p, double lookahead, double samp_freq, double delay)
+{
+	memset(p, 0, sizeof(pacer_t));
+
+	p->lookahead = lookahead;
+	p->samp_freq = samp_freq;
+	p->tstart = monotonicTime() + delay;
+
+	return;
+}
+
+/*! \brief Wait until the next block is within the lookahead
+ *  \param p Pacer
+ */
+void waitPacer(pacer_t *p)
+{
+#ifndef _WIN32
+	struct timespec ts;
+	double dt;
+#endif
+
+	p->due = p->tstart + (double)p->nsamp/p->samp_freq;
+
+#ifndef _WIN32
+	while ((dt = p->due-p->lookahead-monotonicTime())>0.0)
+	{
+		ts.tv_sec = (time_t)dt;
+		ts.tv_nsec = (long)((dt-(double)ts.tv_sec)*1.0e9);
+		nanosleep(&ts, NULL); // Repeated if interrupted
+	}
+#endif
+
+	return;
+}
+
+/*! \brief Account for a block handed to the output
+ *  \param p Pacer
+ *  \param[in] nsamp Number of samples in the block
+ */
+void submitPacer(pacer_t *p, int nsamp)
+{
+	double late = monotonicTime()-p->due;
+
+	// The block is not available when its playback should start
+	if (late>0.0)
+	{
+		p->nunder++;
+		if (late>p->late)
+			p->late = late;
+	}
+
+	p->nsamp += nsamp;
+	p->nblock++;
+
+	return;
 }
 
 void usage(void)
 {
 	fprintf(stderr, "Usage: gps-sdr-sim [options]\n"
 		"Options:\n"
-		"  -e <gps_nav>     RINEX navigation file for GPS ephemerides (required)\n"
+		"  -e <gps_nav>     RINEX navigation file for GPS ephemerides (required, may be repeated)\n"
+		"  -C <cache_dir>   Directory of binary ephemeris caches, rebuilt when a RINEX file changes\n"
 		"  -u <user_motion> User motion file in ECEF x, y, z format (dynamic mode)\n"
 		"  -x <user_motion> User motion file in lat, lon, height format (dynamic mode)\n"
 		"  -g <nmea_gga>    NMEA GGA stream (dynamic mode)\n"
@@ -1702,13 +4816,23 @@ void usage(void)
 		"  -l <location>    Lat, lon, height (static mode) e.g. 35.681298,139.766247,10.0\n"
 		"  -t <date,time>   Scenario start time YYYY/MM/DD,hh:mm:ss\n"
 		"  -T <date,time>   Overwrite TOC and TOE to scenario start time\n"
-		"  -d <duration>    Duration [sec] (dynamic mode max: %.0f, static mode max: %d)\n"
+		"  -d <duration>    Duration [sec] (default: whole user motion or %d in static mode, max: %d or %d)\n"
 		"  -o <output>      I/Q sampling data file (default: gpssim.bin)\n"
 		"  -s <frequency>   Sampling frequency [Hz] (default: 2600000)\n"
 		"  -b <iq_bits>     I/Q data format [1/8/16] (default: 16)\n"
 		"  -i               Disable ionospheric delay for spacecraft scenario\n"
+		"  -j <threads>     Number of threads for the signal synthesis (default: 1)\n"
+		"  -E <epoch>       Range and Doppler update interval [sec] (default: 0.1, min: 0.001, max: 1)\n"
+		"  -B <block>       Output block length [sec] (default: same as the update interval)\n"
+		"  -P <window>      Interpolate satellite orbits over windows [sec] (default: off, max: %.0f)\n"
+		"  -W <buffers>     Number of output blocks queued to the writer thread (default: 3, max: %d, 1: no thread)\n"
+		"  -D               Write the output file with direct I/O, bypassing the page cache (Linux only)\n"
+		"  -F               Preallocate the disk space of the output file\n"
+		"  -R <lookahead>   Stream in real time, producing blocks up to <lookahead> [sec] ahead (e.g. 0.2, max: %.0f)\n"
+		"  -S <name>        Hand the samples to a player through a shared memory ring instead of -o\n"
+		"  -V               Check the user motion file and exit\n"
 		"  -v               Show details about simulated channels\n",
-		((double)USER_MOTION_SIZE) / 10.0, STATIC_MAX_DURATION);
+		STATIC_DEFAULT_DURATION, DYNAMIC_MAX_DURATION, STATIC_MAX_DURATION, ORBIT_MAX_WINDOW, MAX_WRITER_BUFF, REALTIME_MAX_LOOKAHEAD);
 
 	return;
 }
@@ -1720,44 +4844,68 @@ int main(int argc, char *argv[])
 	FILE *fp;
 
 	int sv;
-	int neph,ieph;
-	ephem_t eph[EPHEM_ARRAY_SIZE][MAX_SAT];
+	int neph;
+	ephstore_t store;
+	const ephem_t *eph;
 	gpstime_t g0;
 	
 	double llh[3];
 	
 	int i;
 	channel_t chan[MAX_CHAN];
+	ncostate_t nco;
+	satstate_t sat;
+	rxframe_t rx;
+	range_t rho[MAX_CHAN];
 	double elvmask = 0.0; // in degree
 
-	int ip,qp;
-	int iTable;
-	short *iq_buff = NULL;
-	signed char *iq8_buff = NULL;
+	iowriter_t writer;
+	iqblock_t *blk = NULL;
+	int nbuff;
+	int fused;
+	int direct_io;
+	int prealloc;
+#ifdef USE_DIRECT_IO
+	directio_t direct;
+#endif
+	directio_t *pdirect = NULL;
+	char shmname[MAX_CHAR]; // Shared memory ring, empty for none
+#ifndef _WIN32
+	shmring_t ring;
+#endif
+	void *pring = NULL;
+	long long outsize;
 
 	gpstime_t grx;
 	double delt;
 	int isamp;
+	int n;
 
-	int iumd;
-	int numd;
+	double pos[3];
 	char umfile[MAX_CHAR];
-	double xyz[USER_MOTION_SIZE][3];
+	int umformat = UM_ECEF;
+	usermotion_t um;
+	double xyz[3];
 
 	int staticLocationMode = FALSE;
-	int nmeaGGA = FALSE;
-	int umLLH = FALSE;
+	int checkMotion = FALSE;
 
-	char navfile[MAX_CHAR];
 	char outfile[MAX_CHAR];
 
 	double samp_freq;
 	int iq_buff_size;
 	int data_format;
 
+	int epoch_ms; // Range and Doppler update interval in ms
+	int block_ms; // Output block length in ms
+	double epoch;
+	int epoch_samples;
+	int iepoch;
+	int limit_ms;
+	int nfill;
+
 	int result;
 
-	int gain[MAX_CHAN];
 	double path_loss;
 	double ant_gain;
 	double ant_pat[37];
@@ -1765,7 +4913,6 @@ int main(int argc, char *argv[])
 
 	datetime_t t0,tmin,tmax;
 	gpstime_t gmin,gmax;
-	double dt;
 	int igrx;
 
 	double duration;
@@ -1773,6 +4920,17 @@ int main(int argc, char *argv[])
 	int verb;
 
 	int timeoverwrite = FALSE; // Overwrite the TOC and TOE in the RINEX file
+	int timenow = FALSE; // Start time taken from the system clock
+
+	double lookahead; // Real-time lookahead, 0 for off
+	double rt_start = 0.0; // System time of the first sample of a real-time stream, 0 for any
+	pacer_t pacer;
+
+	double orbit_window; // Orbit interpolation window, 0 for off
+
+	int nthreads;
+	workpool_t pool;
+	const char *simd;
 
 	ionoutc_t ionoutc;
 
@@ -1781,16 +4939,25 @@ int main(int argc, char *argv[])
 	////////////////////////////////////////////////////////////
 
 	// Default options
-	navfile[0] = 0;
+	memset(&store, 0, sizeof(ephstore_t));
+	store.tlast.week = -1;
 	umfile[0] = 0;
 	strcpy(outfile, "gpssim.bin");
 	samp_freq = 2.6e6;
 	data_format = SC16;
 	g0.week = -1; // Invalid start time
-	iduration = USER_MOTION_SIZE;
-	duration = (double)iduration/10.0; // Default duration
+	duration = -1.0; // Whole user motion, or STATIC_DEFAULT_DURATION in static mode
 	verb = FALSE;
 	ionoutc.enable = TRUE;
+	nthreads = 1;
+	epoch_ms = 100;
+	block_ms = 0; // Same as the update interval
+	orbit_window = 0.0;
+	nbuff = 3;
+	lookahead = 0.0;
+	shmname[0] = 0;
+	direct_io = FALSE;
+	prealloc = FALSE;
 
 	if (argc<3)
 	{
@@ -1798,31 +4965,38 @@ int main(int argc, char *argv[])
 		exit(1);
 	}
 
-	while ((result=getopt(argc,argv,"e:u:x:g:c:l:o:s:b:T:t:d:iv"))!=-1)
+	while ((result=getopt(argc,argv,"e:C:u:x:g:c:l:o:s:b:T:t:d:ij:E:B:P:W:DFR:S:Vv"))!=-1)
 	{
 		switch (result)
 		{
 		case 'e':
-			strcpy(navfile, optarg);
+			if (store.nfile>=MAX_NAV_FILE)
+			{
+				fprintf(stderr, "ERROR: Too many ephemeris files.\n");
+				exit(1);
+			}
+			store.files[store.nfile++] = optarg;
+			break;
+		case 'C':
+			store.cachedir = optarg;
 			break;
 		case 'u':
 			strcpy(umfile, optarg);
-			nmeaGGA = FALSE;
-			umLLH = FALSE;
+			umformat = UM_ECEF;
 			break;
 		case 'x':
 			// Added by romalvarezllorens@gmail.com
 			strcpy(umfile, optarg);
-			umLLH = TRUE;
+			umformat = UM_LLH;
 			break;
 		case 'g':
 			strcpy(umfile, optarg);
-			nmeaGGA = TRUE;
+			umformat = UM_NMEA_GGA;
 			break;
 		case 'c':
 			// Static ECEF coordinates input mode
 			staticLocationMode = TRUE;
-			sscanf(optarg,"%lf,%lf,%lf",&xyz[0][0],&xyz[0][1],&xyz[0][2]);
+			sscanf(optarg,"%lf,%lf,%lf",&xyz[0],&xyz[1],&xyz[2]);
 			break;
 		case 'l':
 			// Static geodetic coordinates input mode
@@ -1831,7 +5005,7 @@ int main(int argc, char *argv[])
 			sscanf(optarg,"%lf,%lf,%lf",&llh[0],&llh[1],&llh[2]);
 			llh[0] = llh[0] / R2D; // convert to RAD
 			llh[1] = llh[1] / R2D; // convert to RAD
-			llh2xyz(llh,xyz[0]); // Convert llh to xyz
+			llh2xyz(llh,xyz); // Convert llh to xyz
 			break;
 		case 'o':
 			strcpy(outfile, optarg);
@@ -1858,6 +5032,8 @@ int main(int argc, char *argv[])
 			{
 				time_t timer;
 				struct tm *gmt;
+
+				timenow = TRUE;
 				
 				time(&timer);
 				gmt = gmtime(&timer);
@@ -1886,10 +5062,86 @@ int main(int argc, char *argv[])
 			break;
 		case 'd':
 			duration = atof(optarg);
+			if (duration<0.0)
+			{
+				fprintf(stderr, "ERROR: Invalid duration.\n");
+				exit(1);
+			}
 			break;
 		case 'i':
 			ionoutc.enable = FALSE; // Disable ionospheric correction
 			break;
+		case 'j':
+			nthreads = atoi(optarg);
+			if (nthreads<1 || nthreads>MAX_CHAN)
+			{
+				fprintf(stderr, "ERROR: Invalid number of threads.\n");
+				exit(1);
+			}
+			break;
+		case 'E':
+			epoch_ms = (int)(atof(optarg)*1000.0+0.5);
+			if (epoch_ms<1 || epoch_ms>1000 || 30000%epoch_ms!=0)
+			{
+				fprintf(stderr, "ERROR: Invalid update interval. It has to divide 30 seconds.\n");
+				exit(1);
+			}
+			break;
+		case 'B':
+			block_ms = (int)(atof(optarg)*1000.0+0.5);
+			if (block_ms<1 || block_ms>1000)
+			{
+				fprintf(stderr, "ERROR: Invalid output block length.\n");
+				exit(1);
+			}
+			break;
+		case 'P':
+			orbit_window = atof(optarg);
+			if (orbit_window<=0.0 || orbit_window>ORBIT_MAX_WINDOW)
+			{
+				fprintf(stderr, "ERROR: Invalid orbit interpolation window.\n");
+				exit(1);
+			}
+			break;
+		case 'W':
+			nbuff = atoi(optarg);
+			if (nbuff<1 || nbuff>MAX_WRITER_BUFF)
+			{
+				fprintf(stderr, "ERROR: Invalid number of output buffers.\n");
+				exit(1);
+			}
+			break;
+		case 'D':
+			direct_io = TRUE;
+			break;
+		case 'F':
+			prealloc = TRUE;
+			break;
+		case 'R':
+			lookahead = atof(optarg);
+			if (lookahead<=0.0 || lookahead>REALTIME_MAX_LOOKAHEAD)
+			{
+				fprintf(stderr, "ERROR: Invalid real-time lookahead.\n");
+				exit(1);
+			}
+#ifdef _WIN32
+			fprintf(stderr, "ERROR: Real-time mode is not supported on this platform.\n");
+			exit(1);
+#endif
+			break;
+		case 'S':
+#ifdef _WIN32
+			fprintf(stderr, "ERROR: Shared memory output is not supported on this platform.\n");
+			exit(1);
+#endif
+			if (optarg[0]!='/')
+				snprintf(shmname, MAX_CHAR, "/%s", optarg);
+			else
+				snprintf(shmname, MAX_CHAR, "%s", optarg);
+			break;
+		case 'V':
+			checkMotion = TRUE;
+			break;
 		case 'v':
 			verb = TRUE;
 			break;
@@ -1902,7 +5154,29 @@ int main(int argc, char *argv[])
 		}
 	}
 
-	if (navfile[0]==0)
+	if (checkMotion==TRUE)
+	{
+		// Parse the whole user motion file
+		if (umfile[0]==0 || openUserMotion(&um, umfile, umformat)==-1)
+		{
+			fprintf(stderr, "ERROR: Failed to open user motion / NMEA GGA file.\n");
+			exit(1);
+		}
+
+		tstart = clock();
+		while ((result=readUserMotionPoint(&um, xyz))==1)
+			um.numd++;
+		tend = clock();
+
+		closeUserMotion(&um);
+
+		fprintf(stderr, "%d points (%.1f [sec]) in %.3f [sec]\n", um.numd, (double)um.numd/10.0,
+			(double)(tend-tstart)/CLOCKS_PER_SEC);
+
+		exit((result==0 && um.numd>0)?0:1);
+	}
+
+	if (store.nfile==0)
 	{
 		fprintf(stderr, "ERROR: GPS ephemeris file is not specified.\n");
 		exit(1);
@@ -1917,51 +5191,60 @@ int main(int argc, char *argv[])
 		llh[2] = 10.0;
 	}
 
-	if (duration<0.0 || (duration>((double)USER_MOTION_SIZE)/10.0 && !staticLocationMode) || (duration>STATIC_MAX_DURATION && staticLocationMode))
+	if (duration<0.0)
+		duration = staticLocationMode?STATIC_DEFAULT_DURATION:DYNAMIC_MAX_DURATION;
+
+	if ((duration>DYNAMIC_MAX_DURATION && !staticLocationMode) || (duration>STATIC_MAX_DURATION && staticLocationMode))
 	{
 		fprintf(stderr, "ERROR: Invalid duration.\n");
 		exit(1);
 	}
 	iduration = (int)(duration*10.0 + 0.5);
 
-	// Buffer size	
-	samp_freq = floor(samp_freq/10.0);
-	iq_buff_size = (int)samp_freq; // samples per 0.1sec
-	samp_freq *= 10.0;
+	// Integer number of samples per update interval
+	epoch = (double)epoch_ms/1000.0;
+	samp_freq = floor(samp_freq*(double)epoch_ms/1000.0);
+	epoch_samples = (int)samp_freq;
+	samp_freq = samp_freq*1000.0/(double)epoch_ms;
 
 	delt = 1.0/samp_freq;
 
+	// Buffer size
+	if (block_ms==0)
+		iq_buff_size = epoch_samples;
+	else
+		iq_buff_size = (int)(samp_freq*(double)block_ms/1000.0);
+	iq_buff_size &= ~3; // Whole bytes in 1-bit format
+	if (iq_buff_size<4)
+		iq_buff_size = 4;
+
+	if (lookahead>0.0 && lookahead<(double)iq_buff_size/samp_freq)
+	{
+		fprintf(stderr, "ERROR: Real-time lookahead is shorter than the output block.\n");
+		exit(1);
+	}
+
 	////////////////////////////////////////////////////////////
 	// Receiver position
 	////////////////////////////////////////////////////////////
 
 	if (!staticLocationMode)
 	{
-		// Read user motion file
-		if (nmeaGGA==TRUE)
-			numd = readNmeaGGA(xyz, umfile);
-		else if (umLLH == TRUE)
-			numd = readUserMotionLLH(xyz, umfile);
-		else
-			numd = readUserMotion(xyz, umfile);
-
-		if (numd==-1)
+		// Open user motion file. The points are read on demand.
+		if (openUserMotion(&um, umfile, umformat)==-1)
 		{
 			fprintf(stderr, "ERROR: Failed to open user motion / NMEA GGA file.\n");
 			exit(1);
 		}
-		else if (numd==0)
+
+		// Set user initial position
+		if (getUserMotion(&um, 0, xyz)!=1)
 		{
 			fprintf(stderr, "ERROR: Failed to read user motion / NMEA GGA data.\n");
 			exit(1);
 		}
 
-		// Set simulation duration
-		if (numd>iduration)
-			numd = iduration;
-
-		// Set user initial position
-		xyz2llh(xyz[0], llh);
+		xyz2llh(xyz, llh);
 	} 
 	else 
 	{ 
@@ -1969,30 +5252,29 @@ int main(int argc, char *argv[])
 		// Added by scateu@gmail.com 
 		fprintf(stderr, "Using static location mode.\n");
 
-		// Set simulation duration
-		numd = iduration;
-
 		// Set user initial position
-		llh2xyz(llh, xyz[0]);
+		llh2xyz(llh, xyz);
 	}
 
-	fprintf(stderr, "xyz = %11.1f, %11.1f, %11.1f\n", xyz[0][0], xyz[0][1], xyz[0][2]);
+	fprintf(stderr, "xyz = %11.1f, %11.1f, %11.1f\n", xyz[0], xyz[1], xyz[2]);
 	fprintf(stderr, "llh = %11.6f, %11.6f, %11.1f\n", llh[0]*R2D, llh[1]*R2D, llh[2]);
 
 	////////////////////////////////////////////////////////////
 	// Read ephemeris
 	////////////////////////////////////////////////////////////
 
-	neph = readRinexNavAll(eph, &ionoutc, navfile);
+	store.verb = verb;
+
+	neph = loadNextEphemFile(&store, &ionoutc);
 
-	if (neph==0)
+	if (neph==-1)
 	{
-		fprintf(stderr, "ERROR: No ephemeris available.\n");
+		fprintf(stderr, "ERROR: ephemeris file not found.\n");
 		exit(1);
 	}
-	else if (neph==-1)
+	else if (store.tlast.week<0)
 	{
-		fprintf(stderr, "ERROR: ephemeris file not found.\n");
+		fprintf(stderr, "ERROR: No ephemeris available.\n");
 		exit(1);
 	}
 
@@ -2007,31 +5289,39 @@ int main(int argc, char *argv[])
 		fprintf(stderr, "%6d\n", ionoutc.dtls);
 	}
 
-	for (sv=0; sv<MAX_SAT; sv++) 
+	// A real-time stream with -T now starts on a whole second shortly after
+	// the initialization, in GPS time rather than UTC.
+	if (lookahead>0.0 && timenow==TRUE)
 	{
-		if (eph[0][sv].vflg==1)
-		{
-			gmin = eph[0][sv].toc;
-			tmin = eph[0][sv].t;
-			break;
-		}
+		time_t timer;
+		struct tm *gmt;
+
+		time(&timer);
+		timer += REALTIME_START_DELAY;
+		gmt = gmtime(&timer);
+
+		t0.y = gmt->tm_year+1900;
+		t0.m = gmt->tm_mon+1;
+		t0.d = gmt->tm_mday;
+		t0.hh = gmt->tm_hour;
+		t0.mm = gmt->tm_min;
+		t0.sec = (double)gmt->tm_sec;
+
+		date2gps(&t0, &g0);
+		g0 = incGpsTime(g0, (ionoutc.vflg==TRUE)?(double)ionoutc.dtls:18.0); // Leap seconds
+		gps2date(&g0, &t0);
+
+		rt_start = (double)timer;
 	}
 
-	gmax.sec = 0;
-	gmax.week = 0;
-	tmax.sec = 0;
-	tmax.mm = 0;
-	tmax.hh = 0;
-	tmax.d = 0;
-	tmax.m = 0;
-	tmax.y = 0;
+	// Earliest TOC of the first file
+	gmin.week = -1;
 	for (sv=0; sv<MAX_SAT; sv++)
 	{
-		if (eph[neph-1][sv].vflg == 1)
+		if (store.neph[sv]>0 && (gmin.week<0 || subGpsTime(store.eph[sv][0].toc, gmin)<0.0))
 		{
-			gmax = eph[neph-1][sv].toc;
-			tmax = eph[neph-1][sv].t;
-			break;
+			gmin = store.eph[sv][0].toc;
+			tmin = store.eph[sv][0].t;
 		}
 	}
 
@@ -2058,23 +5348,39 @@ int main(int argc, char *argv[])
 			// Overwrite the TOC and TOE to the scenario start time
 			for (sv=0; sv<MAX_SAT; sv++)
 			{
-				for (i=0; i<neph; i++)
+				for (i=0; i<store.neph[sv]; i++)
 				{
-					if (eph[i][sv].vflg == 1)
-					{
-						gtmp = incGpsTime(eph[i][sv].toc, dsec);
-						gps2date(&gtmp,&ttmp);
-						eph[i][sv].toc = gtmp;
-						eph[i][sv].t = ttmp;
+					gtmp = incGpsTime(store.eph[sv][i].toc, dsec);
+					gps2date(&gtmp,&ttmp);
+					store.eph[sv][i].toc = gtmp;
+					store.eph[sv][i].t = ttmp;
 
-						gtmp = incGpsTime(eph[i][sv].toe, dsec);
-						eph[i][sv].toe = gtmp;
-					}
+					gtmp = incGpsTime(store.eph[sv][i].toe, dsec);
+					store.eph[sv][i].toe = gtmp;
 				}
 			}
+
+			store.tlast = incGpsTime(store.tlast, dsec);
+			store.dsec = dsec; // Applies to the files read later
 		}
 		else
 		{
+			// Read the files up to the start time
+			if (loadEphemerides(&store, &ionoutc, g0)==-1)
+				exit(1);
+
+			// Latest TOC read so far
+			gmax = gmin;
+			tmax = tmin;
+			for (sv=0; sv<MAX_SAT; sv++)
+			{
+				if (store.neph[sv]>0 && (subGpsTime(store.eph[sv][store.neph[sv]-1].toc, gmax)>0.0))
+				{
+					gmax = store.eph[sv][store.neph[sv]-1].toc;
+					tmax = store.eph[sv][store.neph[sv]-1].t;
+				}
+			}
+
 			if (subGpsTime(g0, gmin)<0.0 || subGpsTime(gmax, g0)<0.0)
 			{
 				fprintf(stderr, "ERROR: Invalid start time.\n");
@@ -2096,31 +5402,23 @@ int main(int argc, char *argv[])
 
 	fprintf(stderr, "Start time = %4d/%02d/%02d,%02d:%02d:%02.0f (%d:%.0f)\n", 
 		t0.y, t0.m, t0.d, t0.hh, t0.mm, t0.sec, g0.week, g0.sec);
-	fprintf(stderr, "Duration = %.1f [sec]\n", ((double)numd)/10.0);
+	if (staticLocationMode || duration<DYNAMIC_MAX_DURATION)
+		fprintf(stderr, "Duration = %.1f [sec]\n", ((double)iduration)/10.0);
+	else
+		fprintf(stderr, "Duration = whole user motion\n");
 
-	// Select the current set of ephemerides
-	ieph = -1;
+	// Read the files needed for the start time
+	if (loadEphemerides(&store, &ionoutc, g0)==-1)
+		exit(1);
 
-	for (i=0; i<neph; i++)
+	// Check the ephemerides at the start time
+	for (sv=0; sv<MAX_SAT; sv++)
 	{
-		for (sv=0; sv<MAX_SAT; sv++)
-		{
-			if (eph[i][sv].vflg == 1)
-			{
-				dt = subGpsTime(g0, eph[i][sv].toc);
-				if (dt>=-SECONDS_IN_HOUR && dt<SECONDS_IN_HOUR)
-				{
-					ieph = i;
-					break;
-				}
-			}
-		}
-
-		if (ieph>=0) // ieph has been set
+		if (findEphemeris(&store, sv, g0)!=NULL)
 			break;
 	}
 
-	if (ieph == -1)
+	if (sv==MAX_SAT)
 	{
 		fprintf(stderr, "ERROR: No current set of ephemerides has been found.\n");
 		exit(1);
@@ -2130,54 +5428,133 @@ int main(int argc, char *argv[])
 	// Baseband signal buffer and output file
 	////////////////////////////////////////////////////////////
 
-	// Allocate I/Q buffer
-	iq_buff = calloc(2*iq_buff_size, 2);
+	// Select the synthesis kernel
+	simd = initSynthKernels();
+	if (verb==TRUE)
+		fprintf(stderr, "Synthesis kernel: %s\n", simd);
+
+	// Synthesize SC08 and SC01 directly into the output blocks. SC01 needs
+	// every synthesized span to start on a byte boundary.
+	if (data_format==SC08)
+		fused = TRUE;
+	else if (data_format==SC01)
+		fused = (epoch_samples%4==0 && iq_buff_size%4==0);
+	else
+		fused = FALSE;
+
+	if (verb==TRUE && fused==TRUE)
+		fprintf(stderr, "Output: synthesized directly into %d-bit samples\n", (data_format==SC08)?8:1);
 
-	if (iq_buff==NULL)
+	// Start the worker threads
+	if (startWorkerPool(&pool, nthreads, (iq_buff_size<epoch_samples)?iq_buff_size:epoch_samples, fused?data_format:SC16)==-1)
 	{
-		fprintf(stderr, "ERROR: Failed to allocate 16-bit I/Q buffer.\n");
+		fprintf(stderr, "ERROR: Failed to allocate I/Q accumulators.\n");
 		exit(1);
 	}
 
-	if (data_format==SC08)
+	// Size of the whole output
+	if (data_format==SC01)
+		outsize = ((long long)(iduration-1)*100/epoch_ms*epoch_samples*2+7)/8;
+	else if (data_format==SC08)
+		outsize = (long long)(iduration-1)*100/epoch_ms*epoch_samples*2;
+	else
+		outsize = (long long)(iduration-1)*100/epoch_ms*epoch_samples*4;
+
+	if (direct_io==TRUE && (strcmp("-", outfile)==0 || shmname[0]!=0))
 	{
-		iq8_buff = calloc(2*iq_buff_size, 1);
-		if (iq8_buff==NULL)
-		{
-			fprintf(stderr, "ERROR: Failed to allocate 8-bit I/Q buffer.\n");
-			exit(1);
-		}
+		fprintf(stderr, "ERROR: Direct I/O requires an output file.\n");
+		exit(1);
 	}
-	else if (data_format==SC01)
+
+	// Create the shared memory ring, large enough for two blocks
+	fp = NULL;
+#ifndef _WIN32
+	if (shmname[0]!=0)
 	{
-		iq8_buff = calloc(iq_buff_size/4, 1); // byte = {I0, Q0, I1, Q1, I2, Q2, I3, Q3}
-		if (iq8_buff==NULL)
+		size_t ringsize = 2*sampleBytes(iq_buff_size, data_format);
+
+		if (ringsize<SHMRING_DEFAULT_SIZE)
+			ringsize = SHMRING_DEFAULT_SIZE;
+
+		if (createShmRing(&ring, shmname, ringsize, data_format, samp_freq)==-1)
 		{
-			fprintf(stderr, "ERROR: Failed to allocate compressed 1-bit I/Q buffer.\n");
+			fprintf(stderr, "ERROR: Failed to create shared memory ring %s.\n", shmname);
 			exit(1);
 		}
+
+		pring = &ring;
+
+		if (verb==TRUE)
+			fprintf(stderr, "Output: shared memory ring %s of %.1f [MB]\n", shmname, (double)ring.size/1048576.0);
 	}
+#endif
 
 	// Open output file
 	// "-" can be used as name for stdout
-	if(strcmp("-", outfile)){
-		if (NULL==(fp=fopen(outfile,"wb")))
+	if (direct_io==TRUE)
+	{
+#ifdef USE_DIRECT_IO
+		if (openDirect(&direct, outfile)==0)
 		{
-			fprintf(stderr, "ERROR: Failed to open output file.\n");
-			exit(1);
+			pdirect = &direct;
+
+			if (verb==TRUE)
+				fprintf(stderr, "Output: direct I/O with %s\n", (direct.ring>=0)?"io_uring":"pwrite");
+		}
+		else
+		{
+			// O_DIRECT is not supported by every file system
+			fprintf(stderr, "WARNING: Direct I/O is not available. Using buffered output.\n");
+		}
+#else
+		fprintf(stderr, "WARNING: Direct I/O is not supported on this platform. Using buffered output.\n");
+#endif
+	}
+
+	if (pdirect==NULL && pring==NULL)
+	{
+		if(strcmp("-", outfile)){
+			if (NULL==(fp=fopen(outfile,"wb")))
+			{
+				fprintf(stderr, "ERROR: Failed to open output file.\n");
+				exit(1);
+			}
+		}else{
+			fp = stdout;
 		}
-	}else{
-		fp = stdout;
+	}
+
+	// Reserve the disk space up front to keep the file contiguous
+	if (prealloc==TRUE)
+	{
+		if (!staticLocationMode && duration>=DYNAMIC_MAX_DURATION)
+			fprintf(stderr, "WARNING: Length of the user motion unknown. Set -d to preallocate the output file.\n");
+		else if (fp==stdout || pring!=NULL || preallocateOutput((pdirect!=NULL)?pdirect->fd:fileno(fp), outsize)==-1)
+			fprintf(stderr, "WARNING: Failed to preallocate the output file.\n");
+		else if (verb==TRUE)
+			fprintf(stderr, "Output: %lld bytes preallocated\n", outsize);
+	}
+
+	// Allocate the I/Q buffers and start the writer thread
+	if (startWriter(&writer, fp, pdirect, pring, data_format, fused, nbuff, iq_buff_size)==-1)
+	{
+		fprintf(stderr, "ERROR: Failed to allocate I/Q buffers.\n");
+		exit(1);
 	}
 
 	////////////////////////////////////////////////////////////
 	// Initialize channels
 	////////////////////////////////////////////////////////////
 
+	// Generate the C/A codes
+	initCodeTable();
+
 	// Clear all channels
 	for (i=0; i<MAX_CHAN; i++)
 		chan[i].prn = 0;
 
+	memset(&nco, 0, sizeof(ncostate_t));
+
 	// Clear satellite allocation flag
 	for (sv=0; sv<MAX_SAT; sv++)
 		allocatedSat[sv] = -1;
@@ -2186,7 +5563,11 @@ int main(int argc, char *argv[])
 	grx = incGpsTime(g0, 0.0);
 
 	// Allocate visible satellites
-	allocateChannel(chan, eph[ieph], ionoutc, grx, xyz[0], elvmask);
+	allocateChannel(chan, &nco, &store, ionoutc, grx, xyz, elvmask);
+
+	memset(&sat, 0, sizeof(satstate_t));
+	sat.window = orbit_window;
+	loadChannelEphemerides(&sat, chan);
 
 	for(i=0; i<MAX_CHAN; i++)
 	{
@@ -2208,152 +5589,125 @@ int main(int argc, char *argv[])
 
 	tstart = clock();
 
+	// Anchor the real-time stream to the system clock
+	if (lookahead>0.0)
+	{
+		double delay = lookahead; // Fill the lookahead before the playback
+#ifndef _WIN32
+		struct timespec ts;
+
+		if (rt_start>0.0)
+		{
+			clock_gettime(CLOCK_REALTIME, &ts);
+			delay = rt_start - ((double)ts.tv_sec + (double)ts.tv_nsec*1.0e-9);
+
+			if (delay<0.0)
+				fprintf(stderr, "WARNING: Real-time stream starts %.3f [sec] late.\n", -delay);
+		}
+#endif
+		startPacer(&pacer, lookahead, samp_freq, delay);
+	}
+
 	// Update receiver time
-	grx = incGpsTime(grx, 0.1);
+	grx = incGpsTime(grx, epoch);
 
-	for (iumd=1; iumd<numd; iumd++)
+	// Duration in ms from the first point of the user motion
+	limit_ms = (iduration-1)*100;
+	nfill = 0;
+
+	for (iepoch=1; iepoch*epoch_ms<=limit_ms; iepoch++)
 	{
+		// Stop when the output fails, e.g. the player has exited
+		if (writerFailed(&writer))
+			break;
+
+		// Receiver position at the end of the update interval
+		if (!staticLocationMode)
+		{
+			if ((result=getUserMotion(&um, iepoch*epoch_ms, pos))==0)
+				break; // End of the user motion
+
+			if (result==-1)
+			{
+				fprintf(stderr, "\nERROR: Failed to read user motion / NMEA GGA data.\n");
+#ifndef _WIN32
+				if (pring!=NULL)
+					closeShmRing(&ring);
+#endif
+				exit(1);
+			}
+		}
+		else
+		{
+			pos[0] = xyz[0];
+			pos[1] = xyz[1];
+			pos[2] = xyz[2];
+		}
+
+		// Current pseudoranges of all channels
+		initRxFrame(&rx, pos);
+		satposBatch(&sat, grx);
+		computeRanges(rho, &sat, &ionoutc, grx, &rx);
+
 		for (i=0; i<MAX_CHAN; i++)
 		{
 			if (chan[i].prn>0)
 			{
 				// Refresh code phase and data bit counters
-				range_t rho;
-				sv = chan[i].prn-1;
-
-				// Current pseudorange
-				if (!staticLocationMode)
-					computeRange(&rho, eph[ieph][sv], &ionoutc, grx, xyz[iumd]);
-				else
-					computeRange(&rho, eph[ieph][sv], &ionoutc, grx, xyz[0]);
-
-				chan[i].azel[0] = rho.azel[0];
-				chan[i].azel[1] = rho.azel[1];
+				chan[i].azel[0] = rho[i].azel[0];
+				chan[i].azel[1] = rho[i].azel[1];
 
 				// Update code phase and data bit counters
-				computeCodePhase(&chan[i], rho, 0.1);
-#ifndef FLOAT_CARR_PHASE
-				chan[i].carr_phasestep = (int)round(512.0 * 65536.0 * chan[i].f_carr * delt);
-#endif
+				computeCodePhase(&chan[i], &nco, i, rho[i], epoch, delt);
 				// Path loss
-				path_loss = 20200000.0/rho.d;
+				path_loss = 20200000.0/rho[i].d;
 
 				// Receiver antenna gain
-				ibs = (int)((90.0-rho.azel[1]*R2D)/5.0); // covert elevation to boresight
+				ibs = (int)((90.0-rho[i].azel[1]*R2D)/5.0); // covert elevation to boresight
 				ant_gain = ant_pat[ibs];
 
 				// Signal gain
-				gain[i] = (int)(path_loss*ant_gain*128.0); // scaled by 2^7
+				nco.gain[i] = (int)(path_loss*ant_gain*128.0); // scaled by 2^7
 			}
 		}
 
-		for (isamp=0; isamp<iq_buff_size; isamp++)
+		// Synthesize the I/Q samples of all channels and write out full blocks
+		for (isamp=0; isamp<epoch_samples; isamp+=n)
 		{
-			int i_acc = 0;
-			int q_acc = 0;
+			n = epoch_samples-isamp;
+			if (n>iq_buff_size-nfill)
+				n = iq_buff_size-nfill;
 
-			for (i=0; i<MAX_CHAN; i++)
+			if (nfill==0)
 			{
-				if (chan[i].prn>0)
-				{
-#ifdef FLOAT_CARR_PHASE
-					iTable = (int)floor(chan[i].carr_phase*512.0);
-#else
-					iTable = (chan[i].carr_phase >> 16) & 0x1ff; // 9-bit index
-#endif
-					ip = chan[i].dataBit * chan[i].codeCA * cosTable512[iTable] * gain[i];
-					qp = chan[i].dataBit * chan[i].codeCA * sinTable512[iTable] * gain[i];
+				if (lookahead>0.0)
+					waitPacer(&pacer);
 
-					// Accumulate for all visible satellites
-					i_acc += ip;
-					q_acc += qp;
-
-					// Update code phase
-					chan[i].code_phase += chan[i].f_code * delt;
-
-					if (chan[i].code_phase>=CA_SEQ_LEN)
-					{
-						chan[i].code_phase -= CA_SEQ_LEN;
-
-						chan[i].icode++;
-					
-						if (chan[i].icode>=20) // 20 C/A codes = 1 navigation data bit
-						{
-							chan[i].icode = 0;
-							chan[i].ibit++;
-						
-							if (chan[i].ibit>=30) // 30 navigation data bits = 1 word
-							{
-								chan[i].ibit = 0;
-								chan[i].iword++;
-								/*
-								if (chan[i].iword>=N_DWRD)
-									fprintf(stderr, "\nWARNING: Subframe word buffer overflow.\n");
-								*/
-							}
-
-							// Set new navigation data bit
-							chan[i].dataBit = (int)((chan[i].dwrd[chan[i].iword]>>(29-chan[i].ibit)) & 0x1UL)*2-1;
-						}
-					}
-
-					// Set current code chip
-					chan[i].codeCA = chan[i].ca[(int)chan[i].code_phase]*2-1;
-
-					// Update carrier phase
-#ifdef FLOAT_CARR_PHASE
-					chan[i].carr_phase += chan[i].f_carr * delt;
-
-					if (chan[i].carr_phase >= 1.0)
-						chan[i].carr_phase -= 1.0;
-					else if (chan[i].carr_phase<0.0)
-						chan[i].carr_phase += 1.0;
-#else
-					chan[i].carr_phase += chan[i].carr_phasestep;
-#endif
-				}
+				blk = nextWriterBlock(&writer);
 			}
 
-			// Scaled by 2^7
-			i_acc = (i_acc+64)>>7;
-			q_acc = (q_acc+64)>>7;
-
-			// Store I/Q samples into buffer
-			iq_buff[isamp*2] = (short)i_acc;
-			iq_buff[isamp*2+1] = (short)q_acc;
-		}
+			if (fused==TRUE)
+				synthesizeBlock(&pool, chan, &nco, NULL, blk->iq8_buff+sampleBytes(nfill, data_format), n);
+			else
+				synthesizeBlock(&pool, chan, &nco, blk->iq_buff+2*nfill, NULL, n);
+			nfill += n;
 
-		if (data_format==SC01)
-		{
-			for (isamp=0; isamp<2*iq_buff_size; isamp++)
+			if (nfill==iq_buff_size)
 			{
-				if (isamp%8==0)
-					iq8_buff[isamp/8] = 0x00;
-
-				iq8_buff[isamp/8] |= (iq_buff[isamp]>0?0x01:0x00)<<(7-isamp%8);
+				submitWriterBlock(&writer, iq_buff_size);
+				if (lookahead>0.0)
+					submitPacer(&pacer, iq_buff_size);
+				nfill = 0;
 			}
-
-			fwrite(iq8_buff, 1, iq_buff_size/4, fp);
-		}
-		else if (data_format==SC08)
-		{
-			for (isamp=0; isamp<2*iq_buff_size; isamp++)
-				iq8_buff[isamp] = iq_buff[isamp]>>4; // 12-bit bladeRF -> 8-bit HackRF
-
-			fwrite(iq8_buff, 1, 2*iq_buff_size, fp);
-		} 
-		else // data_format==SC16
-		{
-			fwrite(iq_buff, 2, 2*iq_buff_size, fp);
 		}
 
 		//
 		// Update navigation message and channel allocation every 30 seconds
 		//
 
-		igrx = (int)(grx.sec*10.0+0.5);
+		igrx = (int)(grx.sec*1000.0+0.5);
 
-		if (igrx%300==0) // Every 30 seconds
+		if (igrx%30000==0) // Every 30 seconds
 		{
 			// Update navigation message
 			for (i=0; i<MAX_CHAN; i++)
@@ -2362,34 +5716,29 @@ int main(int argc, char *argv[])
 					generateNavMsg(grx, &chan[i], 0);
 			}
 
+			// Read the next ephemeris file when needed
+			if (loadEphemerides(&store, &ionoutc, grx)==-1)
+				exit(1);
+
 			// Refresh ephemeris and subframes
-			// Quick and dirty fix. Need more elegant way.
-			for (sv=0; sv<MAX_SAT; sv++)
+			for (i=0; i<MAX_CHAN; i++)
 			{
-				if (eph[ieph+1][sv].vflg==1)
+				if (chan[i].prn>0)
 				{
-					dt = subGpsTime(eph[ieph+1][sv].toc, grx);
-					if (dt<SECONDS_IN_HOUR)
+					eph = findEphemeris(&store, chan[i].prn-1, grx);
+
+					// Generate new subframes for a new ephemeris
+					if (eph!=NULL && (subGpsTime(eph->toe, chan[i].eph.toe)!=0.0 || eph->iode!=chan[i].eph.iode))
 					{
-						ieph++;
-
-						for (i=0; i<MAX_CHAN; i++)
-						{
-							// Generate new subframes if allocated
-							if (chan[i].prn!=0) 
-								eph2sbf(eph[ieph][chan[i].prn-1], ionoutc, chan[i].sbf);
-						}
+						chan[i].eph = *eph;
+						eph2sbf(chan[i].eph, ionoutc, chan[i].sbf);
 					}
-						
-					break;
 				}
 			}
 
 			// Update channel allocation
-			if (!staticLocationMode)
-				allocateChannel(chan, eph[ieph], ionoutc, grx, xyz[iumd], elvmask);
-			else
-				allocateChannel(chan, eph[ieph], ionoutc, grx, xyz[0], elvmask);
+			allocateChannel(chan, &nco, &store, ionoutc, grx, pos, elvmask);
+			loadChannelEphemerides(&sat, chan);
 
 			// Show details about simulated channels
 			if (verb==TRUE)
@@ -2405,25 +5754,96 @@ int main(int argc, char *argv[])
 		}
 
 		// Update receiver time
-		grx = incGpsTime(grx, 0.1);
+		grx = incGpsTime(grx, epoch);
 
 		// Update time counter
-		fprintf(stderr, "\rTime into run = %4.1f", subGpsTime(grx, g0));
-		fflush(stdout);
+		if (epoch_ms>=100 || (iepoch*epoch_ms)%100==0)
+		{
+			fprintf(stderr, "\rTime into run = %4.1f", subGpsTime(grx, g0));
+			fflush(stderr);
+		}
+	}
+
+	// Write out the last partial block
+	if (nfill>0)
+	{
+		submitWriterBlock(&writer, nfill);
+		if (lookahead>0.0)
+			submitPacer(&pacer, nfill);
+	}
+
+	// Stop the writer thread after the queued blocks are written
+	if (stopWriter(&writer)==-1)
+	{
+#ifndef _WIN32
+		if (pring!=NULL)
+		{
+			fprintf(stderr, "\nERROR: The player has exited from the shared memory ring.\n");
+			closeShmRing(&ring);
+			exit(1);
+		}
+#endif
+		fprintf(stderr, "\nERROR: Failed to write output file.\n");
+		exit(1);
+	}
+
+#ifdef USE_DIRECT_IO
+	if (pdirect!=NULL && closeDirect(pdirect)==-1)
+	{
+		fprintf(stderr, "\nERROR: Failed to write output file.\n");
+		exit(1);
+	}
+#endif
+
+	// Mark the end of the samples and wait for the player to read them
+#ifndef _WIN32
+	if (pring!=NULL)
+	{
+		if (finishShmRing(&ring)==-1)
+		{
+			fprintf(stderr, "\nERROR: The player has exited from the shared memory ring.\n");
+			closeShmRing(&ring);
+			exit(1);
+		}
+
+		closeShmRing(&ring);
 	}
+#endif
 
 	tend = clock();
 
 	fprintf(stderr, "\nDone!\n");
 
-	// Free I/Q buffer
-	free(iq_buff);
+	// Stop the worker threads
+	stopWorkerPool(&pool);
+
+	freeEphemStore(&store);
+
+	if (!staticLocationMode)
+		closeUserMotion(&um);
 
 	// Close file
-	fclose(fp);
+	if (fp!=NULL)
+	{
+		if (prealloc==TRUE && fp!=stdout && trimOutput(fp)==-1)
+			fprintf(stderr, "WARNING: Failed to release the unused preallocated space.\n");
+
+		fclose(fp);
+	}
 
 	// Process time
 	fprintf(stderr, "Process time = %.1f [sec]\n", (double)(tend-tstart)/CLOCKS_PER_SEC);
 
+	// Blocks that missed their playback time, and waits for the output, which
+	// falls behind the real time
+	if (lookahead>0.0)
+		fprintf(stderr, "Real time: %ld blocks, %ld underruns (%.3f [sec] max. late), %ld overruns\n",
+			pacer.nblock, pacer.nunder, pacer.late, writer.nstall);
+
+	// Back-pressure of the writer
+	if (writer.nbuff>1 && writer.nblock>0)
+		fprintf(stderr, "Output queue depth = %.1f avg, %d max of %d, %ld stalls, %.1f [sec] waiting\n",
+			(double)writer.depth/(double)writer.nblock, writer.maxdepth, writer.nbuff, writer.nstall, writer.stall);
+
 	return(0);
 }
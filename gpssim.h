@@ -1,7 +1,19 @@
 #ifndef GPSSIM_H
 #define GPSSIM_H
 
+#ifndef _WIN32
+#include <pthread.h>
+#include "shmring.h"
+#endif
+
 //#define FLOAT_CARR_PHASE // For RKT simulation. Higher computational load, but smoother carrier phase.
+//#define FLOAT_CODE_PHASE // Double-precision code phase accumulator of the earlier versions.
+//#define EXACT_SATPOS // Orbit propagation of the earlier versions, bit for bit with satpos().
+//#define DISABLE_SIMD // Use the scalar reference kernels only.
+
+#ifdef FLOAT_CODE_PHASE
+#define EXACT_SATPOS // Old captures are only reproduced with the reference orbits
+#endif
 
 #define TRUE	(1)
 #define FALSE	(0)
@@ -15,14 +27,15 @@
 /*! \brief Maximum number of channels we simulate */
 #define MAX_CHAN (16)
 
-/*! \brief Maximum number of user motion points */
-#ifndef USER_MOTION_SIZE
-#define USER_MOTION_SIZE (3000) // max duration at 10Hz
-#endif
+/*! \brief Default duration for static mode */
+#define STATIC_DEFAULT_DURATION (300) // second
 
 /*! \brief Maximum duration for static mode*/
 #define STATIC_MAX_DURATION (86400) // second
 
+/*! \brief Maximum duration for dynamic mode */
+#define DYNAMIC_MAX_DURATION (1000000) // second, keeps the time into run in ms within an int
+
 /*! \brief Number of subframes */
 #define N_SBF (5) // 5 subframes per frame
 
@@ -32,9 +45,52 @@
 /*! \brief Number of words */
 #define N_DWRD ((N_SBF+1)*N_DWRD_SBF) // Subframe word buffer size
 
+/*! \brief Convergence threshold and iteration limit of Kepler's equation */
+#define KEPLER_TOL (1.0E-12)
+#define KEPLER_MAX_ITER (20)
+
+/*! \brief Number of Chebyshev nodes of the orbit interpolation (degree + 1) */
+#define ORBIT_CHEB_NODES (8)
+
+/*! \brief Accuracy bound of the orbit interpolation, checked on every fit */
+#define ORBIT_INTERP_TOL (1.0E-3) // meter
+
+/*! \brief Maximum orbit interpolation window */
+#define ORBIT_MAX_WINDOW (3600.0) // second
+
 /*! \brief C/A code sequence length */
 #define CA_SEQ_LEN (1023)
 
+/*! \brief Fixed-point code phase in 2^-32 chip */
+#define CODE_PHASE_ONE_CHIP (4294967296.0)
+#define CODE_PHASE_SEQ_LEN ((unsigned long long)CA_SEQ_LEN<<32)
+
+/*! \brief Minimum number of samples per chip for generating the code in chip runs */
+#ifndef CHIP_RUN_MIN_SAMPLES
+#define CHIP_RUN_MIN_SAMPLES (8)
+#endif
+
+/*! \brief Number of samples processed at a time by the synthesis kernels */
+#define SYNTH_CHUNK_SIZE (1024)
+
+/*! \brief Maximum number of output blocks in the writer ring */
+#define MAX_WRITER_BUFF (16)
+
+/*! \brief Maximum lookahead of the real-time mode [sec] */
+#define REALTIME_MAX_LOOKAHEAD (10.0)
+
+/*! \brief Time from the start time taken with -T now until the start of a real-time stream [sec] */
+#define REALTIME_START_DELAY (2)
+
+/*! \brief Alignment of the buffers, offsets and lengths of direct output */
+#define DIRECT_ALIGN (4096)
+
+/*! \brief Size of a direct output write */
+#define DIRECT_CHUNK_SIZE (1<<20)
+
+/*! \brief Number of direct output writes in flight */
+#define DIRECT_MAX_INFLIGHT (8)
+
 #define SECONDS_IN_WEEK 604800.0
 #define SECONDS_IN_HALF_WEEK 302400.0
 #define SECONDS_IN_DAY 86400.0
@@ -78,7 +134,14 @@
 #define SC08 (8)
 #define SC16 (16)
 
-#define EPHEM_ARRAY_SIZE (13) // for daily GPS broadcast ephemers file (brdc)
+/*! \brief Maximum number of RINEX navigation files */
+#define MAX_NAV_FILE (64)
+
+/*! \brief Maximum age of an ephemeris in use */
+#define EPHEM_MAX_AGE (4.0*SECONDS_IN_HOUR)
+
+/*! \brief The next navigation file is read this long before the ephemerides run out */
+#define EPHEM_LOOKAHEAD (2.0*SECONDS_IN_HOUR)
 
 /*! \brief Structure representing GPS time */
 typedef struct
@@ -102,6 +165,7 @@ typedef struct
 typedef struct
 {
 	int vflg;	/*!< Valid Flag */
+	int prn;	/*!< PRN number */
 	datetime_t t;
 	gpstime_t toc;	/*!< Time of Clock */
 	gpstime_t toe;	/*!< Time of Ephemeris */
@@ -146,6 +210,95 @@ typedef struct
 	int dtlsf,dn,wnlsf;
 } ionoutc_t;
 
+/*! \brief Version of the binary ephemeris cache, bump on any layout change */
+#define EPHEM_CACHE_VERSION (2)
+
+/*! \brief Header of the binary ephemeris cache
+ *
+ * The header is followed by the ionoutc_t and the ephem_t records of the file
+ * as stored in memory. The cache is only valid on the machine and build that
+ * wrote it.
+ */
+typedef struct
+{
+	char magic[8];	/*!< "GPSEPHC" */
+	int version;	/*!< EPHEM_CACHE_VERSION */
+	int eph_size;	/*!< sizeof(ephem_t) */
+	int iono_size;	/*!< sizeof(ionoutc_t) */
+	int nsat;	/*!< MAX_SAT */
+	int neph;	/*!< Number of ephemeris records */
+	int reserved;	/*!< Zero */
+	long long src_size;	/*!< Size of the RINEX file */
+	long long src_mtime;	/*!< Modification time of the RINEX file */
+	unsigned long long src_hash;	/*!< FNV-1a hash of the RINEX file */
+} ephcache_t;
+
+/*! \brief Ephemerides of all satellites indexed by (PRN, TOE)
+ *
+ * The RINEX files are read in the given order when the scenario time
+ * approaches the last loaded ephemeris.
+ */
+typedef struct
+{
+	ephem_t *eph[MAX_SAT];	/*!< Ephemerides of each satellite sorted by TOE */
+	int neph[MAX_SAT];	/*!< Number of ephemerides of each satellite */
+	int size[MAX_SAT];	/*!< Allocated entries of each satellite */
+	gpstime_t tlast;	/*!< Latest TOE loaded so far */
+	double dsec;	/*!< Time shift applied to the TOC and TOE (-T) */
+	const char *files[MAX_NAV_FILE];
+	int nfile;
+	int ifile;	/*!< Next file to load */
+	const char *cachedir;	/*!< Directory of the binary caches, NULL if not used */
+	int verb;
+} ephstore_t;
+
+/*! \brief Receiver position and local frame, computed once per epoch */
+typedef struct
+{
+	double xyz[3];	/*!< ECEF position */
+	double llh[3];	/*!< Geodetic position */
+	double tmat[3][3];	/*!< ECEF to NEU rotation from \ref ltcmat */
+} rxframe_t;
+
+/*! \brief Ephemerides and states of a batch of satellites in structure-of-arrays layout
+ *
+ * Slot i holds one satellite. The ephemeris columns are loaded when the
+ * ephemeris changes, the states are evaluated for all slots at once. Each
+ * slot also works as an orbit propagator: Kepler's equation is solved
+ * starting from the eccentric anomaly of the previous evaluation.
+ */
+typedef struct
+{
+	int n;	/*!< Number of slots in use */
+	int prn[MAX_SAT];	/*!< PRN number, 0 for an unused slot */
+	const ephem_t *eph[MAX_SAT];	/*!< Ephemeris loaded into the slot */
+	double window;	/*!< Orbit interpolation window in seconds, 0 to evaluate the model */
+	// Ephemeris columns, see ephem_t
+	double toe[MAX_SAT],toc[MAX_SAT];
+	double m0[MAX_SAT],n0[MAX_SAT],ecc[MAX_SAT],sqrta[MAX_SAT],sq1e2[MAX_SAT],A[MAX_SAT];
+	double aop[MAX_SAT],cus[MAX_SAT],cuc[MAX_SAT],crs[MAX_SAT],crc[MAX_SAT],cis[MAX_SAT],cic[MAX_SAT];
+	double inc0[MAX_SAT],idot[MAX_SAT],omg0[MAX_SAT],omgkdot[MAX_SAT];
+	double af0[MAX_SAT],af1[MAX_SAT],af2[MAX_SAT],tgd[MAX_SAT];
+	// Time-invariant terms
+	double saop[MAX_SAT],caop[MAX_SAT];	/*!< sin and cos of the argument of perigee */
+	double omgt[MAX_SAT];	/*!< omg0 - OMEGA_EARTH*toe */
+	double relk[MAX_SAT];	/*!< Relativistic clock correction per sin(E) */
+	// Propagator state for the warm start of Kepler's equation
+	int warm[MAX_SAT];	/*!< The slot has been evaluated with the current ephemeris */
+	double ek[MAX_SAT];	/*!< Eccentric anomaly of the last evaluation */
+	double mk[MAX_SAT];	/*!< Mean anomaly of the last evaluation */
+	double dedm[MAX_SAT];	/*!< dE/dM = 1/(1-e*cos(E)) of the last evaluation */
+	// Orbit interpolation: pos, vel and clk as Chebyshev series in TOE-relative time
+	int fitted[MAX_SAT];	/*!< The series are valid for the current ephemeris */
+	int nofit[MAX_SAT];	/*!< No fit met ORBIT_INTERP_TOL, the model is evaluated instead */
+	double wt0[MAX_SAT],wt1[MAX_SAT];	/*!< Fitted interval */
+	double cheb[8][ORBIT_CHEB_NODES][MAX_SAT];	/*!< Coefficients */
+	// Satellite states
+	double pos[3][MAX_SAT];
+	double vel[3][MAX_SAT];
+	double clk[2][MAX_SAT];
+} satstate_t;
+
 typedef struct
 {
 	gpstime_t g;
@@ -156,30 +309,200 @@ typedef struct
 	double iono_delay;
 } range_t;
 
-/*! \brief Structure representing a Channel */
+// User motion file formats
+#define UM_ECEF (0) // time, x, y, z
+#define UM_LLH (1) // time, lat, lon, height
+#define UM_NMEA_GGA (2) // NMEA GGA sentences
+
+/*! \brief Streaming reader of a 10Hz user motion file */
+typedef struct
+{
+	FILE *fp;	/*!< Used when the file cannot be memory-mapped */
+	const char *map;	/*!< Memory-mapped file */
+	size_t size;	/*!< Size of the mapped file */
+	size_t pos;	/*!< Offset of the next line in the mapped file */
+	size_t released;	/*!< Offset up to which the mapped pages are released */
+	char line[MAX_CHAR];
+	int lineno;	/*!< Line number of the current line */
+	const char *name;	/*!< File name for error messages */
+	int format;	/*!< UM_ECEF, UM_LLH or UM_NMEA_GGA */
+	int numd;	/*!< Number of points read so far */
+	double xyz[2][3]; /*!< Last two points, point k is in xyz[k%2] */
+} usermotion_t;
+
+/*! \brief Structure representing a Channel
+ *
+ * The state that is updated for every sample is kept in ncostate_t.
+ */
 typedef struct
 {
 	int prn;	/*< PRN Number */
-	int ca[CA_SEQ_LEN]; /*< C/A Sequence */
 	double f_carr;	/*< Carrier frequency */
 	double f_code;	/*< Code frequency */
-#ifdef FLOAT_CARR_PHASE
-	double carr_phase;
-#else
-	unsigned int carr_phase; /*< Carrier phase */
-	int carr_phasestep;	/*< Carrier phasestep */
-#endif
-	double code_phase; /*< Code phase */
 	gpstime_t g0;	/*!< GPS time at start */
 	unsigned long sbf[5][N_DWRD_SBF]; /*!< current subframe */
 	unsigned long dwrd[N_DWRD]; /*!< Data words of sub-frame */
-	int iword;	/*!< initial word */
-	int ibit;	/*!< initial bit */
-	int icode;	/*!< initial code */
-	int dataBit;	/*!< current data bit */
-	int codeCA;	/*!< current C/A code */
 	double azel[2];
 	range_t rho0;
+	ephem_t eph;	/*!< Ephemeris in use */
 } channel_t;
 
+/*! \brief Code and carrier NCO state of all channels
+ *
+ * One array per field indexed by channel, so that the fields read by the
+ * sample loop of all channels share a few cache lines instead of being
+ * spread over the channel_t array.
+ */
+typedef struct
+{
+#ifdef FLOAT_CARR_PHASE
+	double carr_phase[MAX_CHAN];
+	double carr_phasestep[MAX_CHAN];	/*< Carrier phasestep in cycles */
+#else
+	unsigned int carr_phase[MAX_CHAN]; /*< Carrier phase */
+	int carr_phasestep[MAX_CHAN];	/*< Carrier phasestep */
+#endif
+#ifdef FLOAT_CODE_PHASE
+	double code_phase[MAX_CHAN]; /*< Code phase */
+	double code_phasestep[MAX_CHAN]; /*< Code phasestep in chips */
+#else
+	unsigned long long code_phase[MAX_CHAN]; /*< Code phase in 2^-32 chip */
+	unsigned long long code_phasestep[MAX_CHAN]; /*< Code phasestep */
+#endif
+	const signed char *ca[MAX_CHAN]; /*< C/A Sequence (+1/-1), row of caTable */
+	const unsigned long *dwrd[MAX_CHAN]; /*!< Data words of the channel */
+	int iword[MAX_CHAN];	/*!< initial word */
+	int ibit[MAX_CHAN];	/*!< initial bit */
+	int icode[MAX_CHAN];	/*!< initial code */
+	int dataBit[MAX_CHAN];	/*!< current data bit */
+	int codeCA[MAX_CHAN];	/*!< current C/A code */
+	int gain[MAX_CHAN];	/*!< Signal gain scaled by 2^7 */
+} ncostate_t;
+
+// Worker pool tasks
+#define POOL_TASK_SYNTH (0) // Accumulate the samples of the assigned channels
+#define POOL_TASK_REDUCE (1) // Sum up the accumulators over the assigned sample range
+
+struct workpool;
+
+/*! \brief Per-thread argument of the worker pool */
+typedef struct
+{
+	struct workpool *pool;
+	int id;		/*!< Worker index, 0 is the main thread */
+} workarg_t;
+
+/*! \brief Pool of threads splitting the synthesis of an I/Q block by channel */
+typedef struct workpool
+{
+	int nthreads;	/*!< Number of workers including the main thread */
+#ifndef _WIN32
+	pthread_t tid[MAX_CHAN];
+	pthread_mutex_t lock;
+	pthread_cond_t start;
+	pthread_cond_t done;
+#endif
+	workarg_t arg[MAX_CHAN];
+	unsigned int job;	/*!< Dispatch counter */
+	int task;	/*!< Current task */
+	int busy;	/*!< Number of workers still running the current task */
+	int quit;
+	int *acc[MAX_CHAN];	/*!< Per-worker I/Q accumulators */
+	// Parameters of the current block
+	ncostate_t *nco;
+	int active[MAX_CHAN];	/*!< Indices of the allocated channels */
+	int nactive;
+	short *iq_buff;
+	signed char *iq8_buff;	/*!< Output of the fused conversion */
+	int data_format;	/*!< Format the samples are converted to in the reduction, SC16 for none */
+	int nsamp;
+} workpool_t;
+
+/*! \brief Output file written with O_DIRECT, bypassing the page cache
+ *
+ * The output is staged in aligned chunks that are written through io_uring
+ * with several writes in flight, or with pwrite() if io_uring is not
+ * available.
+ */
+typedef struct
+{
+	int fd;
+	unsigned char *chunk[DIRECT_MAX_INFLIGHT];	/*!< Aligned staging buffers */
+	size_t len[DIRECT_MAX_INFLIGHT];	/*!< Length of the write of each chunk */
+	int busy[DIRECT_MAX_INFLIGHT];	/*!< The chunk is being written */
+	int cur;	/*!< Chunk being filled */
+	size_t fill;	/*!< Number of bytes in the current chunk */
+	long long offset;	/*!< File offset of the current chunk */
+	int inflight;	/*!< Number of writes in flight */
+	int error;	/*!< A write failed */
+	int ring;	/*!< io_uring descriptor, -1 for synchronous writes */
+	unsigned *sq_head,*sq_tail,*sq_mask,*sq_array;
+	unsigned *cq_head,*cq_tail,*cq_mask;
+	void *sqes,*cqes;
+	void *sq_map,*cq_map;
+	size_t sq_size,cq_size,sqes_size;
+} directio_t;
+
+/*! \brief Block of I/Q samples in the writer ring */
+typedef struct
+{
+	short *iq_buff;	/*!< Interleaved 16-bit I/Q samples, NULL if fused */
+	signed char *iq8_buff;	/*!< Converted samples for SC08 and SC01 */
+	int nsamp;	/*!< Number of samples in the block */
+} iqblock_t;
+
+/*! \brief Output writer with a ring of blocks written by a separate thread
+ *
+ * The blocks are filled by the main thread and converted and written in
+ * order by the writer thread, so the synthesis of a block overlaps with the
+ * output of the previous ones.
+ */
+typedef struct
+{
+	FILE *fp;
+	directio_t *direct;	/*!< Direct output, used instead of \a fp if not NULL */
+#ifndef _WIN32
+	shmring_t *ring;	/*!< Shared memory output, used instead of \a fp if not NULL */
+#endif
+	int data_format;
+	int fused;	/*!< The blocks are synthesized directly into iq8_buff */
+	int nbuff;	/*!< Number of blocks in the ring, 1 to write synchronously */
+	iqblock_t block[MAX_WRITER_BUFF];
+	int head;	/*!< Next block to be filled */
+	int tail;	/*!< Next block to be written */
+	int count;	/*!< Number of blocks queued for writing */
+	int quit;
+	int error;	/*!< A write failed, accessed with setWriterError() and writerFailed() */
+#ifndef _WIN32
+	pthread_t tid;
+	pthread_mutex_t lock;
+	pthread_cond_t filled;
+	pthread_cond_t freed;
+#endif
+	// Back-pressure statistics
+	long nblock;	/*!< Number of blocks submitted */
+	long depth;	/*!< Sum of the queue depths after each submission */
+	int maxdepth;	/*!< Largest queue depth */
+	long nstall;	/*!< Number of times the synthesis waited for a free block */
+	double stall;	/*!< Time spent waiting for a free block in seconds */
+} iowriter_t;
+
+/*! \brief Wall-clock pacing of the output blocks in real-time mode
+ *
+ * A block is started at most \a lookahead seconds before the playback time
+ * of its first sample, counted from the start of the stream at the sample
+ * rate.
+ */
+typedef struct
+{
+	double lookahead;	/*!< Maximum time a block is produced ahead of its playback [sec] */
+	double samp_freq;
+	double tstart;	/*!< CLOCK_MONOTONIC time of the playback of the first sample [sec] */
+	long long nsamp;	/*!< Number of samples submitted */
+	double due;	/*!< Playback time of the block being filled [sec] */
+	long nblock;
+	long nunder;	/*!< Number of blocks submitted after their playback time */
+	double late;	/*!< Largest delay of a block [sec] */
+} pacer_t;
+
 #endif
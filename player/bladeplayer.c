@@ -1,16 +1,27 @@
 #define _CRT_SECURE_NO_WARNINGS
+#ifndef _WIN32
+#define _DEFAULT_SOURCE // usleep() with -std=c11
+#endif
 
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#ifdef BLADERF_MOCK
+#include "bladerf_mock.h"
+#else
 #include <libbladeRF.h>
+#endif
 #ifdef _WIN32
+#include <windows.h>
 #include "getopt.h"
 #else
 #include <getopt.h>
 #include <unistd.h>
 #include <errno.h>
+#include <signal.h>
+#include <pthread.h>
 #endif
+#include "playercore.h"
 
 #define TX_FREQUENCY    1575420000
 #define TX_SAMPLERATE   2600000
@@ -23,50 +34,315 @@
 #define NUM_TRANSFERS       16
 #define TIMEOUT_MS          1000
 
+#define NUM_RAW_CHUNKS      32 // Input read ahead, in buffers
+#define STAGE_SLEEP_US      500 // Wait of a pipeline stage for space
+
 #define AMPLITUDE (1000) // Default amplitude for 12-bit I/Q
 
+volatile int do_exit = 0;
+
+#ifndef _WIN32
+// Single-producer/single-consumer queue of stream buffers. There are only
+// NUM_BUFFERS buffers, so it never overflows.
+typedef struct
+{
+    void *item[NUM_BUFFERS];
+    uint64_t head; // Pushed by the producer
+    uint64_t tail; // Popped by the consumer
+} buffer_queue_t;
+
+// Stages of the async streaming: the reader of the player core reads the
+// input ahead, the converter thread expands it into the stream buffers and
+// the stream callback hands those to libbladeRF.
+typedef struct
+{
+    sample_reader_t *reader;
+    int data_format;
+    int16_t (*lut)[8];
+
+    // Converter <-> stream callback
+    buffer_queue_t free_q;
+    buffer_queue_t ready_q;
+    int done; // The converter has queued the last buffer
+    int drain; // Buffers of zeros sent after the last one
+
+    player_stats_t *stats;
+
+    pthread_t converter;
+} pipeline_t;
+#endif
+
+#ifdef _WIN32
+BOOL WINAPI sighandler(int signum)
+{
+    if (CTRL_C_EVENT == signum) {
+        do_exit = 1;
+        return TRUE;
+    }
+    return FALSE;
+}
+#else
+void sighandler(int signum)
+{
+    (void)signum;
+    do_exit = 1;
+}
+#endif
+
 void usage(void)
 {
     fprintf(stderr, "Usage: bladeplayer [options]\n"
         "  -f <tx_file>  I/Q sampling data file (required)\n"
-        "  -b <iq_bits>  I/Q data format [1/16] (default: 16)\n"
-        "  -g <tx_vga1>  TX VGA1 gain (default: %d)\n",
+#ifndef _WIN32
+        "  -S <name>     Read the samples from the shared memory ring of gps-sdr-sim -S instead\n"
+#endif
+        "  -b <iq_bits>  I/Q data format [1/8/16] (default: 16)\n"
+        "  -g <tx_vga1>  TX VGA1 gain (default: %d)\n"
+#ifndef _WIN32
+        "  -A            Use the asynchronous stream with separate read and convert threads\n"
+#endif
+        ,
         TX_VGA1);
 
     return;
 }
+
+#ifndef _WIN32
+void queue_push(buffer_queue_t *q, void *p)
+{
+    uint64_t head = q->head;
+
+    q->item[head % NUM_BUFFERS] = p;
+    __atomic_store_n(&q->head, head + 1, __ATOMIC_RELEASE);
+
+    return;
+}
+
+void *queue_pop(buffer_queue_t *q)
+{
+    uint64_t tail = q->tail;
+    void *p;
+
+    if (tail==__atomic_load_n(&q->head, __ATOMIC_ACQUIRE))
+        return(NULL);
+
+    p = q->item[tail % NUM_BUFFERS];
+    __atomic_store_n(&q->tail, tail + 1, __ATOMIC_RELEASE);
+
+    return(p);
+}
+
+size_t queue_length(buffer_queue_t *q)
+{
+    return((size_t)(__atomic_load_n(&q->head, __ATOMIC_ACQUIRE) - __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE)));
+}
+
+void *converter_thread(void *arg)
+{
+    pipeline_t *p = (pipeline_t *)arg;
+    int16_t *buffer = NULL;
+    const uint8_t *chunk;
+    size_t length, nsamples;
+
+    while (!do_exit)
+    {
+        // Wait for libbladeRF to return a buffer
+        if (buffer==NULL)
+            buffer = (int16_t *)queue_pop(&p->free_q);
+
+        if (buffer==NULL)
+        {
+            usleep(STAGE_SLEEP_US);
+            continue;
+        }
+
+        chunk = next_chunk(p->reader, &length);
+        if (chunk==NULL)
+            break;
+
+        // Convert straight into the stream buffer, padding the last one with zeros
+        nsamples = convert_samples(buffer, chunk, length, p->data_format, (const int16_t (*)[8])p->lut);
+        release_chunk(p->reader);
+
+        if (nsamples<SAMPLES_PER_BUFFER)
+            memset(buffer + 2 * nsamples, 0, (SAMPLES_PER_BUFFER - nsamples) * 2 * sizeof(int16_t));
+
+        queue_push(&p->ready_q, buffer);
+        buffer = NULL;
+    }
+
+    __atomic_store_n(&p->done, 1, __ATOMIC_RELEASE);
+
+    return(NULL);
+}
+
+// Called by libbladeRF with each transmitted buffer, returns the next one
+void *stream_callback(struct bladerf *dev, struct bladerf_stream *stream,
+    struct bladerf_metadata *meta, void *samples, size_t num_samples, void *user_data)
+{
+    pipeline_t *p = (pipeline_t *)user_data;
+    void *next;
+    int done;
+
+    (void)dev;
+    (void)stream;
+    (void)meta;
+    (void)num_samples;
+
+    if (do_exit)
+        return(BLADERF_STREAM_SHUTDOWN);
+
+    done = __atomic_load_n(&p->done, __ATOMIC_ACQUIRE);
+
+    next = queue_pop(&p->ready_q);
+    if (next!=NULL)
+    {
+        // The transmitted buffer goes back to the converter
+        if (samples!=NULL)
+            queue_push(&p->free_q, samples);
+
+        p->stats->samples += SAMPLES_PER_BUFFER;
+        p->stats->buffers++;
+
+        return(next);
+    }
+
+    if (samples==NULL)
+        return(BLADERF_STREAM_SHUTDOWN);
+
+    if (done)
+    {
+        // Let the buffers in flight go out before shutting down
+        if (p->drain>=NUM_TRANSFERS)
+            return(BLADERF_STREAM_SHUTDOWN);
+
+        p->drain++;
+    }
+    else
+    {
+        p->stats->underruns++;
+        p->stats->underrun_samples += SAMPLES_PER_BUFFER;
+    }
+
+    // Nothing is ready, so send the transmitted buffer again as zeros
+    memset(samples, 0, SAMPLES_PER_BUFFER * 2 * sizeof(int16_t));
+
+    return(samples);
+}
+
+// Stream the input through the async pipeline until it ends or fails
+int stream_async(struct bladerf *dev, sample_reader_t *reader, int data_format, int16_t lut[256][8], player_stats_t *stats)
+{
+    pipeline_t p;
+    struct bladerf_stream *stream = NULL;
+    void **buffers = NULL;
+    int status;
+    int i;
+
+    memset(&p, 0, sizeof(p));
+    p.reader = reader;
+    p.data_format = data_format;
+    p.lut = lut;
+    p.stats = stats;
+
+    status = bladerf_init_stream(&stream,
+            dev,
+            stream_callback,
+            &buffers,
+            NUM_BUFFERS,
+            BLADERF_FORMAT_SC16_Q11,
+            SAMPLES_PER_BUFFER,
+            NUM_TRANSFERS,
+            &p);
+
+    if (status != 0) {
+        fprintf(stderr, "Failed to initialize TX stream: %s\n", bladerf_strerror(status));
+        return(status);
+    }
+
+    // All stream buffers start out free for the converter
+    for (i=0; i<NUM_BUFFERS; i++)
+        queue_push(&p.free_q, buffers[i]);
+
+    if (pthread_create(&p.converter, NULL, converter_thread, &p)!=0)
+    {
+        fprintf(stderr, "Failed to start the converter thread.\n");
+        exit(1);
+    }
+
+    // Have the first transfers ready before the stream starts
+    while (queue_length(&p.ready_q)<NUM_TRANSFERS && !__atomic_load_n(&p.done, __ATOMIC_ACQUIRE) && !do_exit)
+        usleep(STAGE_SLEEP_US);
+
+    status = bladerf_enable_module(dev, BLADERF_MODULE_TX, true);
+    if (status != 0) {
+        fprintf(stderr, "Failed to enable TX module: %s\n", bladerf_strerror(status));
+    }
+    else {
+        // Runs the callback until it shuts the stream down
+        status = bladerf_stream(stream, BLADERF_MODULE_TX);
+        if (status != 0) {
+            fprintf(stderr, "TX stream failed: %s\n", bladerf_strerror(status));
+        }
+    }
+
+    do_exit = 1;
+    pthread_join(p.converter, NULL);
+
+    bladerf_deinit_stream(stream);
+
+    return(status);
+}
+#endif
+
+// Synchronous interface of libbladeRF as a backend of the player core
+int sync_transmit(void *dev, const int16_t *samples, size_t nsamples)
+{
+    int status;
+
+    status = bladerf_sync_tx((struct bladerf *)dev, samples, (unsigned int)nsamples, NULL, TIMEOUT_MS);
+    if (status != 0) {
+        fprintf(stderr, "Failed to transmit samples: %s\n", bladerf_strerror(status));
+    }
+
+    return(status);
+}
+
 int main(int argc, char *argv[])
 {
     int status;
     char *devstr = NULL;
     struct bladerf *dev = NULL;
 
-    FILE *fp;
-    int16_t *tx_buffer;
-    enum state {INIT, READ_FILE, PAD_TRAILING, DONE};
-    enum state state = INIT;
+    player_input_t in;
+    sample_reader_t reader;
+    player_backend_t be;
+    player_stats_t stats;
+    char shmname[128];
 
-    int compressed = 0;
-    uint8_t *read_buffer;
-    size_t samples_read;
     int16_t lut[256][8];
-    int16_t amp = AMPLITUDE;
-    uint32_t i,k;
 
     int gain = TX_VGA1;
     int result;
-    int data_format;
+    int data_format = 16;
+    int async = 0;
+    unsigned int samp_rate = TX_SAMPLERATE;
+    unsigned int actual_rate;
     char txfile[128];
 
-    // Empty TX file name
+    // Empty TX file and ring names
     txfile[0] = 0;
+    shmname[0] = 0;
+
+    memset(&reader, 0, sizeof(reader));
+    start_stats(&stats);
 
     if (argc<3) {
         usage();
         exit(1);
     }
 
-    while ((result=getopt(argc,argv,"g:b:f:"))!=-1)
+    while ((result=getopt(argc,argv,"g:b:f:S:A"))!=-1)
     {
         switch (result)
         {
@@ -80,17 +356,27 @@ int main(int argc, char *argv[])
             break;
         case 'b':
             data_format = atoi(optarg);
-            if (data_format!=1 && data_format!=16)
+            if (data_format!=1 && data_format!=8 && data_format!=16)
             {
                 printf("ERROR: Invalid I/Q data format.\n");
                 exit(1);
             }
-            else if (data_format==1)
-                compressed = 1;
             break;
         case 'f':
             strcpy(txfile, optarg);
             break;
+        case 'S':
+            strncpy(shmname, optarg, sizeof(shmname)-1);
+            shmname[sizeof(shmname)-1] = 0;
+            break;
+        case 'A':
+#ifdef _WIN32
+            printf("ERROR: Asynchronous streaming is not supported on Windows.\n");
+            exit(1);
+#else
+            async = 1;
+#endif
+            break;
         case ':':
         case '?':
             usage();
@@ -100,20 +386,34 @@ int main(int argc, char *argv[])
         }
     }
 
-    // Open TX file.
-    if (txfile[0]==0)
+    if (shmname[0]==0 && txfile[0]==0)
     {
         printf("ERROR: I/Q sampling data file is not specified.\n");
         exit(1);
     }
 
-    fp = fopen(txfile, "rb");
-
-    if (fp==NULL) {
-        fprintf(stderr, "ERROR: Failed to open TX file: %s\n", argv[1]);
+    if (open_input(&in, shmname[0]!=0 ? NULL : txfile, shmname[0]!=0 ? shmname : NULL, 0)!=0)
         exit(1);
+
+    if (in.use_ring)
+    {
+        // The ring tells the I/Q data format and the sampling rate
+        data_format = in.bits;
+        samp_rate = (unsigned int)(in.samp_freq + 0.5);
+        if (data_format!=1 && data_format!=8 && data_format!=16)
+        {
+            fprintf(stderr, "ERROR: Invalid I/Q data format in the ring: %d\n", data_format);
+            close_input(&in);
+            exit(1);
+        }
     }
 
+#ifdef _WIN32
+    SetConsoleCtrlHandler((PHANDLER_ROUTINE)sighandler, TRUE);
+#else
+    signal(SIGINT, sighandler);
+#endif
+
     // Initializing device.
     printf("Opening and initializing device...\n");
 
@@ -132,13 +432,19 @@ int main(int argc, char *argv[])
         printf("TX frequency: %u Hz\n", TX_FREQUENCY);
     }
 
-    status = bladerf_set_sample_rate(dev, BLADERF_MODULE_TX, TX_SAMPLERATE, NULL);
+    status = bladerf_set_sample_rate(dev, BLADERF_MODULE_TX, samp_rate, &actual_rate);
     if (status != 0) {
         fprintf(stderr, "Failed to set TX sample rate: %s\n", bladerf_strerror(status));
         goto out;
     }
+    else if (actual_rate != samp_rate) {
+        // The samples would be sent at the wrong pace
+        fprintf(stderr, "Failed to set TX sample rate: %u sps, the device gives %u sps\n", samp_rate, actual_rate);
+        status = -1;
+        goto out;
+    }
     else {
-        printf("TX sample rate: %u sps\n", TX_SAMPLERATE);
+        printf("TX sample rate: %u sps\n", samp_rate);
     }
 
     status = bladerf_set_bandwidth(dev, BLADERF_MODULE_TX, TX_BANDWIDTH, NULL);
@@ -171,27 +477,20 @@ int main(int argc, char *argv[])
     // Application code goes here.
     printf("Running...\n");
 
-    // Allocate a buffer to hold each block of samples to transmit.
-    tx_buffer = (int16_t*)malloc(SAMPLES_PER_BUFFER * 2 * sizeof(int16_t));
+    // Each byte of 1-bit input expands to 4 I/Q samples
+    init_expand_lut(lut, AMPLITUDE);
 
-    if (tx_buffer == NULL) {
-        fprintf(stderr, "Failed to allocate TX buffer.\n");
+    // Read the input ahead, one stream buffer per chunk
+    if (start_reader(&reader, &in, input_bytes(SAMPLES_PER_BUFFER, data_format), NUM_RAW_CHUNKS, &do_exit, &stats)!=0)
         goto out;
-    }
-
-    // if compressed
-    read_buffer = (uint8_t*)malloc(SAMPLES_PER_BUFFER / 4);
 
-    if (read_buffer == NULL) {
-        fprintf(stderr, "Failed to allocate read buffer.\n");
-        goto out;
-    }
-
-    for (i=0; i<256; i++)
+#ifndef _WIN32
+    if (async)
     {
-        for (k=0; k<8; k++)
-            lut[i][k] = ((i>>(7-k))&0x1)?amp:-amp;
+        stream_async(dev, &reader, data_format, lut, &stats);
+        goto disable;
     }
+#endif
 
     // Configure the TX module for use with the synchronous interface.
     status = bladerf_sync_config(dev,
@@ -215,101 +514,34 @@ int main(int argc, char *argv[])
     }
 
     // Keep writing samples while there is more data to send and no failures have occurred.
-    while (state != DONE && status == 0) {
-
-        int16_t *tx_buffer_current = tx_buffer;
-        unsigned int buffer_samples_remaining = SAMPLES_PER_BUFFER;
-
-        // if compressed
-        unsigned int read_samples_remaining = SAMPLES_PER_BUFFER / 4;
-
-        // Keep adding to the buffer until it is full or a failure occurs
-        while (buffer_samples_remaining > 0 && status == 0 && state != DONE) {
-            size_t samples_populated = 0;
-
-            switch(state) {
-                case INIT:
-                case READ_FILE:
-                    // Read from the input file
-                    if (compressed)
-                    {
-                        int16_t *write_buffer_current = tx_buffer;
-
-                        samples_read = fread(read_buffer,
-                                sizeof(uint8_t),
-                                read_samples_remaining,
-                                fp);
-
-                        samples_populated = samples_read * 4;
-                        buffer_samples_remaining = read_samples_remaining * 4;
-
-                        // Expand compressed data into TX buffer
-                        for (i=0; i<samples_read; i++)
-                        {
-                            memcpy(write_buffer_current, lut[read_buffer[i]], 8);
-                        
-                            // Advance the write buffer pointer
-                            write_buffer_current += 8;
-                        }
-                    }
-                    else
-                    {
-                        samples_populated = fread(tx_buffer_current,
-                                2 * sizeof(int16_t),
-                                buffer_samples_remaining,
-                                fp);
-                    }
-
-                    // If the end of the file was reached, pad the rest of the buffer and finish.
-                    if (feof(fp)) {
-                        state = PAD_TRAILING;
-                    }
-                    // Check for errors
-                    else if (ferror(fp)) {
-                        status = errno;
-                    }
-
-                    break;
-
-                case PAD_TRAILING:
-                    // Populate the remainder of the buffer with zeros.
-                    memset(tx_buffer_current, 0, buffer_samples_remaining * 2 * sizeof(uint16_t));
-
-                    state = DONE;
-                    break;
-
-                case DONE:
-                default:
-                    break;
-            }
-
-            // Advance the buffer pointer.
-            buffer_samples_remaining -= (unsigned int)samples_populated;
-            tx_buffer_current += (2 * samples_populated);
-        }
-
-        // If there were no errors, transmit the data buffer.
-        if (status == 0) {
-            bladerf_sync_tx(dev, tx_buffer, SAMPLES_PER_BUFFER, NULL, TIMEOUT_MS);
-        }
-    }
-
+    // 16-bit input is sent straight from the read-ahead chunks, and the last
+    // buffer is padded with zeros.
+    memset(&be, 0, sizeof(be));
+    be.name = "bladeRF";
+    be.dev = dev;
+    be.buffer_samples = SAMPLES_PER_BUFFER;
+    be.pad = 1;
+    be.transmit = sync_transmit;
+    stream_samples(&be, &reader, data_format, (const int16_t (*)[8])lut, &stats, &do_exit);
+
+#ifndef _WIN32
+disable:
+#endif
     // Disable TX module, shutting down our underlying TX stream.
     status = bladerf_enable_module(dev, BLADERF_MODULE_TX, false);
     if (status != 0) {
         fprintf(stderr, "Failed to disable TX module: %s\n", bladerf_strerror(status));
     }
 
+out:
     // Free up our resources
-    free(tx_buffer);
+    do_exit = 1;
+    stop_reader(&reader);
+    print_stats(&stats, samp_rate, stdout);
 
-    // if compressed
-    free(read_buffer);
+    // Close TX file or ring
+    close_input(&in);
 
-    // Close TX file
-    fclose(fp);
-
-out:
     printf("Closing device...\n");
     bladerf_close(dev);
 
@@ -0,0 +1,319 @@
+#define _DEFAULT_SOURCE // usleep() with -std=c11
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "bladerf_mock.h"
+
+#define MOCK_MAX_BUFFERS 256
+
+struct bladerf
+{
+    FILE *fp; // Record of the transmitted samples
+    int fast; // No pacing
+    unsigned int sample_rate;
+    double t_next; // Time the next buffer is due [sec]
+    unsigned long nbuffers;
+    unsigned long nsamples;
+    int tx_enabled;
+};
+
+struct bladerf_stream
+{
+    struct bladerf *dev;
+    bladerf_stream_cb callback;
+    void *user_data;
+    void **buffers;
+    size_t num_buffers;
+    size_t samples_per_buffer;
+    size_t num_transfers;
+    int *in_flight; // Submitted and not yet returned to the callback
+};
+
+double mock_time(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return((double)ts.tv_sec + (double)ts.tv_nsec * 1e-9);
+}
+
+// Record a transmitted buffer and wait until the device would have sent it
+void mock_transmit(struct bladerf *dev, const void *samples, size_t num_samples)
+{
+    double t;
+
+    fwrite(samples, 2 * sizeof(int16_t), num_samples, dev->fp);
+    dev->nbuffers++;
+    dev->nsamples += num_samples;
+
+    if (dev->fast || dev->sample_rate == 0)
+        return;
+
+    t = mock_time();
+    if (dev->t_next < t)
+        dev->t_next = t;
+    dev->t_next += (double)num_samples / dev->sample_rate;
+
+    t = dev->t_next - t;
+    if (t > 0.0)
+        usleep((useconds_t)(t * 1e6));
+
+    return;
+}
+
+int bladerf_open(struct bladerf **device, const char *device_identifier)
+{
+    struct bladerf *dev;
+    const char *path = getenv("BLADERF_MOCK_OUTPUT");
+
+    (void)device_identifier;
+
+    dev = (struct bladerf *)calloc(1, sizeof(struct bladerf));
+    if (dev == NULL)
+        return(BLADERF_ERR_MEM);
+
+    dev->fp = fopen(path != NULL ? path : "bladerf_mock.bin", "wb");
+    if (dev->fp == NULL) {
+        free(dev);
+        return(BLADERF_ERR_IO);
+    }
+
+    dev->fast = (getenv("BLADERF_MOCK_FAST") != NULL);
+    *device = dev;
+
+    return(0);
+}
+
+void bladerf_close(struct bladerf *dev)
+{
+    if (dev == NULL)
+        return;
+
+    fprintf(stderr, "Mock device: %lu buffers, %lu samples transmitted\n", dev->nbuffers, dev->nsamples);
+    fclose(dev->fp);
+    free(dev);
+
+    return;
+}
+
+const char *bladerf_strerror(int error)
+{
+    switch (error)
+    {
+    case BLADERF_ERR_RANGE: return("Value out of range");
+    case BLADERF_ERR_INVAL: return("Invalid operation or parameter");
+    case BLADERF_ERR_MEM: return("A memory allocation error occurred");
+    case BLADERF_ERR_IO: return("File or device I/O failure");
+    default: return("An unexpected error occurred");
+    }
+}
+
+int bladerf_set_frequency(struct bladerf *dev, bladerf_module module, uint64_t frequency)
+{
+    (void)dev; (void)module; (void)frequency;
+    return(0);
+}
+
+int bladerf_set_sample_rate(struct bladerf *dev, bladerf_module module, unsigned int rate, unsigned int *actual)
+{
+    (void)module;
+    dev->sample_rate = rate;
+    if (actual != NULL)
+        *actual = rate;
+    return(0);
+}
+
+int bladerf_set_bandwidth(struct bladerf *dev, bladerf_module module, unsigned int bandwidth, unsigned int *actual)
+{
+    (void)dev; (void)module;
+    if (actual != NULL)
+        *actual = bandwidth;
+    return(0);
+}
+
+int bladerf_set_txvga1(struct bladerf *dev, int gain)
+{
+    (void)dev;
+    return((gain < -35 || gain > -4) ? BLADERF_ERR_RANGE : 0);
+}
+
+int bladerf_set_txvga2(struct bladerf *dev, int gain)
+{
+    (void)dev;
+    return((gain < 0 || gain > 25) ? BLADERF_ERR_RANGE : 0);
+}
+
+int bladerf_enable_module(struct bladerf *dev, bladerf_module m, bool enable)
+{
+    if (m == BLADERF_MODULE_TX)
+        dev->tx_enabled = enable;
+    return(0);
+}
+
+int bladerf_sync_config(struct bladerf *dev, bladerf_module module, bladerf_format format,
+    unsigned int num_buffers, unsigned int buffer_size, unsigned int num_transfers, unsigned int stream_timeout)
+{
+    (void)dev; (void)module; (void)format; (void)stream_timeout;
+    if (num_transfers >= num_buffers || buffer_size % 1024 != 0)
+        return(BLADERF_ERR_INVAL);
+    return(0);
+}
+
+int bladerf_sync_tx(struct bladerf *dev, const void *samples, unsigned int num_samples,
+    struct bladerf_metadata *metadata, unsigned int timeout_ms)
+{
+    (void)metadata; (void)timeout_ms;
+    if (!dev->tx_enabled)
+        return(BLADERF_ERR_INVAL);
+    mock_transmit(dev, samples, num_samples);
+    return(0);
+}
+
+int bladerf_init_stream(struct bladerf_stream **stream, struct bladerf *dev, bladerf_stream_cb callback,
+    void ***buffers, size_t num_buffers, bladerf_format format, size_t samples_per_buffer,
+    size_t num_transfers, void *user_data)
+{
+    struct bladerf_stream *s;
+    size_t i;
+
+    (void)format;
+
+    if (num_buffers > MOCK_MAX_BUFFERS || num_transfers >= num_buffers || samples_per_buffer % 1024 != 0)
+        return(BLADERF_ERR_INVAL);
+
+    s = (struct bladerf_stream *)calloc(1, sizeof(struct bladerf_stream));
+    if (s == NULL)
+        return(BLADERF_ERR_MEM);
+
+    s->dev = dev;
+    s->callback = callback;
+    s->user_data = user_data;
+    s->num_buffers = num_buffers;
+    s->samples_per_buffer = samples_per_buffer;
+    s->num_transfers = num_transfers;
+    s->buffers = (void **)calloc(num_buffers, sizeof(void *));
+    s->in_flight = (int *)calloc(num_buffers, sizeof(int));
+    if (s->buffers == NULL || s->in_flight == NULL) {
+        bladerf_deinit_stream(s);
+        return(BLADERF_ERR_MEM);
+    }
+
+    for (i = 0; i < num_buffers; i++) {
+        s->buffers[i] = calloc(samples_per_buffer, 2 * sizeof(int16_t));
+        if (s->buffers[i] == NULL) {
+            bladerf_deinit_stream(s);
+            return(BLADERF_ERR_MEM);
+        }
+    }
+
+    *buffers = s->buffers;
+    *stream = s;
+
+    return(0);
+}
+
+// Index of a buffer of the stream, -1 when the callback returned a foreign one
+int mock_buffer_index(struct bladerf_stream *s, void *buffer)
+{
+    size_t i;
+
+    for (i = 0; i < s->num_buffers; i++) {
+        if (s->buffers[i] == buffer)
+            return((int)i);
+    }
+
+    return(-1);
+}
+
+// Queue a buffer returned by the stream callback for transmission
+int mock_submit(struct bladerf_stream *s, void *buffer, int *queue, size_t head, size_t *count)
+{
+    int i;
+
+    // Each buffer must belong to the stream and be submitted only once at a time
+    i = mock_buffer_index(s, buffer);
+    if (i < 0 || s->in_flight[i]) {
+        fprintf(stderr, "Mock device: invalid buffer %p returned by the stream callback\n", buffer);
+        return(BLADERF_ERR_INVAL);
+    }
+
+    s->in_flight[i] = 1;
+    queue[(head + *count) % MOCK_MAX_BUFFERS] = i;
+    (*count)++;
+
+    return(0);
+}
+
+int bladerf_stream(struct bladerf_stream *s, bladerf_module module)
+{
+    int queue[MOCK_MAX_BUFFERS];
+    size_t head = 0, count = 0;
+    int status = 0;
+    void *next;
+    int i;
+
+    if (module != BLADERF_MODULE_TX || !s->dev->tx_enabled)
+        return(BLADERF_ERR_INVAL);
+
+    // The callback provides the first transfers...
+    while (status == 0 && count < s->num_transfers) {
+        next = s->callback(s->dev, s, NULL, NULL, s->samples_per_buffer, s->user_data);
+        if (next == BLADERF_STREAM_SHUTDOWN || next == BLADERF_STREAM_NO_DATA)
+            break;
+
+        status = mock_submit(s, next, queue, head, &count);
+    }
+
+    // ...then the next one as each transfer completes, in order
+    while (status == 0 && count > 0) {
+        i = queue[head];
+        head = (head + 1) % MOCK_MAX_BUFFERS;
+        count--;
+
+        mock_transmit(s->dev, s->buffers[i], s->samples_per_buffer);
+        s->in_flight[i] = 0;
+
+        next = s->callback(s->dev, s, NULL, s->buffers[i], s->samples_per_buffer, s->user_data);
+        if (next == BLADERF_STREAM_SHUTDOWN)
+            break;
+        if (next == BLADERF_STREAM_NO_DATA)
+            continue;
+
+        status = mock_submit(s, next, queue, head, &count);
+    }
+
+    // Transfers still in flight at the shutdown are sent
+    while (count > 0) {
+        i = queue[head];
+        head = (head + 1) % MOCK_MAX_BUFFERS;
+        count--;
+
+        mock_transmit(s->dev, s->buffers[i], s->samples_per_buffer);
+        s->in_flight[i] = 0;
+    }
+
+    return(status);
+}
+
+void bladerf_deinit_stream(struct bladerf_stream *s)
+{
+    size_t i;
+
+    if (s == NULL)
+        return;
+
+    if (s->buffers != NULL) {
+        for (i = 0; i < s->num_buffers; i++)
+            free(s->buffers[i]);
+    }
+
+    free(s->buffers);
+    free(s->in_flight);
+    free(s);
+
+    return;
+}
@@ -0,0 +1,71 @@
+#ifndef BLADERF_MOCK_H
+#define BLADERF_MOCK_H
+
+// Stand-in for the parts of libbladeRF used by bladeplayer, for testing
+// without a device. Build with "make bladeplayer-mock".
+//
+// The samples of every transmitted buffer are appended to the file named by
+// BLADERF_MOCK_OUTPUT (default: bladerf_mock.bin). Transmission is paced at
+// the configured sample rate, unless BLADERF_MOCK_FAST is set.
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#define BLADERF_ERR_UNEXPECTED  (-1)
+#define BLADERF_ERR_RANGE       (-2)
+#define BLADERF_ERR_INVAL       (-3)
+#define BLADERF_ERR_MEM         (-4)
+#define BLADERF_ERR_IO          (-5)
+
+#define BLADERF_STREAM_SHUTDOWN (NULL)
+#define BLADERF_STREAM_NO_DATA  ((void*)(-1))
+
+typedef enum
+{
+    BLADERF_MODULE_RX,
+    BLADERF_MODULE_TX
+} bladerf_module;
+
+typedef enum
+{
+    BLADERF_FORMAT_SC16_Q11
+} bladerf_format;
+
+struct bladerf;
+struct bladerf_stream;
+
+struct bladerf_metadata
+{
+    uint64_t timestamp;
+    uint32_t flags;
+    uint32_t status;
+    unsigned int actual_count;
+};
+
+typedef void *(*bladerf_stream_cb)(struct bladerf *dev, struct bladerf_stream *stream,
+    struct bladerf_metadata *meta, void *samples, size_t num_samples, void *user_data);
+
+int bladerf_open(struct bladerf **device, const char *device_identifier);
+void bladerf_close(struct bladerf *device);
+const char *bladerf_strerror(int error);
+
+int bladerf_set_frequency(struct bladerf *dev, bladerf_module module, uint64_t frequency);
+int bladerf_set_sample_rate(struct bladerf *dev, bladerf_module module, unsigned int rate, unsigned int *actual);
+int bladerf_set_bandwidth(struct bladerf *dev, bladerf_module module, unsigned int bandwidth, unsigned int *actual);
+int bladerf_set_txvga1(struct bladerf *dev, int gain);
+int bladerf_set_txvga2(struct bladerf *dev, int gain);
+int bladerf_enable_module(struct bladerf *dev, bladerf_module m, bool enable);
+
+int bladerf_sync_config(struct bladerf *dev, bladerf_module module, bladerf_format format,
+    unsigned int num_buffers, unsigned int buffer_size, unsigned int num_transfers, unsigned int stream_timeout);
+int bladerf_sync_tx(struct bladerf *dev, const void *samples, unsigned int num_samples,
+    struct bladerf_metadata *metadata, unsigned int timeout_ms);
+
+int bladerf_init_stream(struct bladerf_stream **stream, struct bladerf *dev, bladerf_stream_cb callback,
+    void ***buffers, size_t num_buffers, bladerf_format format, size_t samples_per_buffer,
+    size_t num_transfers, void *user_data);
+int bladerf_stream(struct bladerf_stream *stream, bladerf_module module);
+void bladerf_deinit_stream(struct bladerf_stream *stream);
+
+#endif
@@ -1,7 +1,9 @@
 #define _CRT_SECURE_NO_WARNINGS
+#define _DEFAULT_SOURCE // usleep() with -std=c11
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #ifdef _WIN32
 #include <windows.h>
 #ifdef _WIN64
@@ -18,27 +20,33 @@ typedef int bool;
 #include <sys/types.h>
 #include <getopt.h>
 #include <signal.h>
+#include <unistd.h>
 #endif
 #include <libhackrf/hackrf.h>
+#include "playercore.h"
 
 static hackrf_device* device = NULL;
 
-FILE* fd = NULL;
+player_input_t input;
+sample_reader_t reader;
+player_stats_t stats;
 volatile uint32_t byte_count = 0;
 
-volatile bool do_exit = false;
+volatile int do_exit = 0;
 
 //static transceiver_mode_t transceiver_mode = TRANSCEIVER_MODE_TX;
 
-#define FD_BUFFER_SIZE (8*1024)
 #define FREQ_ONE_MHZ (1000000ull)
 
+#define CHUNK_SIZE (256*1024) // Default USB transfer size of libhackrf
+#define NUM_CHUNKS (32) // 8 MB, 1.6 s at 2.6 MSps SC08
+
 #ifdef _WIN32
 BOOL WINAPI sighandler(int signum)
 {
     if(CTRL_C_EVENT == signum) {
         fprintf(stdout, "Caught signal %d\n", signum);
-        do_exit = true;
+        do_exit = 1;
         return TRUE;
     }
     return FALSE;
@@ -46,34 +54,48 @@ BOOL WINAPI sighandler(int signum)
 #else
 static void sighandler(int signum) {
     fprintf(stdout, "Caught signal %d\n", signum);
-    do_exit = true;
+    do_exit = 1;
 }
 #endif
 
 int tx_callback(hackrf_transfer* transfer) {
     size_t bytes_to_read;
+    size_t bytes_read;
+    int end;
 
-    if( fd != NULL )
-    {
-        ssize_t bytes_read;
-        byte_count += transfer->valid_length;
-        bytes_to_read = transfer->valid_length;
+    byte_count += transfer->valid_length;
+    bytes_to_read = transfer->valid_length;
 
-        bytes_read = fread(transfer->buffer, 1, bytes_to_read, fd);
+    // Only copy prefetched data here, the reader thread does the I/O
+    bytes_read = copy_chunks(&reader, transfer->buffer, bytes_to_read, &end);
 
-        if (bytes_read != bytes_to_read) {
-            return -1; // EOF
-        } else {
-            return 0;
+    if( bytes_read == 0 && end ) {
+        return -1; // All data sent
+    }
+
+    if( bytes_read < bytes_to_read ) {
+        // Pad with silence, counted as an underrun unless it is the tail of the data
+        memset(transfer->buffer + bytes_read, 0, bytes_to_read - bytes_read);
+        if( !end ) {
+            stats.underruns++;
+            stats.underrun_samples += (bytes_to_read - bytes_read) / 2;
         }
-    } else {
-        return -1;
     }
+
+    stats.samples += bytes_to_read / 2;
+    stats.buffers++;
+
+    return 0;
 }
 
 static void usage() {
     fprintf(stderr, "Usage: hackplayer [options]\n"
-        "  -t <filename>  Transmit data from file (required)\n");
+        "  -t <filename>  Transmit data from file (required)\n"
+        "  -R             Repeat the file until stopped\n"
+#ifndef _WIN32
+        "  -S <name>      Transmit data from the shared memory ring of gps-sdr-sim -S instead\n"
+#endif
+        );
 
     return;
 }
@@ -82,13 +104,15 @@ int main(int argc, char** argv) {
     int opt;
     int result;
     const char* path = NULL;
+    const char* shmname = NULL;
     uint32_t sample_rate_hz = 2600000;
     uint32_t baseband_filter_bw_hz = 0;
     unsigned int txvga_gain=0;
     uint64_t freq_hz = 1575420000;
     uint32_t amp_enable = 1;
+    bool repeat = false;
 
-    while( (opt = getopt(argc, argv, "t:")) != EOF )
+    while( (opt = getopt(argc, argv, "t:S:R")) != EOF )
     {
         result = HACKRF_SUCCESS;
         switch( opt ) 
@@ -96,6 +120,12 @@ int main(int argc, char** argv) {
         case 't':
             path = optarg;
             break;
+        case 'S':
+            shmname = optarg;
+            break;
+        case 'R':
+            repeat = true;
+            break;
         default:
             printf("unknown argument '-%c %s'\n", opt, optarg);
             usage();
@@ -109,7 +139,7 @@ int main(int argc, char** argv) {
         }
     }
 
-    if( path == NULL ) {
+    if( path == NULL && shmname == NULL ) {
         printf("specify a path to a file to transmit\n");
         usage();
         return EXIT_FAILURE;
@@ -132,18 +162,20 @@ int main(int argc, char** argv) {
         return EXIT_FAILURE;
     }
 
-    fd = fopen(path, "rb");
-    if( fd == NULL ) {
-        printf("Failed to open file: %s\n", path);
+    if( open_input(&input, path, shmname, repeat) != 0 ) {
         return EXIT_FAILURE;
     }
 
-    // Change fd buffer to have bigger one to store or read data on/to HDD
-    result = setvbuf(fd , NULL , _IOFBF , FD_BUFFER_SIZE);
-    if( result != 0 ) {
-        printf("setvbuf() failed: %d\n", result);
-        usage();
-        return EXIT_FAILURE;
+    if( input.use_ring ) {
+        if( input.bits != 8 ) {
+            printf("HackRF requires 8-bit I/Q samples, ring has %d-bit\n", input.bits);
+            close_input(&input);
+            return EXIT_FAILURE;
+        }
+
+        // Transmit at the rate the samples were generated for
+        sample_rate_hz = (uint32_t)input.samp_freq;
+        baseband_filter_bw_hz = hackrf_compute_baseband_filter_bw_round_down_lt(sample_rate_hz);
     }
 
 #ifdef _WIN32
@@ -152,6 +184,16 @@ int main(int argc, char** argv) {
     signal(SIGINT, sighandler);
 #endif
 
+    // Prefetch the input in a separate thread, so that disk or pipe latency
+    // does not stall the USB transfers
+    start_stats(&stats);
+    if( start_reader(&reader, &input, CHUNK_SIZE, NUM_CHUNKS, &do_exit, &stats) != 0 ) {
+        return EXIT_FAILURE;
+    }
+
+    // Fill the buffer before the transmission starts
+    fill_reader(&reader, NUM_CHUNKS);
+
     printf("call hackrf_sample_rate_set(%.03f MHz)\n", ((float)sample_rate_hz/(float)FREQ_ONE_MHZ));
     result = hackrf_set_sample_rate_manual(device, sample_rate_hz, 1);
     if( result != HACKRF_SUCCESS ) {
@@ -196,7 +238,11 @@ int main(int argc, char** argv) {
 
     printf("Stop with Ctrl-C\n");
     while( (hackrf_is_streaming(device) == HACKRF_TRUE) && (do_exit == false) ) {
-        // Show something?
+#ifdef _WIN32
+        Sleep(100);
+#else
+        usleep(100000);
+#endif
     }
 
     result = hackrf_is_streaming(device);
@@ -226,12 +272,17 @@ int main(int argc, char** argv) {
         printf("hackrf_exit() done\n");
     }
 
-    if(fd != NULL) {
-        fclose(fd);
-        fd = NULL;
-        printf("fclose(fd) done\n");
+    do_exit = 1;
+    stop_reader(&reader);
+
+    print_stats(&stats, (double)sample_rate_hz, stdout);
+    if( repeat ) {
+        printf("loops: %lu\n", input.loops);
     }
 
+    close_input(&input);
+    printf("close_input() done\n");
+
     printf("exit\n");
     return EXIT_SUCCESS;
 }
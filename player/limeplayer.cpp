@@ -6,6 +6,7 @@
 #include <csignal>
 #include <string>
 #include <algorithm>
+#include <chrono>
 #include <spdlog/spdlog.h>
 
 #ifdef _WIN32
@@ -16,19 +17,7 @@
 
 #include <lime/LimeSuite.h>
 
-#ifdef _WIN32
-#include <io.h>
-#include <fcntl.h>
-#define SET_BINARY_MODE(handle) _setmode(handle, O_BINARY)
-#else
-#define SET_BINARY_MODE(handle) ((void)0)
-#endif
-
-#define STDIN  0
-#define STDOUT 1
-#define STDERR 2
-
-#define FD_BUFFER_SIZE 8*1024
+#include "playercore.h"
 
 #define EXIT_CODE_CONTROL_C (SIGINT + 128)
 #define EXIT_CODE_INVALID_ARGUMENTS (-3)
@@ -40,6 +29,10 @@
 #define TX_BANDWIDTH  5000000.0
 #define MAX_DYNAMIC   2047
 
+#define TX_FIFO_SIZE  (1024 * 1024)
+#define TX_THROUGHPUT_VS_LATENCY 0.5
+#define READ_AHEAD_BUFFERS 64 // Input read ahead, 0.64 s
+
 #define ANTENNA_NONE  0
 #define ANTENNA_BAND1 1
 #define ANTENNA_BAND2 2
@@ -49,7 +42,7 @@
 #define STRINGIFY2(X) #X
 #define STRINGIFY(X) STRINGIFY2(X)
 
-static int control_c_received = 0;
+static volatile int control_c_received = 0;
 #ifdef _WIN32
 BOOL WINAPI control_c_handler(DWORD fdwCtrlType)
 {
@@ -80,8 +73,13 @@ static void print_usage(const char *program_name) {
             "\t" "-h, --help              print this help message" "\n"
             "\t" "-i, --index <index>     select specific LimeSDR device if multiple devices connected (default: 0)" "\n"
             "\t" "-l, --log-level <level> configure log level in { 0(trace), 1(debug), 2(info), 3(warn), 4(err), 5(critical), 6(off) } (default: 2)" "\n"
+            "\t" "-F, --fifo <samples>     configure the TX stream FIFO size in samples (default: " STRINGIFY(TX_FIFO_SIZE) ")" "\n"
+            "\t" "-T, --throughput <value> configure the TX stream in [0.0 (min latency) .. 1.0 (max throughput)] (default: " STRINGIFY(TX_THROUGHPUT_VS_LATENCY) ")" "\n"
             "\t" "-s, --samplerate <samplerate>" "\n"
             "\t" "                        configure sampling rate for TX channels (default: " STRINGIFY(TX_SAMPLERATE) ")" "\n"
+#ifndef _WIN32
+            "\t" "-S, --shm <name>        read IQ samples from the shared memory ring of gps-sdr-sim -S, taking its bits and sampling rate" "\n"
+#endif
         "Example:" "\n"
         "\t" "./limeplayer -s 1000000 -b 1 -d 1023 -g 0.1 < ../circle.1b.1M.bin" "\n",
             program_name);
@@ -89,24 +87,62 @@ static void print_usage(const char *program_name) {
 }
 
 lms_device_t *device = nullptr;
-FILE* input_stream = nullptr;
+player_input_t input{};
+sample_reader_t reader{};
+player_stats_t stats{};
 
 int error(int exit_code) {
     if (device != nullptr) {
         LMS_Close(device);
     }
-    if (input_stream != stdin) {
-        fclose(input_stream);
-    }
+    stop_reader(&reader);
+    close_input(&input);
     exit(exit_code);
 }
 
-// File contains interleaved signed 16-bit IQ values, either with only 12-bit data, or with 16-bit data
-typedef struct { int16_t i; int16_t q; } s16iq_sample_s;
-// File contains interleaved signed  8-bit IQ values
-typedef struct { int8_t i; int8_t q; } s8iq_sample_s;
-// File contains interleaved 1-bit IQ values, Each byte is IQIQIQIQ
-typedef int8_t iq_4_sample_s;
+// TX stream of the device behind the player core
+typedef struct {
+    lms_stream_t stream;
+    lms_stream_meta_t meta;
+    std::chrono::steady_clock::time_point report_time;
+    uint64_t report_timestamp;
+} lime_tx_s;
+
+// Once per second, the rate the device has achieved and how full its FIFO is
+void print_progress(lime_tx_s *tx) {
+    auto now = std::chrono::steady_clock::now();
+    double elapsed = std::chrono::duration<double>(now - tx->report_time).count();
+    if (elapsed < 1.0) return;
+    lms_stream_status_t status{};
+    if (LMS_GetStreamStatus(&tx->stream, &status)) {
+        spdlog::error("LMS_GetStreamStatus failed");
+        return;
+    }
+    double hostRate = (double)(tx->meta.timestamp - tx->report_timestamp) / elapsed;
+    spdlog::info("TX rate: {:.3f} MS/s (host {:.3f} MS/s), FIFO: {}/{} ({:.0f}%), link: {:.3f} MiB/s, underrun: {}, dropped: {}",
+                 status.sampleRate / 1e6, hostRate / 1e6,
+                 status.fifoFilledCount, status.fifoSize, status.fifoSize ? 100.0 * status.fifoFilledCount / status.fifoSize : 0.0,
+                 status.linkRate / (1LL << 20), status.underrun, status.droppedPackets);
+    tx->report_time = now;
+    tx->report_timestamp = tx->meta.timestamp;
+}
+
+// Send all samples, retrying partial sends
+int lime_transmit(void *dev, const int16_t *samples, size_t nsamples) {
+    auto *tx = (lime_tx_s *)dev;
+    size_t sentSampleCount = 0;
+    while (sentSampleCount < nsamples && 0 == control_c_received) {
+        int sent = LMS_SendStream(&tx->stream, samples + 2 * sentSampleCount, nsamples - sentSampleCount, nullptr, 1000);
+        if (sent < 0) {
+            spdlog::error("LMS_SendStream failed");
+            return sent;
+        }
+        sentSampleCount += (size_t)sent;
+    }
+    tx->meta.timestamp += sentSampleCount;
+    print_progress(tx);
+    return 0;
+}
 
 int main(int argc, char *const argv[]) {
 #ifdef _WIN32
@@ -157,6 +193,9 @@ int main(int argc, char *const argv[]) {
     double sampleRate = TX_SAMPLERATE;
     int32_t dynamic = 2047;
     std::string path;
+    std::string shmName;
+    int32_t fifoSize = TX_FIFO_SIZE;
+    double throughputVsLatency = TX_THROUGHPUT_VS_LATENCY;
 
     static struct option long_options[] = {
         {"antenna",    required_argument, nullptr, 'a'},
@@ -164,18 +203,21 @@ int main(int argc, char *const argv[]) {
         {"channel",    required_argument, nullptr, 'c'},
         {"dynamic",    required_argument, nullptr, 'd'},
         {"file",       required_argument, nullptr, 'f'},
+        {"fifo",       required_argument, nullptr, 'F'},
         {"gain",       required_argument, nullptr, 'g'},
         {"help",       no_argument,       nullptr, 'h'},
         {"index",      required_argument, nullptr, 'i'},
         {"log-level",  optional_argument, nullptr, 'l'},
         {"samplerate", required_argument, nullptr, 's'},
+        {"shm",        required_argument, nullptr, 'S'},
+        {"throughput", required_argument, nullptr, 'T'},
         {nullptr,      no_argument,       nullptr, '\0'}
     };
 
     int rawLevel;
     while (true) {
         int option_index = 0;
-        int c = getopt_long(argc, argv, "a:b:c:d:f:g:hl:i:s:", long_options, &option_index);
+        int c = getopt_long(argc, argv, "a:b:c:d:f:F:g:hl:i:s:S:T:", long_options, &option_index);
         if (c == -1) break;
 
         char *endptr = nullptr;
@@ -185,11 +227,14 @@ int main(int argc, char *const argv[]) {
             case 'c': channel    = (int32_t) strtol(optarg, &endptr, 10); break;
             case 'd': dynamic    = (int32_t) strtol(optarg, &endptr, 10); break;
             case 'f': path       = std::string(optarg);                   break;
+            case 'F': fifoSize   = (int32_t) strtol(optarg, &endptr, 10); break;
             case 'g': gain       = strtod(optarg, &endptr);               break;
             case 'h':              print_usage(argv[0]);                  break;
             case 'i': index      = (int32_t) strtol(optarg, &endptr, 10); break;
             case 'l': rawLevel   = (int32_t) strtol(optarg, &endptr, 10); break;
             case 's': sampleRate =           strtod(optarg, &endptr);     break;
+            case 'S': shmName    = std::string(optarg);                   break;
+            case 'T': throughputVsLatency = strtod(optarg, &endptr);      break;
         }
         if (endptr != nullptr && *endptr != '\0') {
             spdlog::critical("Failed to parse argument for option -{} => {}", c, optarg);
@@ -200,15 +245,18 @@ int main(int argc, char *const argv[]) {
     spdlog::level::level_enum logLevel = (spdlog::level::level_enum) std::min(std::max(0, rawLevel), (int)spdlog::level::off);
     spdlog::set_level(logLevel);
 
-    if (path.empty()) {
-        input_stream = stdin;
-        SET_BINARY_MODE(STDIN);
-    } else {
-        input_stream = fopen(path.c_str(), "rb");
-        if (input_stream == nullptr) {
-            spdlog::critical("Failed to open signal file: {}", path);
-            error(EXIT_CODE_INVALID_ARGUMENTS);
-        }
+    if (!shmName.empty()) {
+        spdlog::info("Waiting for shared memory ring {}", shmName);
+    }
+    if (open_input(&input, path.empty() ? nullptr : path.c_str(), shmName.empty() ? nullptr : shmName.c_str(), 0) != 0) {
+        spdlog::critical("Failed to open the signal input");
+        error(EXIT_CODE_INVALID_ARGUMENTS);
+    }
+    if (input.use_ring) {
+        bits = input.bits;
+        sampleRate = input.samp_freq;
+    } else if (input.map != nullptr) {
+        spdlog::info("Memory-mapped signal file: {} ({} bytes)", path, input.map_size);
     }
 
     int device_count = LMS_GetDeviceList(nullptr);
@@ -351,16 +399,17 @@ int main(int argc, char *const argv[]) {
     }
 
     spdlog::info("Setup TX stream ...");
-    lms_stream_t tx_stream{};
+    lime_tx_s tx{};
+    lms_stream_t &tx_stream = tx.stream;
     tx_stream.isTx = true;                         // TX channel
     tx_stream.channel = (uint32_t)channel;         // channel number
-    tx_stream.fifoSize = 1024 * 1024;              // fifo size in samples
-    tx_stream.throughputVsLatency = 0.5f;          // 0 min latency, 1 max throughput
+    tx_stream.fifoSize = (uint32_t)std::max(fifoSize, 4096);                       // fifo size in samples
+    tx_stream.throughputVsLatency = (float)std::min(std::max(0.0, throughputVsLatency), 1.0); // 0 min latency, 1 max throughput
     tx_stream.dataFmt = 16 == bits ?
                         lms_stream_t::LMS_FMT_I16 :
                         lms_stream_t::LMS_FMT_I12; // 12-bit/16-bit data format
 
-    lms_stream_meta_t tx_meta{};
+    lms_stream_meta_t &tx_meta = tx.meta;
     tx_meta.waitForTimestamp = true;               // wait for HW timestamp to send samples
     tx_meta.flushPartialPacket = false;            // send samples to HW after packet is completely filled
 
@@ -372,81 +421,43 @@ int main(int argc, char *const argv[]) {
         spdlog::critical("LMS_StartStream failed");
         error(EXIT_CODE_LMS_INIT);
     }
+    spdlog::info("TX stream FIFO: {} samples, throughput vs latency: {}", tx_stream.fifoSize, tx_stream.throughputVsLatency);
 
     int nSamples = (int)(sampleRate / 100);
     if (1 == bits) {
         // trim extra samples in 1-bit mode
         nSamples -= nSamples % 4;
     }
-    auto sampleBuffer   = (s16iq_sample_s*)malloc(sizeof(s16iq_sample_s) * nSamples);
-    auto fileBuffer8bit = (s8iq_sample_s*) malloc(sizeof(s8iq_sample_s) * nSamples);
-    auto fileBuffer1bit = (iq_4_sample_s*)malloc(sizeof(iq_4_sample_s) * nSamples / 4);
-
-    int64_t loop_step = 0;
-    auto print_progress = [&]() {
-        if (0 != (loop_step++ % 100)) return;
-        lms_stream_status_t status{};
-        if (LMS_GetStreamStatus(&tx_stream, &status)) {
-            spdlog::error("LMS_GetStreamStatus failed");
-        }
-        spdlog::info("TX rate: {:06f} MiB/s", status.linkRate / (1LL << 20));
-    };
 
     int16_t expand_lut[1 << 8][8] = {};
-    for (int i = 0; i < 256; i++) {
-        for (int j = 0; j < 8; j++) {
-            expand_lut[i][j] = (int16_t)(((i >> (7 - j)) & 0x1) ? dynamic : -dynamic);
-        }
-    }
+    init_expand_lut(expand_lut, (int16_t)dynamic);
 
     double transmitBandwidth = sampleRate * (bits == 16 ? 16 : 12) * 2 / 8 / (1LL << 20);
     spdlog::info("transmit bit mode: {}-bit, sample rate: {} Hz, expected bandwidth: {} MiB/s", bits, sampleRate, transmitBandwidth);
 
-    int sampleCount = 0;
-    while (0 == control_c_received) {
-        if (12 == bits || 16 == bits) {
-            sampleCount = (int) fread(sampleBuffer, sizeof(s16iq_sample_s), nSamples, input_stream);
-            if (0 == sampleCount) {
-                break;
-            }
-        } else if (8 == bits) {
-            sampleCount = (int) fread(fileBuffer8bit, sizeof(s8iq_sample_s), nSamples, input_stream);
-            if (0 == sampleCount) {
-                break;
-            }
-            // Up-Scale to 12-bit
-            for (int i = 0; i < sampleCount; ++i) {
-                sampleBuffer[i].i = fileBuffer8bit[i].i << 4;
-                sampleBuffer[i].q = fileBuffer8bit[i].q << 4;
-            }
-        } else if (1 == bits) {
-            sampleCount = (int) fread(fileBuffer1bit, sizeof(iq_4_sample_s), nSamples / 4, input_stream);
-            if (0 == sampleCount) {
-                break;
-            }
-            for (int i = 0, offset = 0; i < sampleCount; ++i, offset += 4) {
-                memcpy(sampleBuffer + offset, expand_lut + fileBuffer1bit[i], sizeof(expand_lut[0]));
-            }
-            sampleCount *= 4;
-        }
-        print_progress();
-        int sentSampleCount = LMS_SendStream(&tx_stream, sampleBuffer, sampleCount, nullptr, 1000);
-        if (sentSampleCount < 0) {
-            spdlog::error("LMS_SendStream failed");
-        }
-        tx_meta.timestamp += sentSampleCount;
+    // 16-bit and 12-bit samples are sent straight from the input, 8-bit and
+    // 1-bit samples are converted by the player core first
+    start_stats(&stats);
+    if (start_reader(&reader, &input, input_bytes(nSamples, bits), READ_AHEAD_BUFFERS, &control_c_received, &stats) != 0) {
+        error(EXIT_CODE_LMS_INIT);
     }
 
+    player_backend_t backend{};
+    backend.name = "LimeSDR";
+    backend.dev = &tx;
+    backend.buffer_samples = (size_t)nSamples;
+    backend.pad = 0;
+    backend.transmit = lime_transmit;
+
+    tx.report_time = std::chrono::steady_clock::now();
+    stream_samples(&backend, &reader, bits, expand_lut, &stats, &control_c_received);
+
     spdlog::info("Total transmit duration: {}s", tx_meta.timestamp / sampleRate);
+    print_stats(&stats, sampleRate, stdout);
 
     spdlog::info("Releasing resources...");
-    if (input_stream != stdin) {
-        fclose(input_stream);
-        input_stream = nullptr;
-    }
-    free(sampleBuffer);
-    free(fileBuffer8bit);
-    free(fileBuffer1bit);
+    stop_reader(&reader);
+    close_input(&input);
     LMS_StopStream(&tx_stream);
     LMS_DestroyStream(device, &tx_stream);
     LMS_EnableChannel(device, LMS_CH_TX, channel, false);
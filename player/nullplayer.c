@@ -0,0 +1,180 @@
+#define _CRT_SECURE_NO_WARNINGS
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#ifdef _WIN32
+#include "getopt.h"
+#else
+#include <getopt.h>
+#endif
+#include "playercore.h"
+
+// Player without a device: the samples go through the same reader and
+// converters as for an SDR and are then discarded or written to a file,
+// so that the throughput of the players can be measured anywhere.
+
+#define SAMPLES_PER_BUFFER  (32 * 1024)
+#define NUM_CHUNKS          (32)
+#define AMPLITUDE           (1000) // Default amplitude for 12-bit I/Q
+
+volatile int do_exit = 0;
+
+void sighandler(int signum)
+{
+    (void)signum;
+    do_exit = 1;
+}
+
+void usage(void)
+{
+    fprintf(stderr, "Usage: nullplayer [options]\n"
+        "  -f <tx_file>    I/Q sampling data file (default: stdin)\n"
+#ifndef _WIN32
+        "  -S <name>       Read the samples from the shared memory ring of gps-sdr-sim -S instead\n"
+        "  -r              Pace the samples at the sampling rate of the ring\n"
+#endif
+        "  -b <iq_bits>    I/Q data format [1/8/16] (default: 16)\n"
+        "  -o <out_file>   Write the SC16 samples to a file (\"-\" for stdout) instead of discarding them\n"
+        "  -s <frequency>  Pace the samples at this sampling rate [Hz] (default: as fast as possible)\n"
+        "  -n <samples>    Samples per buffer (default: %d)\n"
+        "  -d <amplitude>  Amplitude of 1-bit samples (default: %d)\n"
+        "  -R              Repeat the file until stopped\n",
+        SAMPLES_PER_BUFFER, AMPLITUDE);
+
+    return;
+}
+
+int main(int argc, char *argv[])
+{
+    const char *path = NULL;
+    const char *shmname = NULL;
+    const char *outfile = NULL;
+    int bits = 16;
+    double samp_freq = 0.0;
+    int ring_pace = 0;
+    size_t nsamples = SAMPLES_PER_BUFFER;
+    int amplitude = AMPLITUDE;
+    int repeat = 0;
+    int16_t lut[256][8];
+
+    player_input_t in;
+    sample_reader_t reader;
+    player_backend_t be;
+    player_stats_t stats;
+    FILE *report;
+    int status;
+    int result;
+
+    while ((result=getopt(argc,argv,"f:S:rb:o:s:n:d:Rh"))!=-1)
+    {
+        switch (result)
+        {
+        case 'f':
+            path = optarg;
+            break;
+        case 'S':
+            shmname = optarg;
+            break;
+        case 'r':
+            ring_pace = 1;
+            break;
+        case 'b':
+            bits = atoi(optarg);
+            if (bits!=1 && bits!=8 && bits!=16)
+            {
+                fprintf(stderr, "ERROR: Invalid I/Q data format.\n");
+                exit(1);
+            }
+            break;
+        case 'o':
+            outfile = optarg;
+            break;
+        case 's':
+            samp_freq = atof(optarg);
+            break;
+        case 'n':
+            nsamples = (size_t)atol(optarg);
+            break;
+        case 'd':
+            amplitude = atoi(optarg);
+            if (amplitude<0 || amplitude>32767)
+            {
+                fprintf(stderr, "ERROR: Invalid amplitude.\n");
+                exit(1);
+            }
+            break;
+        case 'R':
+            repeat = 1;
+            break;
+        default:
+            usage();
+            exit(1);
+        }
+    }
+
+    // 1-bit input holds 4 samples per byte
+    nsamples -= nsamples % 4;
+    if (nsamples==0)
+    {
+        fprintf(stderr, "ERROR: Invalid buffer size.\n");
+        exit(1);
+    }
+
+    if (open_input(&in, path, shmname, repeat)!=0)
+        exit(1);
+
+    // The ring tells the I/Q data format, and the pace if asked for
+    if (in.use_ring)
+    {
+        bits = in.bits;
+        if (ring_pace)
+            samp_freq = in.samp_freq;
+    }
+    else if (ring_pace)
+    {
+        fprintf(stderr, "ERROR: -r needs shared memory input.\n");
+        close_input(&in);
+        exit(1);
+    }
+
+    if (open_sink_backend(&be, outfile, samp_freq, nsamples)!=0)
+    {
+        close_input(&in);
+        exit(1);
+    }
+
+    signal(SIGINT, sighandler);
+
+    init_expand_lut(lut, (int16_t)amplitude);
+    start_stats(&stats);
+
+    if (start_reader(&reader, &in, input_bytes(nsamples, bits), NUM_CHUNKS, &do_exit, &stats)!=0)
+    {
+        be.close(be.dev);
+        close_input(&in);
+        exit(1);
+    }
+
+    fprintf(stderr, "Streaming %d-bit I/Q to the %s backend, %lu samples per buffer\n",
+        bits, be.name, (unsigned long)nsamples);
+
+    status = stream_samples(&be, &reader, bits, lut, &stats, &do_exit);
+    if (status!=0)
+        fprintf(stderr, "ERROR: Failed to write samples.\n");
+
+    stop_reader(&reader);
+    be.close(be.dev);
+
+    // The report goes to stderr when the samples go to stdout
+    report = (outfile!=NULL && strcmp(outfile, "-")==0) ? stderr : stdout;
+    // Compared to the real time of the ring even when not paced
+    print_stats(&stats, (samp_freq<=0.0 && in.use_ring) ? in.samp_freq : samp_freq, report);
+    if (repeat)
+        fprintf(report, "Loops: %lu\n", in.loops);
+
+    close_input(&in);
+
+    return(status==0 ? 0 : 1);
+}
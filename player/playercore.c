@@ -0,0 +1,729 @@
+#define _CRT_SECURE_NO_WARNINGS
+#ifndef _WIN32
+#define _DEFAULT_SOURCE // usleep() and madvise() with -std=c11
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+#ifdef _WIN32
+#include <windows.h>
+#include <io.h>
+#include <fcntl.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+#include "playercore.h"
+
+#define PAGE_TOUCH_STEP (4096)
+
+// Seconds on a monotonic clock
+double player_time(void)
+{
+#ifdef _WIN32
+    LARGE_INTEGER freq, count;
+
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&count);
+
+    return((double)count.QuadPart / (double)freq.QuadPart);
+#else
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return((double)ts.tv_sec + (double)ts.tv_nsec * 1e-9);
+#endif
+}
+
+static void sleep_us(unsigned int us)
+{
+#ifdef _WIN32
+    Sleep((us + 999) / 1000);
+#else
+    usleep(us);
+#endif
+}
+
+static int is_cancelled(const volatile int *cancel)
+{
+    return(cancel != NULL && *cancel);
+}
+
+#ifndef _WIN32
+// Map a regular file, so that its samples are used without copying them
+static int map_input(player_input_t *in, const char *path)
+{
+    struct stat st;
+    void *map;
+    int fd;
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return(0);
+
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size == 0) {
+        close(fd);
+        return(0);
+    }
+
+    map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return(0);
+
+    madvise(map, (size_t)st.st_size, MADV_SEQUENTIAL);
+    in->map = (const uint8_t *)map;
+    in->map_size = (size_t)st.st_size;
+    in->map_offset = 0;
+
+    return(1);
+}
+#endif
+
+// Open a file (stdin if path is NULL or "-") or attach to the shared memory
+// ring of gps-sdr-sim -S, which gives the I/Q data format and sampling rate
+// Returns 0 on success, -1 on error
+int open_input(player_input_t *in, const char *path, const char *shmname, int repeat)
+{
+    memset(in, 0, sizeof(player_input_t));
+    in->repeat = repeat;
+
+    if (shmname != NULL) {
+#ifdef _WIN32
+        fprintf(stderr, "ERROR: Shared memory input is not supported on Windows.\n");
+        return(-1);
+#else
+        if (repeat) {
+            fprintf(stderr, "ERROR: Cannot repeat shared memory input.\n");
+            return(-1);
+        }
+
+        // Wait for gps-sdr-sim to create the ring
+        if (openShmRing(&in->ring, shmname, -1) != 0) {
+            fprintf(stderr, "ERROR: Failed to open shared memory ring: %s\n", shmname);
+            return(-1);
+        }
+
+        in->use_ring = 1;
+        in->bits = in->ring.hdr->bits;
+        in->samp_freq = in->ring.hdr->samp_freq;
+
+        return(0);
+#endif
+    }
+
+    if (path == NULL || strcmp(path, "-") == 0) {
+#ifdef _WIN32
+        _setmode(_fileno(stdin), O_BINARY);
+#endif
+        in->fp = stdin;
+        return(0);
+    }
+
+#ifndef _WIN32
+    if (map_input(in, path))
+        return(0);
+#endif
+
+    in->fp = fopen(path, "rb");
+    if (in->fp == NULL) {
+        fprintf(stderr, "ERROR: Failed to open TX file: %s\n", path);
+        return(-1);
+    }
+
+    return(0);
+}
+
+void close_input(player_input_t *in)
+{
+#ifndef _WIN32
+    if (in->use_ring)
+        closeShmRing(&in->ring);
+    else if (in->map != NULL)
+        munmap((void *)in->map, in->map_size);
+    else
+#endif
+    if (in->fp != NULL && in->fp != stdin)
+        fclose(in->fp);
+
+    in->fp = NULL;
+    in->map = NULL;
+    in->use_ring = 0;
+
+    return;
+}
+
+// Read up to length bytes, less only at the end of the input. A repeated
+// file is started over at its end. The reader thread takes the ring and
+// memory-mapped files without this copy.
+size_t read_input(player_input_t *in, uint8_t *buffer, size_t length, const volatile int *cancel)
+{
+    size_t bytes_read = 0;
+    size_t n;
+
+#ifndef _WIN32
+    if (in->use_ring)
+        return(readShmRing(&in->ring, buffer, length));
+#endif
+
+    while (bytes_read < length && !is_cancelled(cancel)) {
+        if (in->map != NULL) {
+            n = in->map_size - in->map_offset;
+            if (n > length - bytes_read)
+                n = length - bytes_read;
+            memcpy(buffer + bytes_read, in->map + in->map_offset, n);
+            in->map_offset += n;
+        }
+        else
+            n = fread(buffer + bytes_read, 1, length - bytes_read, in->fp);
+
+        bytes_read += n;
+
+        if (n == 0) {
+            // Rewind the open file instead of reopening it
+            if (!in->repeat)
+                break;
+            if (in->map != NULL)
+                in->map_offset = 0;
+            else if (ferror(in->fp) || fseek(in->fp, 0L, SEEK_SET) != 0)
+                break;
+            in->loops++;
+        }
+    }
+
+    return(bytes_read);
+}
+
+#ifndef _WIN32
+static void *reader_thread(void *arg)
+{
+    sample_reader_t *r = (sample_reader_t *)arg;
+    player_input_t *in = r->in;
+    uint64_t head = 0;
+    uint64_t pos = 0;
+    const uint8_t *p;
+    volatile uint8_t touch;
+    size_t slot, n, i;
+
+    while (!r->stop && !is_cancelled(r->cancel)) {
+        // Wait for the consumer to free a chunk
+        if (head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) >= r->nchunks) {
+            usleep(READER_SLEEP_US);
+            continue;
+        }
+
+        slot = head % r->nchunks;
+
+        if (in->use_ring) {
+            // Hand out the span of the ring, released with the chunk
+            if (head == 0)
+                pos = __atomic_load_n(&in->ring.hdr->tail, __ATOMIC_ACQUIRE);
+            p = (const uint8_t *)peekShmRingAt(&in->ring, pos, r->chunk_size, &n);
+            pos += n;
+        }
+        else if (in->map != NULL && !in->repeat) {
+            // Fault the pages of the chunk in here rather than in the consumer
+            p = in->map + in->map_offset;
+            n = in->map_size - in->map_offset;
+            if (n > r->chunk_size)
+                n = r->chunk_size;
+            for (i = 0; i < n; i += PAGE_TOUCH_STEP)
+                touch = p[i];
+            in->map_offset += n;
+        }
+        else {
+            p = r->buffer + slot * r->chunk_size;
+            n = read_input(in, r->buffer + slot * r->chunk_size, r->chunk_size, r->cancel);
+        }
+
+        r->data[slot] = p;
+        r->length[slot] = n;
+
+        if (n > 0) {
+            head++;
+            __atomic_store_n(&r->head, head, __ATOMIC_RELEASE);
+        }
+
+        if (n < r->chunk_size)
+            break;
+    }
+
+    (void)touch;
+    __atomic_store_n(&r->eof, 1, __ATOMIC_RELEASE);
+
+    return(NULL);
+}
+#endif
+
+// Start reading the input ahead in nchunks chunks of chunk_size bytes
+// Returns 0 on success, -1 on error
+int start_reader(sample_reader_t *r, player_input_t *in, size_t chunk_size, size_t nchunks,
+    const volatile int *cancel, player_stats_t *stats)
+{
+    memset(r, 0, sizeof(sample_reader_t));
+    r->in = in;
+    r->chunk_size = chunk_size;
+    r->nchunks = nchunks;
+    r->cancel = cancel;
+    r->stats = stats;
+
+#ifdef _WIN32
+    // The chunk is read when it is needed
+    r->nchunks = 1;
+#endif
+
+#ifndef _WIN32
+    if (in->use_ring) {
+        // The chunks read ahead are held in the ring, so they must fit into it
+        if (chunk_size > in->ring.size) {
+            fprintf(stderr, "ERROR: Buffer larger than the shared memory ring.\n");
+            return(-1);
+        }
+        if (r->nchunks > in->ring.size / chunk_size)
+            r->nchunks = in->ring.size / chunk_size;
+    }
+#endif
+
+    // A mapped file or the ring is not copied, unless the file is repeated
+    r->copy = !in->use_ring && (in->map == NULL || in->repeat);
+    if (r->copy)
+        r->buffer = (uint8_t *)malloc(r->nchunks * chunk_size);
+    r->data = (const uint8_t **)calloc(r->nchunks, sizeof(const uint8_t *));
+    r->length = (size_t *)calloc(r->nchunks, sizeof(size_t));
+
+    if ((r->buffer == NULL && r->copy) || r->data == NULL || r->length == NULL) {
+        fprintf(stderr, "ERROR: Failed to allocate the read-ahead buffer.\n");
+        stop_reader(r);
+        return(-1);
+    }
+
+#ifndef _WIN32
+    if (pthread_create(&r->thread, NULL, reader_thread, r) != 0) {
+        fprintf(stderr, "ERROR: Failed to start the reader thread.\n");
+        stop_reader(r);
+        return(-1);
+    }
+    r->started = 1;
+#endif
+
+    return(0);
+}
+
+// Wait until nchunks chunks are read ahead, or the input has ended
+void fill_reader(sample_reader_t *r, size_t nchunks)
+{
+#ifndef _WIN32
+    if (nchunks > r->nchunks)
+        nchunks = r->nchunks;
+
+    while (__atomic_load_n(&r->head, __ATOMIC_ACQUIRE) - r->tail < nchunks
+        && !__atomic_load_n(&r->eof, __ATOMIC_ACQUIRE) && !is_cancelled(r->cancel))
+        usleep(READER_SLEEP_US);
+#else
+    (void)r;
+    (void)nchunks;
+#endif
+
+    return;
+}
+
+// Next chunk of input, waiting for the reader if necessary
+// Returns NULL at the end of the input or when cancelled
+const uint8_t *next_chunk(sample_reader_t *r, size_t *length)
+{
+    size_t slot;
+#ifndef _WIN32
+    int eof;
+    int waited = 0;
+
+    for (;;) {
+        // The end flag is read first, so that no chunk is missed
+        eof = __atomic_load_n(&r->eof, __ATOMIC_ACQUIRE);
+
+        if (r->tail != __atomic_load_n(&r->head, __ATOMIC_ACQUIRE))
+            break;
+
+        if (eof || r->stop || is_cancelled(r->cancel))
+            return(NULL);
+
+        // Waiting for the first chunk is not counted
+        if (!waited && r->tail > 0 && r->stats != NULL)
+            r->stats->input_waits++;
+        waited = 1;
+
+        usleep(READER_SLEEP_US);
+    }
+#else
+    size_t n;
+
+    if (r->eof || is_cancelled(r->cancel))
+        return(NULL);
+
+    n = read_input(r->in, r->buffer, r->chunk_size, r->cancel);
+    r->data[0] = r->buffer;
+    r->length[0] = n;
+    if (n < r->chunk_size)
+        r->eof = 1;
+    if (n == 0)
+        return(NULL);
+#endif
+
+    slot = r->tail % r->nchunks;
+    *length = r->length[slot];
+
+    return(r->data[slot]);
+}
+
+#ifndef _WIN32
+// Let the reader reuse the slot of the tail chunk, and the simulator the ring span
+static void advance_tail(sample_reader_t *r)
+{
+    if (r->in->use_ring)
+        releaseShmRing(&r->in->ring, r->length[r->tail % r->nchunks]);
+
+    __atomic_store_n(&r->tail, r->tail + 1, __ATOMIC_RELEASE);
+
+    return;
+}
+#endif
+
+// Done with the chunk from next_chunk()
+void release_chunk(sample_reader_t *r)
+{
+#ifndef _WIN32
+    advance_tail(r);
+#else
+    r->tail++;
+#endif
+
+    return;
+}
+
+// Copy up to length bytes that have been read ahead, without waiting.
+// Chunks are used across calls, so this suits device callbacks asking for
+// any number of bytes. end is set when all of the input has been copied.
+// Returns the number of bytes copied
+size_t copy_chunks(sample_reader_t *r, uint8_t *dst, size_t length, int *end)
+{
+    size_t copied = 0;
+#ifndef _WIN32
+    size_t slot, n;
+    int eof;
+
+    *end = 0;
+
+    while (copied < length) {
+        eof = __atomic_load_n(&r->eof, __ATOMIC_ACQUIRE);
+
+        if (r->tail == __atomic_load_n(&r->head, __ATOMIC_ACQUIRE)) {
+            *end = eof;
+            break;
+        }
+
+        slot = r->tail % r->nchunks;
+        n = r->length[slot] - r->offset;
+        if (n > length - copied)
+            n = length - copied;
+
+        memcpy(dst + copied, r->data[slot] + r->offset, n);
+        copied += n;
+        r->offset += n;
+
+        if (r->offset == r->length[slot]) {
+            r->offset = 0;
+            advance_tail(r);
+        }
+    }
+#else
+    // Read in the caller's thread
+    copied = read_input(r->in, dst, length, r->cancel);
+    *end = (copied < length);
+#endif
+
+    return(copied);
+}
+
+// Stop the reader thread and free the chunks
+void stop_reader(sample_reader_t *r)
+{
+    r->stop = 1;
+
+#ifndef _WIN32
+    if (r->started)
+        pthread_join(r->thread, NULL);
+#endif
+    r->started = 0;
+
+    free(r->buffer);
+    free((void *)r->data);
+    free(r->length);
+    r->buffer = NULL;
+    r->data = NULL;
+    r->length = NULL;
+
+    return;
+}
+
+// Bytes of input for a number of samples
+size_t input_bytes(size_t nsamples, int bits)
+{
+    if (bits == 1)
+        return(nsamples / 4); // IQIQIQIQ in each byte
+    else if (bits == 8)
+        return(nsamples * 2);
+
+    return(nsamples * 2 * sizeof(int16_t));
+}
+
+// Whole samples in a number of input bytes
+size_t input_samples(size_t nbytes, int bits)
+{
+    if (bits == 1)
+        return(nbytes * 4);
+    else if (bits == 8)
+        return(nbytes / 2);
+
+    return(nbytes / (2 * sizeof(int16_t)));
+}
+
+// Table of the 8 values (4 I/Q samples) of each byte of 1-bit input
+void init_expand_lut(int16_t lut[256][8], int16_t amplitude)
+{
+    int i, k;
+
+    for (i = 0; i < 256; i++) {
+        for (k = 0; k < 8; k++)
+            lut[i][k] = ((i >> (7 - k)) & 0x1) ? amplitude : (int16_t)-amplitude;
+    }
+
+    return;
+}
+
+// Scale 8-bit I/Q values up to the 12-bit range, 16 values per step with SSE2 or NEON
+static void convert_8bit(int16_t *dst, const int8_t *src, size_t count)
+{
+    size_t i = 0;
+
+#if defined(__SSE2__)
+    const __m128i zero = _mm_setzero_si128();
+
+    for (; i + 16 <= count; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(src + i));
+        // Each byte into the upper half of a 16-bit lane, then shifted down keeping the sign
+        _mm_storeu_si128((__m128i *)(dst + i), _mm_srai_epi16(_mm_unpacklo_epi8(zero, v), 4));
+        _mm_storeu_si128((__m128i *)(dst + i + 8), _mm_srai_epi16(_mm_unpackhi_epi8(zero, v), 4));
+    }
+#elif defined(__ARM_NEON)
+    for (; i + 16 <= count; i += 16) {
+        int8x16_t v = vld1q_s8(src + i);
+        vst1q_s16(dst + i, vshlq_n_s16(vmovl_s8(vget_low_s8(v)), 4));
+        vst1q_s16(dst + i + 8, vshlq_n_s16(vmovl_s8(vget_high_s8(v)), 4));
+    }
+#endif
+    for (; i < count; i++)
+        dst[i] = (int16_t)(src[i] * 16);
+
+    return;
+}
+
+// Convert input bytes into SC16 samples, 12-bit range for 1-bit and 8-bit input
+// Returns the number of samples
+size_t convert_samples(int16_t *dst, const uint8_t *src, size_t nbytes, int bits, const int16_t lut[256][8])
+{
+    size_t i;
+
+    if (bits == 1) {
+        // One table lookup gives the 8 values of each byte
+        for (i = 0; i < nbytes; i++)
+            memcpy(dst + 8 * i, lut[src[i]], sizeof(lut[0]));
+    }
+    else if (bits == 8)
+        convert_8bit(dst, (const int8_t *)src, nbytes);
+    else if ((const void *)dst != (const void *)src)
+        memcpy(dst, src, nbytes);
+
+    return(input_samples(nbytes, bits));
+}
+
+void start_stats(player_stats_t *st)
+{
+    memset(st, 0, sizeof(player_stats_t));
+    st->t_start = player_time();
+
+    return;
+}
+
+// Print the throughput, compared to real time if the sampling rate is known
+void print_stats(const player_stats_t *st, double samp_freq, FILE *fp)
+{
+    double elapsed = player_time() - st->t_start;
+    double rate = elapsed > 0.0 ? (double)st->samples / elapsed : 0.0;
+
+    fprintf(fp, "Samples: %llu in %llu buffers, %.3f s, %.3f MS/s",
+        (unsigned long long)st->samples, (unsigned long long)st->buffers, elapsed, rate / 1e6);
+    if (samp_freq > 0.0)
+        fprintf(fp, " (%.2fx real time)", rate / samp_freq);
+    fprintf(fp, "\n");
+
+    fprintf(fp, "Input waits: %llu, underruns: %llu (%.3f s padded with zeros)\n",
+        (unsigned long long)st->input_waits, (unsigned long long)st->underruns,
+        samp_freq > 0.0 ? (double)st->underrun_samples / samp_freq : 0.0);
+
+    return;
+}
+
+// Send the input to a backend, one chunk of the reader per buffer, until the
+// input ends, the player is cancelled or the backend fails. The chunks must
+// hold be->buffer_samples samples.
+// Returns 0 or the error of the backend
+int stream_samples(player_backend_t *be, sample_reader_t *r, int bits, const int16_t lut[256][8],
+    player_stats_t *st, const volatile int *cancel)
+{
+    int16_t *own;
+    int16_t *buffer;
+    const int16_t *samples;
+    const uint8_t *chunk;
+    size_t length, nsamples;
+    int status = 0;
+
+    own = (int16_t *)malloc(be->buffer_samples * 2 * sizeof(int16_t));
+    if (own == NULL) {
+        fprintf(stderr, "ERROR: Failed to allocate the TX buffer.\n");
+        return(-1);
+    }
+
+    while (status == 0 && !is_cancelled(cancel)) {
+        chunk = next_chunk(r, &length);
+        if (chunk == NULL)
+            break;
+
+        nsamples = input_samples(length, bits);
+        if (nsamples == 0) {
+            release_chunk(r);
+            break;
+        }
+
+        if ((bits == 16 || bits == 12) && be->get_buffer == NULL && (nsamples == be->buffer_samples || !be->pad)) {
+            // 16-bit and 12-bit samples are sent straight from the chunk
+            samples = (const int16_t *)chunk;
+        }
+        else {
+            buffer = be->get_buffer != NULL ? be->get_buffer(be->dev) : own;
+            convert_samples(buffer, chunk, length, bits, lut);
+
+            // The end of the input was reached, so pad the rest of the buffer
+            if (be->pad && nsamples < be->buffer_samples) {
+                memset(buffer + 2 * nsamples, 0, (be->buffer_samples - nsamples) * 2 * sizeof(int16_t));
+                nsamples = be->buffer_samples;
+            }
+            samples = buffer;
+        }
+
+        status = be->transmit(be->dev, samples, nsamples);
+        release_chunk(r);
+
+        if (status == 0) {
+            st->samples += nsamples;
+            st->buffers++;
+        }
+    }
+
+    free(own);
+
+    return(status);
+}
+
+// File sink or, without a path, null device that discards the samples
+typedef struct
+{
+    FILE *fp;
+    double samp_freq; // Pace the samples at this rate, 0 for as fast as possible
+    double t_next; // Time the next buffer is due [sec]
+} sink_t;
+
+static int sink_transmit(void *dev, const int16_t *samples, size_t nsamples)
+{
+    sink_t *s = (sink_t *)dev;
+    double t;
+
+    if (s->fp != NULL && fwrite(samples, 2 * sizeof(int16_t), nsamples, s->fp) != nsamples)
+        return(-1);
+
+    if (s->samp_freq <= 0.0)
+        return(0);
+
+    // Take as long as a device would
+    t = player_time();
+    if (s->t_next < t)
+        s->t_next = t;
+    s->t_next += (double)nsamples / s->samp_freq;
+
+    t = s->t_next - t;
+    if (t > 0.0)
+        sleep_us((unsigned int)(t * 1e6));
+
+    return(0);
+}
+
+static void sink_close(void *dev)
+{
+    sink_t *s = (sink_t *)dev;
+
+    if (s->fp != NULL && s->fp != stdout)
+        fclose(s->fp);
+    free(s);
+
+    return;
+}
+
+// Backend writing the SC16 samples to a file ("-" for stdout) or, if path is
+// NULL, discarding them. With samp_freq > 0 the samples are paced in real time.
+// Returns 0 on success, -1 on error
+int open_sink_backend(player_backend_t *be, const char *path, double samp_freq, size_t buffer_samples)
+{
+    sink_t *s;
+
+    s = (sink_t *)calloc(1, sizeof(sink_t));
+    if (s == NULL)
+        return(-1);
+
+    if (path != NULL) {
+        if (strcmp(path, "-") == 0) {
+#ifdef _WIN32
+            _setmode(_fileno(stdout), O_BINARY);
+#endif
+            s->fp = stdout;
+        }
+        else
+            s->fp = fopen(path, "wb");
+
+        if (s->fp == NULL) {
+            fprintf(stderr, "ERROR: Failed to open output file: %s\n", path);
+            free(s);
+            return(-1);
+        }
+    }
+
+    s->samp_freq = samp_freq;
+
+    memset(be, 0, sizeof(player_backend_t));
+    be->name = path != NULL ? "file" : "null";
+    be->dev = s;
+    be->buffer_samples = buffer_samples;
+    be->pad = 0;
+    be->get_buffer = NULL;
+    be->transmit = sink_transmit;
+    be->close = sink_close;
+
+    return(0);
+}
@@ -0,0 +1,120 @@
+#ifndef PLAYERCORE_H
+#define PLAYERCORE_H
+
+// Streaming core shared by the players: input (file, memory map, pipe or the
+// shared memory ring of gps-sdr-sim -S), a read-ahead thread, the SC01/SC08
+// to SC16 converters, statistics and a small interface to the device
+// backends. Without threads (Windows), the input is read when it is needed.
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+#ifndef _WIN32
+#include <pthread.h>
+#include "shmring.h"
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define READER_SLEEP_US (500) // Wait of the reader or its consumer for the other side
+
+// Source of the I/Q samples
+typedef struct
+{
+    FILE *fp;
+    const uint8_t *map; // Memory-mapped regular file
+    size_t map_size;
+    size_t map_offset; // Bytes of the map read so far
+#ifndef _WIN32
+    shmring_t ring;
+#endif
+    int use_ring;
+    int bits; // I/Q data format of the ring, 0 for files
+    double samp_freq; // Sampling frequency of the ring [Hz], 0 for files
+    int repeat; // Start over at the end of a file
+    unsigned long loops; // Times the file was started over
+} player_input_t;
+
+// Counters of a stream. Each one is written by a single thread.
+typedef struct
+{
+    uint64_t samples; // Samples handed to the device
+    uint64_t buffers;
+    uint64_t underruns; // Buffers or transfers sent as zeros because the input was late
+    uint64_t underrun_samples;
+    uint64_t input_waits; // Times a consumer waited for the reader
+    double t_start;
+} player_stats_t;
+
+// Input read ahead in chunks by a separate thread. Chunks of a memory-mapped
+// file point into the map, those of the ring into the ring, which keeps them
+// until they are released. Each side only advances its own counter, so
+// consumers in device callbacks never take a lock.
+typedef struct
+{
+    player_input_t *in;
+    size_t chunk_size; // Bytes of each chunk, the last one can be shorter
+    size_t nchunks;
+    int copy; // The chunks are read into buffer
+    uint8_t *buffer; // Chunks read from a pipe or a file
+    const uint8_t **data;
+    size_t *length; // Valid bytes of each chunk
+    uint64_t head; // Chunks filled by the reader
+    uint64_t tail; // Chunks consumed
+    size_t offset; // Bytes consumed of the tail chunk by copy_chunks()
+    int eof; // The reader has filled the last chunk
+    volatile int stop;
+    const volatile int *cancel; // Exit flag of the player, may be NULL
+    player_stats_t *stats; // Counts the waits for the input, may be NULL
+    int started;
+#ifndef _WIN32
+    pthread_t thread;
+#endif
+} sample_reader_t;
+
+// Device behind a player. transmit() sends nsamples SC16 samples and returns
+// 0 or a negative error code.
+typedef struct
+{
+    const char *name;
+    void *dev;
+    size_t buffer_samples; // Samples per transmit() call
+    int pad; // Pad a short last buffer with zeros to buffer_samples
+    int16_t *(*get_buffer)(void *dev); // Device memory to convert into, NULL for a buffer of our own
+    int (*transmit)(void *dev, const int16_t *samples, size_t nsamples);
+    void (*close)(void *dev);
+} player_backend_t;
+
+double player_time(void);
+
+int open_input(player_input_t *in, const char *path, const char *shmname, int repeat);
+void close_input(player_input_t *in);
+size_t read_input(player_input_t *in, uint8_t *buffer, size_t length, const volatile int *cancel);
+
+int start_reader(sample_reader_t *r, player_input_t *in, size_t chunk_size, size_t nchunks,
+    const volatile int *cancel, player_stats_t *stats);
+void fill_reader(sample_reader_t *r, size_t nchunks);
+const uint8_t *next_chunk(sample_reader_t *r, size_t *length);
+void release_chunk(sample_reader_t *r);
+size_t copy_chunks(sample_reader_t *r, uint8_t *dst, size_t length, int *end);
+void stop_reader(sample_reader_t *r);
+
+size_t input_bytes(size_t nsamples, int bits);
+size_t input_samples(size_t nbytes, int bits);
+void init_expand_lut(int16_t lut[256][8], int16_t amplitude);
+size_t convert_samples(int16_t *dst, const uint8_t *src, size_t nbytes, int bits, const int16_t lut[256][8]);
+
+void start_stats(player_stats_t *st);
+void print_stats(const player_stats_t *st, double samp_freq, FILE *fp);
+
+int stream_samples(player_backend_t *be, sample_reader_t *r, int bits, const int16_t lut[256][8],
+    player_stats_t *st, const volatile int *cancel);
+int open_sink_backend(player_backend_t *be, const char *path, double samp_freq, size_t buffer_samples);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -1,17 +1,20 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <getopt.h>
 #include <errno.h>
 #include <signal.h>
 #include <string.h>
 #include <iio.h>
 #include <ad9361.h>
+#include "playercore.h"
 
 #define NOTUSED(V) ((void) V)
 #define MHZ(x) ((long long)(x*1000000.0 + .5))
 #define GHZ(x) ((long long)(x*1000000000.0 + .5))
 #define NUM_SAMPLES 2600000
-#define BUFFER_SIZE (NUM_SAMPLES * 2 * sizeof(int16_t))
+#define NUM_KERNEL_BUFFERS 8
+#define NUM_CHUNKS 4 // TX buffers read ahead of the one being pushed
 
 
 struct stream_cfg {
@@ -25,19 +28,22 @@ struct stream_cfg {
 static void usage() {
     fprintf(stderr, "Usage: plutoplayer [options]\n"
         "  -t <filename>      Transmit data from file (required)\n"
+        "  -S <name>          Transmit data from the shared memory ring of gps-sdr-sim -S instead\n"
         "  -a <attenuation>   Set TX attenuation [dB] (default -20.0)\n"
         "  -b <bw>            Set RF bandwidth [MHz] (default 5.0)\n"
         "  -u <uri>           ADALM-Pluto URI\n"
-        "  -n <network>       ADALM-Pluto network IP or hostname (default pluto.local)\n");
+        "  -n <network>       ADALM-Pluto network IP or hostname (default pluto.local)\n"
+        "  -B <samples>       Set TX buffer size [samples] (default 2600000)\n"
+        "  -k <buffers>       Set number of kernel buffers (default 8)\n");
     return;
 }
 
-static bool stop = false;
+static volatile int stop = 0;
 
 static void handle_sig(int sig)
 {
     NOTUSED(sig);
-    stop = true;
+    stop = 1;
 }
 
 static char* readable_fs(double size, char *buf, size_t buf_size) {
@@ -51,6 +57,25 @@ static char* readable_fs(double size, char *buf, size_t buf_size) {
     return buf;
 }
 
+// The samples are converted straight into the TX buffer, which can move
+// after each push
+static int16_t *tx_get_buffer(void *dev) {
+    return (int16_t *)iio_buffer_start((struct iio_buffer *)dev);
+}
+
+static int tx_push(void *dev, const int16_t *samples, size_t nsamples) {
+    NOTUSED(samples);
+    NOTUSED(nsamples);
+
+    // Schedule TX buffer
+    ssize_t ntx = iio_buffer_push((struct iio_buffer *)dev);
+    if (ntx < 0) {
+        printf("Error pushing buf %d\n", (int) ntx);
+        return (int) ntx;
+    }
+    return 0;
+}
+
 /*
  * 
  */
@@ -58,8 +83,14 @@ int main(int argc, char** argv) {
     char buf[1024];
     int opt;
     const char* path = NULL;
+    const char* shmname = NULL;
     struct stream_cfg txcfg;
-    FILE *fp = NULL;
+    player_input_t input;
+    sample_reader_t reader;
+    player_backend_t be;
+    player_stats_t stats;
+    size_t num_samples = NUM_SAMPLES;
+    int kernel_buffers = NUM_KERNEL_BUFFERS;
     const char *uri = NULL;
     const char *ip = NULL;
     
@@ -77,11 +108,14 @@ int main(int argc, char** argv) {
     struct iio_channel *tx0_q = NULL;
     struct iio_buffer *tx_buffer = NULL;    
     
-    while ((opt = getopt(argc, argv, "t:a:b:n:u:")) != EOF) {
+    while ((opt = getopt(argc, argv, "t:S:a:b:n:u:B:k:")) != EOF) {
         switch (opt) {
             case 't':
                 path = optarg;
                 break;
+            case 'S':
+                shmname = optarg;
+                break;
             case 'a':
                 txcfg.gain_db = atof(optarg);
                 if(txcfg.gain_db > 0.0) txcfg.gain_db = 0.0;
@@ -98,6 +132,15 @@ int main(int argc, char** argv) {
             case 'n':
                 ip = optarg;
                 break;
+            case 'B':
+                num_samples = (size_t)atol(optarg);
+                if(num_samples < 4096) num_samples = 4096;
+                break;
+            case 'k':
+                kernel_buffers = atoi(optarg);
+                if(kernel_buffers < 1) kernel_buffers = 1;
+                if(kernel_buffers > 64) kernel_buffers = 64;
+                break;
             default:
                 printf("Unknown argument '-%c %s'\n", opt, optarg);
                 usage();
@@ -105,24 +148,36 @@ int main(int argc, char** argv) {
         }
     }
   
+    memset(&reader, 0, sizeof(reader));
+    start_stats(&stats);
     signal(SIGINT, handle_sig);
     
-    if( path == NULL ) {
+    if( path == NULL && shmname == NULL ) {
         printf("Specify a path to a file to transmit\n");
         usage();
         return EXIT_FAILURE;
     }
     
-    fp = fopen(path, "rb");
-    if (fp==NULL) {
-        fprintf(stderr, "ERROR: Failed to open TX file: %s\n", path);
+    if (shmname != NULL)
+        printf("* Waiting for shared memory ring %s\n", shmname);
+    if (open_input(&input, path, shmname, 0) != 0)
         return EXIT_FAILURE;
+
+    if (input.use_ring) {
+        if (input.bits != 16) {
+            fprintf(stderr, "ERROR: PlutoSDR requires 16-bit I/Q samples, ring has %d-bit\n", input.bits);
+            close_input(&input);
+            return EXIT_FAILURE;
+        }
+        txcfg.fs_hz = (long long)input.samp_freq;
+        readable_fs((double)input.ring.size, buf, sizeof(buf));
+        printf("* Shared memory ring size: %s, %.3f MS/s\n", buf, input.samp_freq/1e6);
+    } else if (input.map != NULL) {
+        readable_fs((double)input.map_size, buf, sizeof(buf));
+        printf("* Transmit file size: %s (memory-mapped)\n", buf);
+    } else {
+        printf("* Transmit file: %s\n", path);
     }
-    fseek(fp, 0L, SEEK_END);
-    size_t sz = ftell(fp);
-    fseek(fp, 0L, SEEK_SET);
-    readable_fs((double)sz, buf, sizeof(buf));
-    printf("* Transmit file size: %s\n", buf);
     
     printf("* Acquiring IIO context\n");
     ctx = iio_create_default_context();
@@ -170,7 +225,9 @@ int main(int argc, char** argv) {
         goto error_exit;
     }    
 
-    iio_device_set_kernel_buffers_count(tx, 8);
+    // More kernel buffers queued for the DMA ride out longer host stalls
+    if (iio_device_set_kernel_buffers_count(tx, kernel_buffers) < 0)
+        fprintf(stderr, "Could not set %d kernel buffers.\n", kernel_buffers);
     
     phydev = iio_context_find_device(ctx, "ad9361-phy");
     struct iio_channel* phy_chn = iio_device_find_channel(phydev, "voltage0", true);
@@ -202,9 +259,10 @@ int main(int argc, char** argv) {
     
     ad9361_set_bb_rate(iio_context_find_device(ctx, "ad9361-phy"), txcfg.fs_hz);
     
-    printf("* Creating TX buffer\n");
+    printf("* Creating TX buffer of %zu samples (%.3f s), %d kernel buffers\n",
+        num_samples, (double)num_samples / txcfg.fs_hz, kernel_buffers);
 
-    tx_buffer = iio_device_create_buffer(tx, NUM_SAMPLES, false);
+    tx_buffer = iio_device_create_buffer(tx, num_samples, false);
     if (!tx_buffer) {
         fprintf(stderr, "Could not create TX buffer.\n");
         goto error_exit;
@@ -214,24 +272,29 @@ int main(int argc, char** argv) {
         iio_device_find_channel(iio_context_find_device(ctx, "ad9361-phy"), "altvoltage1", true)
         , "powerdown", false); // Turn ON TX LO
 
-    int32_t ntx = 0;
-    short *ptx_buffer = (short *)iio_buffer_start(tx_buffer);
+    // Read ahead, one TX buffer per chunk, so that reading the next buffer
+    // overlaps with pushing the previous one
+    if (start_reader(&reader, &input, num_samples * 2 * sizeof(int16_t), NUM_CHUNKS, &stop, &stats) != 0)
+        goto error_exit;
+
+    memset(&be, 0, sizeof(be));
+    be.name = "PlutoSDR";
+    be.dev = tx_buffer;
+    be.buffer_samples = num_samples;
+    be.pad = 1;
+    be.get_buffer = tx_get_buffer;
+    be.transmit = tx_push;
 
     printf("* Transmit starts...\n");    
     // Keep writing samples while there is more data to send and no failures have occurred.
-    while (!feof(fp) && !stop) {
-        fread(ptx_buffer, sizeof(short), BUFFER_SIZE / sizeof(short),fp);
-        // Schedule TX buffer
-        ntx = iio_buffer_push(tx_buffer);
-        if (ntx < 0) {
-            printf("Error pushing buf %d\n", (int) ntx);
-            break;
-        }       
-    }
+    stream_samples(&be, &reader, 16, NULL, &stats, &stop);
+    print_stats(&stats, (double)txcfg.fs_hz, stdout);
     printf("Done.\n");
 
 error_exit:
-    fclose(fp);
+    stop = 1;
+    stop_reader(&reader);
+    close_input(&input);
     iio_channel_attr_write_bool(
         iio_device_find_channel(iio_context_find_device(ctx, "ad9361-phy"), "altvoltage1", true)
         , "powerdown", true); // Turn OFF TX LO                
@@ -0,0 +1,298 @@
+/*
+ * Check and benchmark of the carrier mixer and the SC08 and SC01 output
+ * quantizers
+ *
+ * Compares the output of each SIMD quantizer supported by the CPU with the
+ * scalar reference byte for byte, over the whole 16-bit range and all
+ * lengths and alignments up to a few vectors, and the SIMD carrier mixer
+ * with the scalar one for random phases, phase steps and gains. Fails on
+ * any difference. Then reports the throughput of each kernel for blocks of
+ * the given number of samples.
+ *
+ * Usage: quantbench [nsamp] [repeat]
+ */
+
+#define main gpssim_main
+#include "gpssim.c"
+#undef main
+
+#define QUANT_CHECK_LEN (200)
+#define QUANT_CHECK_OFFSET (32)
+
+#define MIX_CHECK_RUNS (20000)
+
+typedef void (*quantfunc_t)(signed char *, const short *, int);
+typedef void (*mixfunc_t)(int *, const signed char *, unsigned int, unsigned int, int, int);
+
+/*! \brief Quantizer and carrier mixer under test */
+typedef struct
+{
+	const char *name;
+	quantfunc_t sc08;
+	quantfunc_t sc01;
+	mixfunc_t mix;	/*!< NULL if there is no SIMD version */
+} quantkernel_t;
+
+/*! \brief Compare a quantizer with the scalar reference
+ *  \returns Number of mismatching outputs
+ */
+int checkKernel(const quantkernel_t *q, const short *in, int n)
+{
+	signed char ref[QUANT_CHECK_LEN+QUANT_CHECK_OFFSET],out[QUANT_CHECK_LEN+QUANT_CHECK_OFFSET];
+	int len,off;
+	int nerr = 0;
+
+	for (len=0; len<=QUANT_CHECK_LEN; len++)
+	{
+		for (off=0; off<QUANT_CHECK_OFFSET && off+len<=n; off++)
+		{
+			// SC08, at all alignments of the input and output
+			memset(ref, 0x55, sizeof(ref));
+			memset(out, 0x55, sizeof(out));
+			quantizeSC08Scalar(ref+off, in+off, len);
+			q->sc08(out+off, in+off, len);
+			if (memcmp(ref, out, sizeof(ref))!=0)
+			{
+				fprintf(stderr, "ERROR: %s SC08 differs for %d samples at offset %d.\n", q->name, len, off);
+				nerr++;
+			}
+
+			// SC01, including the zero padding of the last byte
+			memset(ref, 0x55, sizeof(ref));
+			memset(out, 0x55, sizeof(out));
+			packSC01Scalar(ref+off, in+off, len);
+			q->sc01(out+off, in+off, len);
+			if (memcmp(ref, out, sizeof(ref))!=0)
+			{
+				fprintf(stderr, "ERROR: %s SC01 differs for %d samples at offset %d.\n", q->name, len, off);
+				nerr++;
+			}
+		}
+	}
+
+	return(nerr);
+}
+
+/*! \brief Compare a carrier mixer with the scalar reference
+ *  \returns Number of mismatching runs
+ *
+ * Each run adds a random code to a random accumulator, with any phase and
+ * phase step, a gain in or out of the 16-bit range and a length of up to a
+ * few vectors.
+ */
+int checkMixer(const quantkernel_t *q)
+{
+	int ref[2*QUANT_CHECK_LEN],out[2*QUANT_CHECK_LEN];
+	signed char code[QUANT_CHECK_LEN];
+	unsigned int phase,step;
+	int gain,len,run,i;
+	int nerr = 0;
+
+	srand(2);
+	for (run=0; run<MIX_CHECK_RUNS; run++)
+	{
+		len = rand()%(QUANT_CHECK_LEN+1);
+		phase = ((unsigned int)rand()<<16) ^ (unsigned int)rand();
+		step = ((unsigned int)rand()<<16) ^ (unsigned int)rand();
+		if (run%4==0)
+			step &= 0x3fffff; // Less than a table entry per sample, as in practice
+
+		gain = (rand()%65536)-32768;
+		if (run%8==0)
+			gain = rand()%(1<<20); // Beyond the 16-bit range
+
+		for (i=0; i<len; i++)
+			code[i] = (rand()&1)?1:-1;
+		for (i=0; i<2*len; i++)
+			ref[i] = out[i] = rand()%2001-1000;
+
+		mixCarrierScalar(ref, code, phase, step, gain, len);
+		q->mix(out, code, phase, step, gain, len);
+		if (memcmp(ref, out, 2*len*sizeof(int))!=0)
+		{
+			fprintf(stderr, "ERROR: %s mixer differs for %d samples, phase 0x%08x, step 0x%08x, gain %d.\n",
+				q->name, len, phase, step, gain);
+			nerr++;
+		}
+	}
+
+	return(nerr);
+}
+
+/*! \brief Time a carrier mixer
+ *  \returns Process time in seconds
+ */
+double timeMixer(mixfunc_t f, int *acc, const signed char *code, int n, int repeat)
+{
+	clock_t tstart;
+	int k;
+
+	tstart = clock();
+	for (k=0; k<repeat; k++)
+		f(acc, code, (unsigned int)k*0x9e3779b9U, 0x1a2b3cU, 102, n);
+
+	return((double)(clock()-tstart)/CLOCKS_PER_SEC);
+}
+
+/*! \brief Time a quantizer
+ *  \returns Process time in seconds
+ */
+double timeKernel(quantfunc_t f, signed char *out, const short *in, int n, int repeat)
+{
+	clock_t tstart;
+	int k;
+
+	tstart = clock();
+	for (k=0; k<repeat; k++)
+		f(out, in, n);
+
+	return((double)(clock()-tstart)/CLOCKS_PER_SEC);
+}
+
+int main(int argc, char *argv[])
+{
+	quantkernel_t kernel[4];
+	int nkernel = 0;
+	short *in;
+	signed char *out,*ref,*code;
+	int *acc;
+	int nsamp = 260000; // 0.1 s at 2.6 MHz
+	int repeat = 1000;
+	int n,k;
+	int nerr = 0;
+	double t08,t01,tmix;
+
+	if (argc>1)
+		nsamp = atoi(argv[1]);
+	if (argc>2)
+		repeat = atoi(argv[2]);
+
+	if (nsamp<1 || repeat<1)
+	{
+		fprintf(stderr, "Usage: quantbench [nsamp] [repeat]\n");
+		exit(1);
+	}
+
+	// Tables of the carrier mixers
+	initSynthKernels();
+
+	kernel[nkernel].name = "scalar";
+	kernel[nkernel].sc08 = quantizeSC08Scalar;
+	kernel[nkernel].sc01 = packSC01Scalar;
+	kernel[nkernel++].mix = mixCarrierScalar;
+#if defined(USE_AVX2)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("sse2"))
+	{
+		kernel[nkernel].name = "SSE2";
+		kernel[nkernel].sc08 = quantizeSC08SSE2;
+		kernel[nkernel].sc01 = packSC01SSE2;
+		kernel[nkernel++].mix = NULL;
+	}
+	if (__builtin_cpu_supports("avx2"))
+	{
+		kernel[nkernel].name = "AVX2";
+		kernel[nkernel].sc08 = quantizeSC08AVX2;
+		kernel[nkernel].sc01 = packSC01AVX2;
+		kernel[nkernel++].mix = mixCarrierAVX2;
+	}
+#elif defined(USE_NEON)
+	kernel[nkernel].name = "NEON";
+	kernel[nkernel].sc08 = quantizeSC08NEON;
+	kernel[nkernel].sc01 = packSC01NEON;
+	kernel[nkernel++].mix = mixCarrierNEON;
+#endif
+
+	// I and Q of nsamp samples, at least 64k values for the check
+	n = 2*nsamp;
+	if (n<65536+QUANT_CHECK_LEN+QUANT_CHECK_OFFSET)
+		n = 65536+QUANT_CHECK_LEN+QUANT_CHECK_OFFSET;
+
+	in = (short *)malloc(n*sizeof(short));
+	out = (signed char *)malloc(n);
+	if (in==NULL || out==NULL)
+	{
+		fprintf(stderr, "ERROR: Failed to allocate buffers.\n");
+		exit(1);
+	}
+
+	// Every 16-bit value once, starting with the edge cases around zero and
+	// the limits, then random values
+	in[0] = 0; in[1] = 1; in[2] = -1; in[3] = 15; in[4] = 16; in[5] = -16; in[6] = -17;
+	in[7] = 32767; in[8] = -32768; in[9] = 2047; in[10] = -2048;
+	for (k=11; k<65536+11 && k<n; k++)
+		in[k] = (short)(k-11);
+	srand(1);
+	for (; k<n; k++)
+		in[k] = (short)(rand() & 0xffff);
+
+	// Whole input, covering every 16-bit value
+	ref = (signed char *)malloc(n);
+	code = (signed char *)malloc(nsamp);
+	acc = (int *)calloc(2*(size_t)nsamp, sizeof(int));
+	if (ref==NULL || code==NULL || acc==NULL)
+	{
+		fprintf(stderr, "ERROR: Failed to allocate buffers.\n");
+		exit(1);
+	}
+
+	for (k=1; k<nkernel; k++)
+	{
+		quantizeSC08Scalar(ref, in, n);
+		kernel[k].sc08(out, in, n);
+		if (memcmp(ref, out, n)!=0)
+		{
+			fprintf(stderr, "ERROR: %s SC08 differs from the scalar reference.\n", kernel[k].name);
+			nerr++;
+		}
+
+		packSC01Scalar(ref, in, n);
+		kernel[k].sc01(out, in, n);
+		if (memcmp(ref, out, (n+7)/8)!=0)
+		{
+			fprintf(stderr, "ERROR: %s SC01 differs from the scalar reference.\n", kernel[k].name);
+			nerr++;
+		}
+
+		// Short lengths and unaligned buffers
+		nerr += checkKernel(&kernel[k], in, n);
+
+		if (kernel[k].mix!=NULL)
+			nerr += checkMixer(&kernel[k]);
+	}
+
+	for (k=0; k<nsamp; k++)
+		code[k] = (k/2046%2==0)?1:-1;
+
+	// Throughput
+	fprintf(stderr, "%d samples x %d\n", nsamp, repeat);
+	for (k=0; k<nkernel; k++)
+	{
+		t08 = timeKernel(kernel[k].sc08, out, in, 2*nsamp, repeat);
+		t01 = timeKernel(kernel[k].sc01, out, in, 2*nsamp, repeat);
+
+		fprintf(stderr, "%-6s  SC08 %.3f [sec] (%.0f [MS/s]), SC01 %.3f [sec] (%.0f [MS/s])", kernel[k].name,
+			t08, (double)nsamp*repeat/t08*1.0e-6, t01, (double)nsamp*repeat/t01*1.0e-6);
+
+		if (kernel[k].mix!=NULL)
+		{
+			tmix = timeMixer(kernel[k].mix, acc, code, nsamp, repeat);
+			fprintf(stderr, ", mixer %.3f [sec] (%.0f [MS/s])", tmix, (double)nsamp*repeat/tmix*1.0e-6);
+		}
+		fprintf(stderr, "\n");
+	}
+
+	free(in);
+	free(out);
+	free(ref);
+	free(code);
+	free(acc);
+
+	if (nerr>0)
+	{
+		fprintf(stderr, "ERROR: %d differences.\n", nerr);
+		exit(1);
+	}
+
+	return(0);
+}
@@ -0,0 +1,211 @@
+/*
+ * Benchmark of the satellite orbit computation
+ *
+ * Propagates all satellites over one day of a RINEX navigation file at the
+ * given update interval with the batched propagator used by gps-sdr-sim,
+ * with the orbit interpolation (-P) and with the reference satpos(). Reports
+ * the time taken and the largest difference to the reference, and fails if
+ * it exceeds 1 mm.
+ *
+ * Usage: satposbench <rinex_nav> [interval_sec] [duration_sec] [window_sec]
+ */
+
+#define main gpssim_main
+#include "gpssim.c"
+#undef main
+
+/*! \brief Largest differences to the reference */
+typedef struct
+{
+	double pos,vel,clk;
+} satdiff_t;
+
+/*! \brief Select the ephemerides at the given time into the batch
+ *  \returns TRUE if the ephemeris of any slot has changed
+ */
+int selectEphemerides(satstate_t *ss, const ephem_t **cur, const ephstore_t *store, gpstime_t g)
+{
+	const ephem_t *eph;
+	int sv;
+	int changed = FALSE;
+
+	ss->n = MAX_SAT;
+
+	for (sv=0; sv<MAX_SAT; sv++)
+	{
+		eph = findEphemeris(store, sv, g);
+
+		if (eph!=cur[sv])
+		{
+			setSatEphemeris(ss, sv, eph);
+			cur[sv] = eph;
+			changed = TRUE;
+		}
+	}
+
+	return(changed);
+}
+
+/*! \brief Propagate the satellites over the given span
+ *  \param[in] window Orbit interpolation window, 0 for the model
+ *  \param[out] diff Largest differences to satpos(), NULL to time the batch only
+ *  \returns Process time in seconds
+ */
+double propagate(const ephstore_t *store, gpstime_t g0, double step, long nstep, double window, satdiff_t *diff)
+{
+	satstate_t ss;
+	const ephem_t *cur[MAX_SAT];
+	gpstime_t g;
+	double pos[3],vel[3],clk[2];
+	double dpos,dvel,dclk;
+	clock_t tstart;
+	long istep;
+	int sv,k;
+
+	memset(&ss, 0, sizeof(satstate_t));
+	memset(cur, 0, sizeof(cur));
+	ss.window = window;
+
+	tstart = clock();
+	for (istep=0; istep<nstep; istep++)
+	{
+		g = incGpsTime(g0, istep*step);
+
+		if (istep%300==0) // Ephemeris update every 30 s at 0.1 s
+			selectEphemerides(&ss, cur, store, g);
+
+		satposBatch(&ss, g);
+
+		if (diff==NULL)
+			continue;
+
+		for (sv=0; sv<MAX_SAT; sv++)
+		{
+			if (cur[sv]==NULL)
+				continue;
+
+			satpos(cur[sv], g, pos, vel, clk);
+
+			dpos = 0.0;
+			dvel = 0.0;
+			for (k=0; k<3; k++)
+			{
+				dpos += (ss.pos[k][sv]-pos[k])*(ss.pos[k][sv]-pos[k]);
+				dvel += (ss.vel[k][sv]-vel[k])*(ss.vel[k][sv]-vel[k]);
+			}
+			dclk = fabs(ss.clk[0][sv]-clk[0])*SPEED_OF_LIGHT;
+
+			if (sqrt(dpos)>diff->pos)
+				diff->pos = sqrt(dpos);
+			if (sqrt(dvel)>diff->vel)
+				diff->vel = sqrt(dvel);
+			if (dclk>diff->clk)
+				diff->clk = dclk;
+		}
+	}
+
+	return((double)(clock()-tstart)/CLOCKS_PER_SEC);
+}
+
+int main(int argc, char *argv[])
+{
+	ephstore_t store;
+	ionoutc_t ionoutc;
+	satstate_t ss;
+	const ephem_t *cur[MAX_SAT];
+	gpstime_t g0,g;
+	double step = 0.1;
+	double duration = SECONDS_IN_DAY;
+	double window = 300.0;
+	double pos[3],vel[3],clk[2];
+	double tbatch,tinterp,tref;
+	satdiff_t dbatch,dinterp;
+	clock_t tstart;
+	long nstep,istep,neval;
+	int sv;
+
+	if (argc<2)
+	{
+		fprintf(stderr, "Usage: satposbench <rinex_nav> [interval_sec] [duration_sec] [window_sec]\n");
+		exit(1);
+	}
+
+	if (argc>2)
+		step = atof(argv[2]);
+	if (argc>3)
+		duration = atof(argv[3]);
+	if (argc>4)
+		window = atof(argv[4]);
+
+	memset(&store, 0, sizeof(ephstore_t));
+	store.tlast.week = -1;
+	store.files[store.nfile++] = argv[1];
+	ionoutc.enable = TRUE;
+
+	if (loadNextEphemFile(&store, &ionoutc)<=0)
+	{
+		fprintf(stderr, "ERROR: Failed to read ephemeris file %s.\n", argv[1]);
+		exit(1);
+	}
+
+	// Earliest TOC
+	g0.week = -1;
+	for (sv=0; sv<MAX_SAT; sv++)
+	{
+		if (store.neph[sv]>0 && (g0.week<0 || subGpsTime(store.eph[sv][0].toc, g0)<0.0))
+			g0 = store.eph[sv][0].toc;
+	}
+
+	nstep = (long)(duration/step);
+
+	// Batched propagator and orbit interpolation
+	tbatch = propagate(&store, g0, step, nstep, 0.0, NULL);
+	tinterp = propagate(&store, g0, step, nstep, window, NULL);
+
+	// Reference
+	memset(&ss, 0, sizeof(satstate_t));
+	memset(cur, 0, sizeof(cur));
+	neval = 0;
+
+	tstart = clock();
+	for (istep=0; istep<nstep; istep++)
+	{
+		g = incGpsTime(g0, istep*step);
+
+		if (istep%300==0)
+			selectEphemerides(&ss, cur, &store, g);
+
+		for (sv=0; sv<MAX_SAT; sv++)
+		{
+			if (cur[sv]!=NULL)
+			{
+				satpos(cur[sv], g, pos, vel, clk);
+				neval++;
+			}
+		}
+	}
+	tref = (double)(clock()-tstart)/CLOCKS_PER_SEC;
+
+	// Accuracy
+	memset(&dbatch, 0, sizeof(satdiff_t));
+	memset(&dinterp, 0, sizeof(satdiff_t));
+	propagate(&store, g0, step, nstep, 0.0, &dbatch);
+	propagate(&store, g0, step, nstep, window, &dinterp);
+
+	freeEphemStore(&store);
+
+	fprintf(stderr, "%ld epochs of %.3f [sec], %ld evaluations\n", nstep, step, neval);
+	fprintf(stderr, "satposBatch:  %.3f [sec] (%.1f [ns] per satellite)\n", tbatch, tbatch/(double)neval*1.0e9);
+	fprintf(stderr, "  Max. difference: position %.3e [m], velocity %.3e [m/s], clock %.3e [m]\n", dbatch.pos, dbatch.vel, dbatch.clk);
+	fprintf(stderr, "satposInterp: %.3f [sec] (%.1f [ns] per satellite, %.0f [sec] window)\n", tinterp, tinterp/(double)neval*1.0e9, window);
+	fprintf(stderr, "  Max. difference: position %.3e [m], velocity %.3e [m/s], clock %.3e [m]\n", dinterp.pos, dinterp.vel, dinterp.clk);
+	fprintf(stderr, "satpos:       %.3f [sec] (%.1f [ns] per satellite)\n", tref, tref/(double)neval*1.0e9);
+
+	if (dbatch.pos>1.0e-3 || dbatch.clk>1.0e-3 || dinterp.pos>ORBIT_INTERP_TOL || dinterp.clk>ORBIT_INTERP_TOL)
+	{
+		fprintf(stderr, "ERROR: Difference exceeds 1 mm.\n");
+		exit(1);
+	}
+
+	return(0);
+}
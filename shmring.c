@@ -0,0 +1,506 @@
+/*
+ * Single-producer/single-consumer ring of bytes in POSIX shared memory
+ *
+ * Used by gps-sdr-sim (-S) to hand the samples to the players without a
+ * pipe. The producer creates the ring and the consumer attaches to it by
+ * name, in either order.
+ */
+
+#ifdef __linux__
+#define _GNU_SOURCE // MAP_ANONYMOUS and syscall()
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <time.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#endif
+#include "shmring.h"
+
+/*! \brief Wait for a sequence number to change
+ *  \param[in] seq Sequence number in the ring header
+ *  \param[in] val Value seen before deciding to wait
+ *
+ * Returns when \a seq differs from \a val, after SHMRING_WAIT_MS at the
+ * latest, or spuriously.
+ */
+void waitShmRing(uint32_t *seq, uint32_t val)
+{
+#ifdef __linux__
+	struct timespec ts;
+
+	ts.tv_sec = 0;
+	ts.tv_nsec = SHMRING_WAIT_MS*1000000L;
+	syscall(SYS_futex, seq, FUTEX_WAIT, val, &ts, NULL, 0);
+#else
+	struct timespec ts;
+
+	(void)seq;
+	(void)val;
+	ts.tv_sec = 0;
+	ts.tv_nsec = 1000000L; // Polling
+	nanosleep(&ts, NULL);
+#endif
+
+	return;
+}
+
+/*! \brief Wake up the other side waiting for a sequence number */
+void wakeShmRing(uint32_t *seq)
+{
+#ifdef __linux__
+	syscall(SYS_futex, seq, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+#else
+	(void)seq;
+#endif
+
+	return;
+}
+
+/*! \brief Check if a process of the other side has exited
+ *  \param[in] pid Process ID, 0 if unknown
+ */
+int processExited(int32_t pid)
+{
+	return(pid>0 && kill((pid_t)pid, 0)==-1 && errno==ESRCH);
+}
+
+/*! \brief Map the data of a ring, and the header if not mapped yet
+ *  \param r Ring with an open file descriptor
+ *  \param[in] size Size of the data in bytes
+ *  \returns 0 on success, -1 on error
+ */
+int mapShmRing(shmring_t *r, uint64_t size)
+{
+	unsigned char *base;
+
+	if (r->hdr==NULL)
+	{
+		r->hdr = (shmring_hdr_t *)mmap(NULL, r->hdr_size, PROT_READ|PROT_WRITE, MAP_SHARED, r->fd, 0);
+		if (r->hdr==MAP_FAILED)
+		{
+			r->hdr = NULL;
+			return(-1);
+		}
+	}
+
+	// Reserve twice the size and map the data into both halves
+	base = (unsigned char *)mmap(NULL, 2*size, PROT_NONE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+	if (base==MAP_FAILED)
+		return(-1);
+
+	if (mmap(base, size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_FIXED, r->fd, (off_t)r->hdr_size)==MAP_FAILED ||
+		mmap(base+size, size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_FIXED, r->fd, (off_t)r->hdr_size)==MAP_FAILED)
+	{
+		munmap(base, 2*size);
+		return(-1);
+	}
+
+	r->data = base;
+	r->size = size;
+
+	return(0);
+}
+
+/*! \brief Create a ring as the producer
+ *  \param r Ring
+ *  \param[in] name Name of the shared memory object, e.g. "/gpssim"
+ *  \param[in] size Size of the data in bytes, rounded up to whole pages
+ *  \param[in] bits I/Q data format of the samples
+ *  \param[in] samp_freq Sampling frequency [Hz]
+ *  \returns 0 on success, -1 on error
+ */
+int createShmRing(shmring_t *r, const char *name, uint64_t size, int bits, double samp_freq)
+{
+	long page = sysconf(_SC_PAGESIZE);
+
+	memset(r, 0, sizeof(shmring_t));
+	r->fd = -1;
+	r->producer = 1;
+	r->hdr_size = (size_t)page;
+	snprintf(r->name, sizeof(r->name), "%s", name);
+
+	size = (size+page-1)/page*page;
+
+	// A ring left behind by an earlier run
+	shm_unlink(name);
+
+	r->fd = shm_open(name, O_RDWR|O_CREAT|O_EXCL, 0600);
+	if (r->fd==-1)
+		return(-1);
+
+	if (ftruncate(r->fd, (off_t)(r->hdr_size+size))!=0 || mapShmRing(r, size)==-1)
+	{
+		closeShmRing(r);
+		return(-1);
+	}
+
+	r->hdr->version = SHMRING_VERSION;
+	r->hdr->size = size;
+	r->hdr->bits = bits;
+	r->hdr->pid = (int32_t)getpid();
+	r->hdr->samp_freq = samp_freq;
+
+	// The consumer may attach from now on
+	__atomic_store_n(&r->hdr->magic, SHMRING_MAGIC, __ATOMIC_RELEASE);
+
+	return(0);
+}
+
+/*! \brief Attach to a ring as the consumer
+ *  \param r Ring
+ *  \param[in] name Name of the shared memory object
+ *  \param[in] timeout_ms Time to wait for the producer to create the ring, -1 for no limit
+ *  \returns 0 on success, -1 on error
+ */
+int openShmRing(shmring_t *r, const char *name, int timeout_ms)
+{
+	struct timespec ts;
+	int32_t expected;
+	int waited = 0;
+
+	memset(r, 0, sizeof(shmring_t));
+	r->fd = -1;
+	r->hdr_size = (size_t)sysconf(_SC_PAGESIZE);
+	snprintf(r->name, sizeof(r->name), "%s", name);
+
+	ts.tv_sec = 0;
+	ts.tv_nsec = SHMRING_WAIT_MS*1000000L;
+
+	// Wait for the producer to create and initialize the ring
+	while (1)
+	{
+		if (r->fd==-1)
+			r->fd = shm_open(name, O_RDWR, 0);
+
+		if (r->fd!=-1 && r->hdr==NULL)
+		{
+			struct stat st;
+
+			if (fstat(r->fd, &st)==0 && (size_t)st.st_size>r->hdr_size)
+			{
+				r->hdr = (shmring_hdr_t *)mmap(NULL, r->hdr_size, PROT_READ|PROT_WRITE, MAP_SHARED, r->fd, 0);
+				if (r->hdr==MAP_FAILED)
+					r->hdr = NULL;
+			}
+		}
+
+		if (r->hdr!=NULL && __atomic_load_n(&r->hdr->magic, __ATOMIC_ACQUIRE)==SHMRING_MAGIC)
+			break;
+
+		if (timeout_ms>=0 && waited>=timeout_ms)
+		{
+			closeShmRing(r);
+			return(-1);
+		}
+
+		nanosleep(&ts, NULL);
+		waited += SHMRING_WAIT_MS;
+	}
+
+	// Only one consumer at a time
+	expected = 0;
+	if (r->hdr->version!=SHMRING_VERSION ||
+		!__atomic_compare_exchange_n(&r->hdr->cpid, &expected, (int32_t)getpid(), 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+	{
+		closeShmRing(r);
+		return(-1);
+	}
+
+	if (mapShmRing(r, r->hdr->size)==-1)
+	{
+		closeShmRing(r);
+		return(-1);
+	}
+
+	return(0);
+}
+
+/*! \brief Mark the end of the data and wait for the consumer to read it
+ *  \param r Ring created as the producer
+ *  \returns 0 once the ring is drained, -1 if the consumer has exited first
+ *
+ * A consumer that has not attached yet is waited for, so the ring is not
+ * removed by \ref closeShmRing before anybody has read the data.
+ */
+int finishShmRing(shmring_t *r)
+{
+	shmring_hdr_t *hdr = r->hdr;
+	uint32_t seq;
+	int32_t cpid;
+
+	__atomic_store_n(&hdr->closed, 1, __ATOMIC_SEQ_CST);
+	__atomic_add_fetch(&hdr->wseq, 1, __ATOMIC_SEQ_CST);
+	wakeShmRing(&hdr->wseq);
+
+	while (1)
+	{
+		seq = __atomic_load_n(&hdr->rseq, __ATOMIC_SEQ_CST);
+		__atomic_store_n(&hdr->wwait, 1, __ATOMIC_SEQ_CST);
+
+		cpid = __atomic_load_n(&hdr->cpid, __ATOMIC_SEQ_CST);
+		if (cpid!=0 && __atomic_load_n(&hdr->tail, __ATOMIC_SEQ_CST)==hdr->head)
+			break;
+
+		if (cpid==-1 || processExited(cpid))
+		{
+			__atomic_store_n(&hdr->wwait, 0, __ATOMIC_SEQ_CST);
+			return(-1);
+		}
+
+		// The consumer may have read everything before it exited, so the
+		// tail is checked first. Nobody bumps rseq before the consumer has
+		// attached, so this polls until then.
+		waitShmRing(&hdr->rseq, seq);
+		r->nwait++;
+	}
+
+	__atomic_store_n(&hdr->wwait, 0, __ATOMIC_SEQ_CST);
+
+	return(0);
+}
+
+/*! \brief Detach from a ring
+ *  \param r Ring
+ *
+ * The producer marks the end of the data and removes the name; the
+ * consumer can still read what is left. Call \ref finishShmRing first
+ * to make sure the consumer has read it.
+ */
+void closeShmRing(shmring_t *r)
+{
+	if (r->hdr!=NULL)
+	{
+		if (r->producer)
+		{
+			__atomic_store_n(&r->hdr->closed, 1, __ATOMIC_SEQ_CST);
+			__atomic_add_fetch(&r->hdr->wseq, 1, __ATOMIC_SEQ_CST);
+			wakeShmRing(&r->hdr->wseq);
+		}
+		else if (r->data!=NULL)
+		{
+			// Let the producer know nobody reads any more
+			__atomic_store_n(&r->hdr->cpid, -1, __ATOMIC_SEQ_CST);
+			__atomic_add_fetch(&r->hdr->rseq, 1, __ATOMIC_SEQ_CST);
+			wakeShmRing(&r->hdr->rseq);
+		}
+
+		munmap(r->hdr, r->hdr_size);
+		r->hdr = NULL;
+	}
+
+	if (r->data!=NULL)
+	{
+		munmap(r->data, 2*r->size);
+		r->data = NULL;
+	}
+
+	if (r->fd!=-1)
+	{
+		close(r->fd);
+		r->fd = -1;
+	}
+
+	if (r->producer)
+		shm_unlink(r->name);
+
+	return;
+}
+
+/*! \brief Wait for space in the ring as the producer
+ *  \param r Ring
+ *  \param[in] len Number of bytes, at most the ring size
+ *  \returns Contiguous space of \a len bytes, NULL if the consumer has exited
+ */
+void *reserveShmRing(shmring_t *r, size_t len)
+{
+	shmring_hdr_t *hdr = r->hdr;
+	uint64_t head = hdr->head;
+	uint32_t seq;
+	int32_t cpid;
+
+	if (len>r->size)
+		return(NULL);
+
+	while (r->size-(head-__atomic_load_n(&hdr->tail, __ATOMIC_ACQUIRE))<len)
+	{
+		cpid = __atomic_load_n(&hdr->cpid, __ATOMIC_SEQ_CST);
+		if (cpid==-1 || processExited(cpid))
+			return(NULL);
+
+		seq = __atomic_load_n(&hdr->rseq, __ATOMIC_SEQ_CST);
+		__atomic_store_n(&hdr->wwait, 1, __ATOMIC_SEQ_CST);
+
+		if (r->size-(head-__atomic_load_n(&hdr->tail, __ATOMIC_SEQ_CST))<len)
+		{
+			waitShmRing(&hdr->rseq, seq);
+			r->nwait++;
+		}
+
+		__atomic_store_n(&hdr->wwait, 0, __ATOMIC_SEQ_CST);
+	}
+
+	return(r->data + head%r->size);
+}
+
+/*! \brief Publish bytes written into reserved space
+ *  \param r Ring
+ *  \param[in] len Number of bytes
+ */
+void commitShmRing(shmring_t *r, size_t len)
+{
+	shmring_hdr_t *hdr = r->hdr;
+
+	__atomic_store_n(&hdr->head, hdr->head+len, __ATOMIC_SEQ_CST);
+	__atomic_add_fetch(&hdr->wseq, 1, __ATOMIC_SEQ_CST);
+
+	if (__atomic_load_n(&hdr->rwait, __ATOMIC_SEQ_CST))
+		wakeShmRing(&hdr->wseq);
+
+	return;
+}
+
+/*! \brief Copy data into the ring
+ *  \param r Ring
+ *  \param[in] buf Data
+ *  \param[in] len Number of bytes
+ *  \returns 0 on success, -1 if the consumer has exited
+ */
+int writeShmRing(shmring_t *r, const void *buf, size_t len)
+{
+	const unsigned char *p = (const unsigned char *)buf;
+	void *dst;
+	size_t n;
+
+	while (len>0)
+	{
+		n = (len<r->size/2)?len:r->size/2;
+
+		if ((dst = reserveShmRing(r, n))==NULL)
+			return(-1);
+
+		memcpy(dst, p, n);
+		commitShmRing(r, n);
+
+		p += n;
+		len -= n;
+	}
+
+	return(0);
+}
+
+/*! \brief Wait for data in the ring as the consumer
+ *  \param r Ring
+ *  \param[in] len Number of bytes wanted, at most the ring size
+ *  \param[out] avail Number of bytes available, less than \a len only at the end of the data
+ *  \returns Contiguous data of \a avail bytes
+ */
+const void *peekShmRing(shmring_t *r, size_t len, size_t *avail)
+{
+	return(peekShmRingAt(r, __atomic_load_n(&r->hdr->tail, __ATOMIC_ACQUIRE), len, avail));
+}
+
+/*! \brief Wait for data past bytes that have been peeked but not released yet
+ *  \param r Ring
+ *  \param[in] pos Position of the data as a byte count, at least the tail
+ *  \param[in] len Number of bytes wanted
+ *  \param[out] avail Number of bytes available, less than \a len only at the end of the data
+ *  \returns Contiguous data of \a avail bytes
+ *
+ * Spans are released in the order of their positions. The data up to
+ * \a pos + \a len must fit in the ring together with the unreleased bytes
+ * before \a pos, or the producer can never write it.
+ */
+const void *peekShmRingAt(shmring_t *r, uint64_t pos, size_t len, size_t *avail)
+{
+	shmring_hdr_t *hdr = r->hdr;
+	uint64_t n;
+	uint32_t seq;
+	int closed;
+
+	if (len>r->size)
+		len = r->size;
+
+	while (1)
+	{
+		// The head is read after the closed flag, so no data is missed
+		closed = __atomic_load_n(&hdr->closed, __ATOMIC_SEQ_CST) || processExited(hdr->pid);
+		n = __atomic_load_n(&hdr->head, __ATOMIC_ACQUIRE)-pos;
+
+		if (n>=len || closed)
+			break;
+
+		seq = __atomic_load_n(&hdr->wseq, __ATOMIC_SEQ_CST);
+		__atomic_store_n(&hdr->rwait, 1, __ATOMIC_SEQ_CST);
+
+		if (__atomic_load_n(&hdr->head, __ATOMIC_SEQ_CST)-pos<len && !__atomic_load_n(&hdr->closed, __ATOMIC_SEQ_CST))
+		{
+			waitShmRing(&hdr->wseq, seq);
+			r->nwait++;
+		}
+
+		__atomic_store_n(&hdr->rwait, 0, __ATOMIC_SEQ_CST);
+	}
+
+	*avail = (size_t)((n<len)?n:len);
+
+	return(r->data + pos%r->size);
+}
+
+/*! \brief Free bytes that have been read
+ *  \param r Ring
+ *  \param[in] len Number of bytes
+ */
+void releaseShmRing(shmring_t *r, size_t len)
+{
+	shmring_hdr_t *hdr = r->hdr;
+
+	__atomic_store_n(&hdr->tail, hdr->tail+len, __ATOMIC_SEQ_CST);
+	__atomic_add_fetch(&hdr->rseq, 1, __ATOMIC_SEQ_CST);
+
+	if (__atomic_load_n(&hdr->wwait, __ATOMIC_SEQ_CST))
+		wakeShmRing(&hdr->rseq);
+
+	return;
+}
+
+/*! \brief Copy data out of the ring
+ *  \param r Ring
+ *  \param[out] buf Data
+ *  \param[in] len Number of bytes
+ *  \returns Number of bytes read, less than \a len only at the end of the data
+ */
+size_t readShmRing(shmring_t *r, void *buf, size_t len)
+{
+	unsigned char *p = (unsigned char *)buf;
+	const void *src;
+	size_t n,avail;
+	size_t nread = 0;
+
+	while (len>0)
+	{
+		n = (len<r->size/2)?len:r->size/2;
+
+		src = peekShmRing(r, n, &avail);
+		if (avail==0)
+			break;
+
+		memcpy(p, src, avail);
+		releaseShmRing(r, avail);
+
+		p += avail;
+		len -= avail;
+		nread += avail;
+	}
+
+	return(nread);
+}
@@ -0,0 +1,84 @@
+#ifndef SHMRING_H
+#define SHMRING_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*! \brief Identifier of an initialized ring ("GPSR") */
+#define SHMRING_MAGIC (0x47505352)
+
+/*! \brief Layout version of the ring */
+#define SHMRING_VERSION (1)
+
+/*! \brief Default size of the ring data (0.8 s of SC16 at 20 MHz) */
+#define SHMRING_DEFAULT_SIZE (64*1024*1024)
+
+/*! \brief Longest sleep of a waiting side before it checks the other side again [ms] */
+#define SHMRING_WAIT_MS (100)
+
+/*! \brief Header of a single-producer/single-consumer ring in shared memory
+ *
+ * The head and tail are byte counts that only increase, so the ring is
+ * empty when they are equal and full when they differ by the data size.
+ * Each side only writes its own counter. The sequence numbers are bumped
+ * after every update and are used as futex words by the side waiting for
+ * the other. The data starts on the page after the header.
+ */
+typedef struct
+{
+	uint32_t magic;	/*!< SHMRING_MAGIC once the producer has initialized the ring */
+	uint32_t version;
+	uint64_t size;	/*!< Size of the data in bytes, a multiple of the page size */
+	int32_t bits;	/*!< I/Q data format of the samples (1, 8 or 16) */
+	int32_t pid;	/*!< Process ID of the producer */
+	double samp_freq;	/*!< Sampling frequency [Hz] */
+
+	// Written by the producer
+	uint64_t head __attribute__((aligned(64)));	/*!< Number of bytes written */
+	uint32_t wseq;	/*!< Bumped after every update of the head */
+	uint32_t closed;	/*!< The producer has written the last byte */
+	uint32_t wwait;	/*!< The producer is waiting for space */
+
+	// Written by the consumer
+	uint64_t tail __attribute__((aligned(64)));	/*!< Number of bytes read */
+	uint32_t rseq;	/*!< Bumped after every update of the tail */
+	uint32_t rwait;	/*!< The consumer is waiting for data */
+	int32_t cpid;	/*!< Process ID of the consumer, 0 until it has attached */
+} shmring_hdr_t;
+
+/*! \brief Mapping of a ring in one process */
+typedef struct
+{
+	char name[256];
+	int fd;
+	int producer;	/*!< The ring was created by this process */
+	shmring_hdr_t *hdr;
+	unsigned char *data;	/*!< Data mapped twice in a row, so any span is contiguous */
+	uint64_t size;
+	size_t hdr_size;	/*!< Size of the header mapping, one page */
+	uint64_t nwait;	/*!< Number of waits for the other side */
+} shmring_t;
+
+int createShmRing(shmring_t *r, const char *name, uint64_t size, int bits, double samp_freq);
+int openShmRing(shmring_t *r, const char *name, int timeout_ms);
+int finishShmRing(shmring_t *r);
+void closeShmRing(shmring_t *r);
+
+void *reserveShmRing(shmring_t *r, size_t len);
+void commitShmRing(shmring_t *r, size_t len);
+int writeShmRing(shmring_t *r, const void *buf, size_t len);
+
+const void *peekShmRing(shmring_t *r, size_t len, size_t *avail);
+const void *peekShmRingAt(shmring_t *r, uint64_t pos, size_t len, size_t *avail);
+void releaseShmRing(shmring_t *r, size_t len);
+size_t readShmRing(shmring_t *r, void *buf, size_t len);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif